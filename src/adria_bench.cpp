@@ -0,0 +1,422 @@
+#include <base.h>
+#include <utils.h>
+#include <history.h>
+
+using namespace TAdriaUtils;
+using namespace TAdriaHistory;
+
+// Benchmarks the history reply encodings and checks that they carry the same
+// data. The txt, f32 and q encodings of a generated series are decoded again
+// and compared to the samples, and THistCodec::AddFlt is compared to
+// printf("%g") over a range of magnitudes. Exits with 1 if anything differs.
+
+PNotify Notify = TStdNotify::New();
+
+/////////////////////////////////////////////////////////
+// History codec benchmark
+class TCodecBench {
+private:
+	const static int MX_REPORTED;
+
+	// configuration
+	const int Points;
+	const int Reps;
+	const int Decimals;
+	const int FltChecks;
+
+	TRnd Rnd;
+	TUInt64FltKdV HistV;	// newest first, as in the replies
+	TTmBucketV BucketV;		// newest first
+
+	int Mismatches;
+
+public:
+	TCodecBench(const TEnv& Env);
+
+	// returns true if all the checks passed
+	bool Run();
+
+private:
+	void GenSeries();
+
+	void CheckFlt();
+	void CheckFlt(const double& Val);
+	void CheckEnc(const THistEnc& Enc);
+	void CheckRollupEnc(const THistEnc& Enc);
+
+	void BenchEnc(const THistEnc& Enc);
+	void BenchRollupEnc(const THistEnc& Enc);
+	void BenchFlt();
+
+	// decoders of the binary encodings, see THistCodec
+	static uint64 GetVarInt(const TChA& InChA, int& ChN);
+	static double GetVal(const TChA& InChA, const THistEnc& Enc, const double& Scale,
+			int64& PrevQuant, int& ChN);
+	static void Decode(const TChA& InChA, TUInt64FltKdV& OutV);
+	static void Decode(const TChA& InChA, TTmBucketV& OutV);
+	static void DecodeTxt(const TChA& InChA, TFltV& ValV);
+
+	void OnMismatch(const TStr& MsgStr);
+};
+
+const int TCodecBench::MX_REPORTED = 10;
+
+TCodecBench::TCodecBench(const TEnv& Env):
+		Points(Env.GetIfArgPrefixInt("-points=", 100000, "Samples in the generated series")),
+		Reps(Env.GetIfArgPrefixInt("-reps=", 20, "Encodings of the series per measurement")),
+		Decimals(Env.GetIfArgPrefixInt("-dec=", 2, "Decimals kept by the q encoding")),
+		FltChecks(Env.GetIfArgPrefixInt("-flt_checks=", 1000000, "Random values compared to %g")),
+		Rnd(Env.GetIfArgPrefixInt("-seed=", 1, "Random seed")),
+		HistV(),
+		BucketV(),
+		Mismatches(0) {
+
+	EAssertR(Points > 0 && Reps > 0, "-points= and -reps= must be positive!");
+	EAssertR(0 <= Decimals && Decimals <= 9, "-dec= must be between 0 and 9!");
+}
+
+bool TCodecBench::Run() {
+	GenSeries();
+
+	Notify->OnNotifyFmt(TNotifyType::ntInfo, "Series of %d samples, %d buckets, %d repetitions", HistV.Len(),
+			BucketV.Len(), Reps);
+
+	CheckFlt();
+	for (int EncN = hetTxt; EncN <= hetQuant; EncN++) {
+		CheckEnc((THistEnc) EncN);
+		CheckRollupEnc((THistEnc) EncN);
+	}
+
+	BenchFlt();
+	for (int EncN = hetTxt; EncN <= hetQuant; EncN++) {
+		BenchEnc((THistEnc) EncN);
+	}
+	for (int EncN = hetTxt; EncN <= hetQuant; EncN++) {
+		BenchRollupEnc((THistEnc) EncN);
+	}
+
+	if (Mismatches > 0) {
+		Notify->OnNotifyFmt(TNotifyType::ntErr, "%d mismatches!", Mismatches);
+		return false;
+	}
+
+	Notify->OnNotify(TNotifyType::ntInfo, "All the encodings match.");
+	return true;
+}
+
+void TCodecBench::GenSeries() {
+	// a sensor which reports two decimals once a minute and drifts
+	TTmSeries Series;
+	double Val = 20;
+	for (int SampleN = 0; SampleN < Points; SampleN++) {
+		Val += Rnd.GetNrmDev() * 0.1;
+		Series.Add(uint64(1400000000000) + uint64(SampleN) * 60000, floor(Val * 100 + 0.5) / 100);
+	}
+
+	Series.GetNewestFirst(HistV);
+	Series.GetNewestFirst(TTmSeries::RES_RAW+1, BucketV);
+}
+
+void TCodecBench::CheckFlt() {
+	const int StartMismatches = Mismatches;
+
+	const double EdgeValV[] = { 0, -0.0, 1, -1, 0.1, 1e-4, 9.9999995e-5, 0.00012345675, 999999.4,
+			999999.5, 1e6, 123456.5, 99999.95, 0.5, 1.5, 2.5, 1e-10, 1e20, 3.4028235e38 };
+	for (int ValN = 0; ValN < (int) (sizeof(EdgeValV) / sizeof(double)); ValN++) {
+		CheckFlt(EdgeValV[ValN]);
+	}
+
+	// random mantissas over the whole fast path and a bit outside of it
+	for (int CheckN = 0; CheckN < FltChecks; CheckN++) {
+		const double Mantissa = Rnd.GetUniDev() * 10;
+		const int Exp = Rnd.GetUniDevInt(-6, 7);
+		const double Sign = Rnd.GetUniDevInt(2) == 0 ? 1 : -1;
+		CheckFlt(Sign * Mantissa * pow(10.0, Exp));
+
+		// the readings are floats with a few decimals
+		CheckFlt((float) (floor(Mantissa * pow(10.0, Exp + 2) + 0.5) / 100));
+	}
+
+	// the samples of the series
+	for (int SampleN = 0; SampleN < HistV.Len(); SampleN++) {
+		CheckFlt(HistV[SampleN].Dat);
+	}
+
+	Notify->OnNotifyFmt(TNotifyType::ntInfo, "AddFlt vs %%g: %d mismatches", Mismatches - StartMismatches);
+}
+
+void TCodecBench::CheckFlt(const double& Val) {
+	TChA FltChA;	THistCodec::AddFlt(Val, FltChA);
+
+	char Bf[32];
+	snprintf(Bf, sizeof(Bf), "%g", Val);
+
+	if (strcmp(FltChA.CStr(), Bf) != 0) {
+		OnMismatch(TStr::Fmt("AddFlt(%.17g) = %s, %%g = %s", Val, FltChA.CStr(), Bf));
+	}
+}
+
+void TCodecBench::CheckEnc(const THistEnc& Enc) {
+	const int StartMismatches = Mismatches;
+	const double Scale = pow(10.0, Decimals);
+
+	TChA OutChA;	THistCodec::Encode(HistV, Enc, Decimals, OutChA);
+
+	TUInt64FltKdV DecV;
+	if (Enc == hetTxt) {
+		TFltV ValV;	DecodeTxt(OutChA, ValV);
+		for (int ValN = 0; ValN+1 < ValV.Len(); ValN += 2) {
+			DecV.Add(TUInt64FltKd((uint64) ValV[ValN], ValV[ValN+1]));
+		}
+	} else {
+		Decode(OutChA, DecV);
+	}
+
+	if (DecV.Len() != HistV.Len()) {
+		OnMismatch(TStr::Fmt("%s: decoded %d of %d samples", THistCodec::GetEncNm(Enc), DecV.Len(), HistV.Len()));
+		return;
+	}
+
+	for (int SampleN = 0; SampleN < HistV.Len(); SampleN++) {
+		const TUInt64FltKd& Sample = HistV[SampleN];
+		const TUInt64FltKd& DecSample = DecV[SampleN];
+
+		// what each encoding is expected to preserve
+		double ExpVal;
+		if (Enc == hetTxt) {
+			char Bf[32];	snprintf(Bf, sizeof(Bf), "%g", Sample.Dat.Val);
+			ExpVal = atof(Bf);
+		} else if (Enc == hetF32) {
+			ExpVal = (float) Sample.Dat;
+		} else {
+			ExpVal = double(llround(Sample.Dat * Scale)) / Scale;
+		}
+
+		if (DecSample.Key != Sample.Key || fabs(DecSample.Dat - ExpVal) > 1e-9 * TMath::Mx(1.0, fabs(ExpVal))) {
+			OnMismatch(TStr::Fmt("%s: sample %d is %s,%.17g, expected %s,%.17g", THistCodec::GetEncNm(Enc), SampleN,
+					TUInt64::GetStr(DecSample.Key).CStr(), DecSample.Dat.Val, TUInt64::GetStr(Sample.Key).CStr(), ExpVal));
+		}
+	}
+
+	Notify->OnNotifyFmt(TNotifyType::ntInfo, "raw %s: %d mismatches", THistCodec::GetEncNm(Enc),
+			Mismatches - StartMismatches);
+}
+
+void TCodecBench::CheckRollupEnc(const THistEnc& Enc) {
+	const int StartMismatches = Mismatches;
+	const double Scale = pow(10.0, Decimals);
+
+	TChA OutChA;	THistCodec::Encode(BucketV, Enc, Decimals, OutChA);
+
+	TTmBucketV DecV;
+	if (Enc == hetTxt) {
+		TFltV ValV;	DecodeTxt(OutChA, ValV);
+		for (int ValN = 0; ValN+4 < ValV.Len(); ValN += 5) {
+			TTmBucket Bucket;
+			Bucket.StartTm = (uint64) ValV[ValN];
+			Bucket.Avg = (float) ValV[ValN+1];
+			Bucket.Mn = (float) ValV[ValN+2];
+			Bucket.Mx = (float) ValV[ValN+3];
+			Bucket.Count = (int) ValV[ValN+4];
+			DecV.Add(Bucket);
+		}
+	} else {
+		Decode(OutChA, DecV);
+	}
+
+	if (DecV.Len() != BucketV.Len()) {
+		OnMismatch(TStr::Fmt("%s: decoded %d of %d buckets", THistCodec::GetEncNm(Enc), DecV.Len(), BucketV.Len()));
+		return;
+	}
+
+	for (int BucketN = 0; BucketN < BucketV.Len(); BucketN++) {
+		const TTmBucket& Bucket = BucketV[BucketN];
+		const TTmBucket& DecBucket = DecV[BucketN];
+
+		const float FieldV[] = { Bucket.Avg, Bucket.Mn, Bucket.Mx };
+		const float DecFieldV[] = { DecBucket.Avg, DecBucket.Mn, DecBucket.Mx };
+
+		bool Ok = DecBucket.StartTm == Bucket.StartTm && DecBucket.Count == Bucket.Count;
+		for (int FieldN = 0; FieldN < 3 && Ok; FieldN++) {
+			double ExpVal;
+			if (Enc == hetTxt) {
+				char Bf[32];	snprintf(Bf, sizeof(Bf), "%g", (double) FieldV[FieldN]);
+				ExpVal = (float) atof(Bf);
+			} else if (Enc == hetF32) {
+				ExpVal = FieldV[FieldN];
+			} else {
+				ExpVal = (float) (double(llround(FieldV[FieldN] * Scale)) / Scale);
+			}
+			Ok = DecFieldV[FieldN] == (float) ExpVal;
+		}
+
+		if (!Ok) {
+			OnMismatch(TStr::Fmt("%s: bucket %d at %s differs", THistCodec::GetEncNm(Enc), BucketN,
+					TUInt64::GetStr(Bucket.StartTm).CStr()));
+		}
+	}
+
+	Notify->OnNotifyFmt(TNotifyType::ntInfo, "rollup %s: %d mismatches", THistCodec::GetEncNm(Enc),
+			Mismatches - StartMismatches);
+}
+
+void TCodecBench::BenchEnc(const THistEnc& Enc) {
+	TChA OutChA;
+
+	const uint64 StartTm = TUtils::GetCurrTimeMicros();
+	for (int RepN = 0; RepN < Reps; RepN++) {
+		OutChA.Clr();
+		THistCodec::Encode(HistV, Enc, Decimals, OutChA);
+	}
+	const double Secs = TMath::Mx(double(TUtils::GetCurrTimeMicros() - StartTm) / 1e6, 1e-6);
+
+	Notify->OnNotifyFmt(TNotifyType::ntInfo, "raw %-3s %8d bytes %6.2f B/sample %7.1f ns/sample %8.1f MB/s",
+			THistCodec::GetEncNm(Enc), OutChA.Len(), double(OutChA.Len()) / HistV.Len(),
+			Secs * 1e9 / Reps / HistV.Len(), double(OutChA.Len()) * Reps / Secs / (1024*1024));
+}
+
+void TCodecBench::BenchRollupEnc(const THistEnc& Enc) {
+	TChA OutChA;
+
+	// the rollups are short, encode them as often as it takes to cover the samples
+	const int BucketReps = Reps * TMath::Mx(HistV.Len() / TMath::Mx(BucketV.Len(), 1), 1);
+
+	const uint64 StartTm = TUtils::GetCurrTimeMicros();
+	for (int RepN = 0; RepN < BucketReps; RepN++) {
+		OutChA.Clr();
+		THistCodec::Encode(BucketV, Enc, Decimals, OutChA);
+	}
+	const double Secs = TMath::Mx(double(TUtils::GetCurrTimeMicros() - StartTm) / 1e6, 1e-6);
+
+	Notify->OnNotifyFmt(TNotifyType::ntInfo, "1h  %-3s %8d bytes %6.2f B/bucket %7.1f ns/bucket %8.1f MB/s",
+			THistCodec::GetEncNm(Enc), OutChA.Len(), double(OutChA.Len()) / TMath::Mx(BucketV.Len(), 1),
+			Secs * 1e9 / BucketReps / TMath::Mx(BucketV.Len(), 1), double(OutChA.Len()) * BucketReps / Secs / (1024*1024));
+}
+
+void TCodecBench::BenchFlt() {
+	TChA OutChA;
+	char Bf[32];
+
+	uint64 StartTm = TUtils::GetCurrTimeMicros();
+	for (int RepN = 0; RepN < Reps; RepN++) {
+		OutChA.Clr();
+		for (int SampleN = 0; SampleN < HistV.Len(); SampleN++) {
+			THistCodec::AddFlt(HistV[SampleN].Dat, OutChA);
+		}
+	}
+	const double FltSecs = TMath::Mx(double(TUtils::GetCurrTimeMicros() - StartTm) / 1e6, 1e-6);
+
+	StartTm = TUtils::GetCurrTimeMicros();
+	for (int RepN = 0; RepN < Reps; RepN++) {
+		OutChA.Clr();
+		for (int SampleN = 0; SampleN < HistV.Len(); SampleN++) {
+			snprintf(Bf, sizeof(Bf), "%g", HistV[SampleN].Dat.Val);
+			OutChA += Bf;
+		}
+	}
+	const double PrintfSecs = TMath::Mx(double(TUtils::GetCurrTimeMicros() - StartTm) / 1e6, 1e-6);
+
+	const double Values = double(Reps) * HistV.Len();
+	Notify->OnNotifyFmt(TNotifyType::ntInfo, "AddFlt %.1f ns/value, %%g %.1f ns/value (%.1fx)",
+			FltSecs * 1e9 / Values, PrintfSecs * 1e9 / Values, PrintfSecs / FltSecs);
+}
+
+uint64 TCodecBench::GetVarInt(const TChA& InChA, int& ChN) {
+	uint64 Val = 0;
+	int Shift = 0;
+	while (ChN < InChA.Len()) {
+		const uchar Ch = (uchar) InChA[ChN++];
+		Val |= uint64(Ch & 0x7F) << Shift;
+		if ((Ch & 0x80) == 0) { break; }
+		Shift += 7;
+	}
+	return Val;
+}
+
+double TCodecBench::GetVal(const TChA& InChA, const THistEnc& Enc, const double& Scale,
+		int64& PrevQuant, int& ChN) {
+
+	if (Enc == hetF32) {
+		float Val;
+		memcpy(&Val, InChA.CStr() + ChN, sizeof(float));
+		ChN += (int) sizeof(float);
+		return Val;
+	}
+
+	const uint64 ZigZag = GetVarInt(InChA, ChN);
+	const int64 Delta = int64(ZigZag >> 1) ^ -int64(ZigZag & 1);
+	PrevQuant += Delta;
+	return double(PrevQuant) / Scale;
+}
+
+void TCodecBench::Decode(const TChA& InChA, TUInt64FltKdV& OutV) {
+	int ChN = 0;
+	const THistEnc Enc = (THistEnc) InChA[ChN++];
+	const double Scale = pow(10.0, (int) InChA[ChN++]);
+	const int Points = (int) GetVarInt(InChA, ChN);
+
+	uint64 Tm = 0;
+	int64 PrevQuant = 0;
+	for (int PointN = 0; PointN < Points && ChN < InChA.Len(); PointN++) {
+		const uint64 TmVal = GetVarInt(InChA, ChN);
+		Tm = PointN == 0 ? TmVal : Tm - TmVal;
+		const double Val = GetVal(InChA, Enc, Scale, PrevQuant, ChN);
+		OutV.Add(TUInt64FltKd(Tm, Val));
+	}
+}
+
+void TCodecBench::Decode(const TChA& InChA, TTmBucketV& OutV) {
+	int ChN = 0;
+	const THistEnc Enc = (THistEnc) InChA[ChN++];
+	const double Scale = pow(10.0, (int) InChA[ChN++]);
+	const int Points = (int) GetVarInt(InChA, ChN);
+
+	uint64 Tm = 0;
+	int64 PrevAvg = 0, PrevMn = 0, PrevMx = 0;
+	for (int PointN = 0; PointN < Points && ChN < InChA.Len(); PointN++) {
+		const uint64 TmVal = GetVarInt(InChA, ChN);
+		Tm = PointN == 0 ? TmVal : Tm - TmVal;
+
+		TTmBucket Bucket;
+		Bucket.StartTm = Tm;
+		Bucket.Avg = (float) GetVal(InChA, Enc, Scale, PrevAvg, ChN);
+		Bucket.Mn = (float) GetVal(InChA, Enc, Scale, PrevMn, ChN);
+		Bucket.Mx = (float) GetVal(InChA, Enc, Scale, PrevMx, ChN);
+		Bucket.Count = (int) GetVarInt(InChA, ChN);
+		OutV.Add(Bucket);
+	}
+}
+
+void TCodecBench::DecodeTxt(const TChA& InChA, TFltV& ValV) {
+	const char* Bf = InChA.CStr();
+	const char* EndBf = Bf + InChA.Len();
+	while (Bf < EndBf) {
+		char* NumEnd;
+		ValV.Add(strtod(Bf, &NumEnd));
+		if (NumEnd == Bf) { break; }
+		Bf = NumEnd + 1;
+	}
+}
+
+void TCodecBench::OnMismatch(const TStr& MsgStr) {
+	if (Mismatches < MX_REPORTED) {
+		Notify->OnNotify(TNotifyType::ntWarn, MsgStr);
+	}
+	Mismatches++;
+}
+
+int main(int argc, char* argv[]) {
+	try {
+		Env = TEnv(argc, argv, Notify);
+		Env.SetNoLine();
+
+		TCodecBench Bench(Env);
+		return Bench.Run() ? 0 : 1;
+	} catch (const PExcept& Except) {
+		Notify->OnNotify(TNotifyType::ntErr, Except->GetMsgStr());
+		return 2;
+	} catch (...) {
+		Notify->OnNotify(TNotifyType::ntErr, "Unknown exception, exiting...");
+		return 2;
+	}
+}
@@ -0,0 +1,617 @@
+#include <base.h>
+#include <thread.h>
+#include <utils.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+
+using namespace TAdriaUtils;
+
+// A stand-in for the UMKO bus, used to load and soak test aminer on a single
+// machine. Accepts a single aminer connection, pushes generated res_table
+// updates and issues GET history, prediction and stats requests while measuring
+// the throughput and response latency. It also subscribes to the history of a
+// few CAN IDs and counts the pushed updates.
+
+PNotify Notify = TStdNotify::New();
+
+/////////////////////////////////////////////////////////
+// Mock Adria bus
+class TMockBus {
+private:
+	// a thread which generates the traffic towards aminer
+	class TGenThread: public TThread {
+	private:
+		TMockBus* Bus;
+	public:
+		TGenThread(TMockBus* _Bus): Bus(_Bus) {}
+		void Run() { Bus->Generate(); }
+	};
+
+	const static int READ_BUFF_LEN;
+	const static TStr REQ_ID_PREFIX;
+	const static TChA SUB_COMPONENT_ID;
+
+	// configuration
+	const int PortN;
+	const double PushRate;
+	const int TblWidth;
+	const double HistRate;
+	const TStr HistParamStr;
+	const int HistBatch;
+	const int HistSubs;
+	const double PredRate;
+	const double StatsRate;
+	const int DurationSecs;
+	const bool AcceptBinary;
+
+	TIntV CanIdV;
+	TIntV SubCanIdV;		// CAN IDs with subscribed history
+	TFltV CanCdfV;			// cumulative distribution of the CAN IDs
+	TFltV CanValV;			// current value of each CAN ID
+
+	int ListenFd;
+	int ClientFd;
+
+	TAdriaMsgParser Parser;
+	TRnd Rnd;
+	// switched by the reader, frames are encoded and sent under SendSection
+	// so none of them is encoded in one framing and sent after the switch
+	bool BinaryFraming;
+	// set by the reader, the generator owns the values and sends the table
+	volatile bool TableRequested;
+	volatile bool Running;
+
+	// pending requests, the request ID is sent as the component ID
+	int NextReqId;
+	THash<TInt, TUInt64> ReqIdSendTmH;
+	TUInt64V PredSendTmV;
+
+	// statistics
+	uint64 StartTm;
+	uint64 PushesSent;
+	uint64 EntriesSent;
+	uint64 BytesSent;
+	uint64 MsgsRecv;
+	uint64 BytesRecv;
+	uint64 RequestsSent;
+	TUInt64V HistLatV;
+	uint64 HistBytes;
+	uint64 HistSnapshotsRecv;
+	uint64 HistUpdatesRecv;
+	TUInt64V PredLatV;
+	TUInt64V StatsLatV;
+
+	TCriticalSection SendSection;
+	TCriticalSection StatSection;
+
+public:
+	TMockBus(const TEnv& Env);
+	~TMockBus();
+
+	void Run();
+
+private:
+	void Listen();
+	void ReadHandshake();
+	void Read();
+	void OnMsg(const TAdriaMsg& Msg);
+
+	void Generate();
+	void AddPush(const int& NEntries, TMem& Out);
+	void AddRequest(const TChA& Command, const TChA& Params, TMem& Out);
+	// subscribes to or unsubscribes from the history of SubCanIdV
+	void AddSubRequest(const TChA& Command, TMem& Out);
+	int SampleCanId();
+
+	void Send(const TMem& Out);
+	void SendMsg(const TAdriaMsgMethod& Method, const TChA& Command, const TChA& ComponentId, const TChView& Content);
+
+	void ReportProgress(const uint64& ElapsedMicros, const uint64& PrevPushes, const uint64& PrevBytes);
+	void ReportFinal();
+	void ReportLatency(const TStr& Nm, TUInt64V& LatV) const;
+	static uint64 GetPercentile(const TUInt64V& SortedV, const double& Perc);
+};
+
+const int TMockBus::READ_BUFF_LEN = 64*1024;
+const TStr TMockBus::REQ_ID_PREFIX = "mock";
+const TChA TMockBus::SUB_COMPONENT_ID = "subscriber";
+
+TMockBus::TMockBus(const TEnv& Env):
+		PortN(Env.GetIfArgPrefixInt("-port=", 8080, "Port number")),
+		PushRate(Env.GetIfArgPrefixFlt("-push_rate=", 100, "res_table pushes per second")),
+		TblWidth(Env.GetIfArgPrefixInt("-width=", 8, "Entries per res_table push")),
+		HistRate(Env.GetIfArgPrefixFlt("-hist_rate=", 1, "GET history requests per second")),
+		HistParamStr(Env.GetIfArgPrefixStr("-hist_params=", "", "Parameters appended to GET history, e.g. ;enc=q;points=500")),
+		HistBatch(Env.GetIfArgPrefixInt("-hist_batch=", 1, "CAN IDs per GET history request")),
+		HistSubs(Env.GetIfArgPrefixInt("-hist_subs=", 2, "CAN IDs to subscribe to with GET history_sub")),
+		PredRate(Env.GetIfArgPrefixFlt("-pred_rate=", 0.1, "GET prediction requests per second")),
+		StatsRate(Env.GetIfArgPrefixFlt("-stats_rate=", 0.2, "GET stats requests per second")),
+		DurationSecs(Env.GetIfArgPrefixInt("-duration=", 60, "Duration of the test in seconds")),
+		AcceptBinary(Env.GetIfArgPrefixBool("-binary=", true, "Accept the binary framing")),
+		CanIdV(),
+		SubCanIdV(),
+		CanCdfV(),
+		CanValV(256, 256),
+		ListenFd(-1),
+		ClientFd(-1),
+		Parser(Notify),
+		Rnd(0),
+		BinaryFraming(false),
+		TableRequested(false),
+		Running(false),
+		NextReqId(0),
+		ReqIdSendTmH(),
+		PredSendTmV(),
+		StartTm(0),
+		PushesSent(0),
+		EntriesSent(0),
+		BytesSent(0),
+		MsgsRecv(0),
+		BytesRecv(0),
+		RequestsSent(0),
+		HistLatV(),
+		HistBytes(0),
+		HistSnapshotsRecv(0),
+		HistUpdatesRecv(0),
+		PredLatV(),
+		StatsLatV(),
+		SendSection(TCriticalSectionType::cstRecursive),
+		StatSection(TCriticalSectionType::cstRecursive) {
+
+	const TStr CanIdsStr = Env.GetIfArgPrefixStr("-cans=",
+			"103,104,106,108,109,122,123,124,147,148,149,159,160,161", "CAN IDs to push");
+	const TStr CanDistStr = Env.GetIfArgPrefixStr("-can_dist=", "uniform", "CAN ID distribution: uniform, zipf or hot");
+
+	TStrV CanIdStrV;	CanIdsStr.SplitOnAllCh(',', CanIdStrV);
+	for (int i = 0; i < CanIdStrV.Len(); i++) {
+		// a CAN ID is sent as a single byte
+		int CanId;
+		EAssertR(CanIdStrV[i].IsInt(CanId) && 0 <= CanId && CanId < CanValV.Len(),
+				TStr::Fmt("Invalid CAN ID in -cans=: %s, expected 0 to %d!", CanIdStrV[i].CStr(), CanValV.Len()-1));
+		CanIdV.Add(CanId);
+	}
+
+	EAssertR(!CanIdV.Empty(), "No CAN IDs to push!");
+
+	for (int i = 0; i < TMath::Mn(HistSubs, CanIdV.Len()); i++) {
+		SubCanIdV.Add(CanIdV[i]);
+	}
+
+	// weights of the CAN IDs
+	const int NCans = CanIdV.Len();
+	TFltV WgtV(NCans, 0);
+	for (int i = 0; i < NCans; i++) {
+		if (CanDistStr == "zipf") {
+			WgtV.Add(1.0 / (i+1));
+		} else if (CanDistStr == "hot") {
+			// the first ID gets 80% of the updates
+			WgtV.Add(i == 0 ? 0.8 * NCans : 0.2 * NCans / TMath::Mx(NCans-1, 1));
+		} else {
+			WgtV.Add(1);
+		}
+	}
+
+	double WgtSum = 0;
+	for (int i = 0; i < NCans; i++) { WgtSum += WgtV[i]; }
+
+	double CumWgt = 0;
+	for (int i = 0; i < NCans; i++) {
+		CumWgt += WgtV[i];
+		CanCdfV.Add(CumWgt / WgtSum);
+	}
+
+	for (int i = 0; i < CanValV.Len(); i++) {
+		CanValV[i] = 50;
+	}
+}
+
+TMockBus::~TMockBus() {
+	if (ClientFd >= 0) { close(ClientFd); }
+	if (ListenFd >= 0) { close(ListenFd); }
+}
+
+void TMockBus::Run() {
+	Listen();
+
+	Notify->OnNotifyFmt(TNotifyType::ntInfo, "Waiting for aminer on port %d...", PortN);
+
+	ClientFd = accept(ListenFd, NULL, NULL);
+	EAssertR(ClientFd >= 0, "Failed to accept connection!");
+
+	int NoDelay = 1;
+	setsockopt(ClientFd, IPPROTO_TCP, TCP_NODELAY, &NoDelay, sizeof(NoDelay));
+
+	Notify->OnNotify(TNotifyType::ntInfo, "aminer connected, waiting for the handshake...");
+
+	ReadHandshake();
+
+	StartTm = TUtils::GetCurrTimeMicros();
+	Running = true;
+
+	PThread GenThread = new TGenThread(this);
+	GenThread->Start();
+
+	Read();
+
+	Running = false;
+	GenThread->Join();
+
+	ReportFinal();
+}
+
+void TMockBus::Listen() {
+	ListenFd = socket(AF_INET, SOCK_STREAM, 0);
+	EAssertR(ListenFd >= 0, "Failed to create socket!");
+
+	int Reuse = 1;
+	setsockopt(ListenFd, SOL_SOCKET, SO_REUSEADDR, &Reuse, sizeof(Reuse));
+
+	sockaddr_in Addr;
+	memset(&Addr, 0, sizeof(Addr));
+	Addr.sin_family = AF_INET;
+	Addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	Addr.sin_port = htons(PortN);
+
+	EAssertR(bind(ListenFd, (sockaddr*) &Addr, sizeof(Addr)) == 0, "Failed to bind socket!");
+	EAssertR(listen(ListenFd, 1) == 0, "Failed to listen on socket!");
+}
+
+void TMockBus::ReadHandshake() {
+	// the handshake is a single line which lists the subscriptions, it
+	// doesn't follow the message framing so it's read by character before
+	// anything is fed to the parser
+	TChA LineChA;
+	char Ch;
+	while (true) {
+		EAssertR(recv(ClientFd, &Ch, 1, 0) == 1, "Connection closed during the handshake!");
+
+		if (Ch == '\n') { break; }
+		if (Ch != '\r') { LineChA += Ch; }
+	}
+
+	Notify->OnNotifyFmt(TNotifyType::ntInfo, "Handshake: %s", LineChA.CStr());
+}
+
+void TMockBus::Read() {
+	char* Bf = new char[READ_BUFF_LEN];
+	TAdriaMsg Msg(Notify);
+
+	while (Running) {
+		const int BfL = (int) recv(ClientFd, Bf, READ_BUFF_LEN, 0);
+		if (BfL <= 0) {
+			Notify->OnNotify(TNotifyType::ntInfo, "aminer disconnected.");
+			break;
+		}
+
+		BytesRecv += BfL;
+		Parser.Feed(Bf, BfL);
+
+		while (true) {
+			try {
+				if (!Parser.Next(Msg)) { break; }
+				MsgsRecv++;
+				OnMsg(Msg);
+			} catch (const PExcept& Except) {
+				Notify->OnNotifyFmt(TNotifyType::ntErr, "Failed to parse frame: %s", Except->GetMsgStr().CStr());
+			}
+		}
+	}
+
+	delete[] Bf;
+}
+
+void TMockBus::OnMsg(const TAdriaMsg& Msg) {
+	const uint64 CurrTm = TUtils::GetCurrTimeMicros();
+
+	if (Msg.IsGet() && Msg.GetCommand() == TAdriaMsg::FRAMING) {
+		// answer the negotiation in the current framing, then switch
+		const TChA& FramingChA = AcceptBinary ? TAdriaMsg::FRAMING_BINARY : TChA("text");
+		{
+			TLock Lock(SendSection);
+			SendMsg(TAdriaMsgMethod::ammPush, TAdriaMsg::FRAMING, TChA(), FramingChA);
+			BinaryFraming = AcceptBinary;
+		}
+		Notify->OnNotifyFmt(TNotifyType::ntInfo, "Framing: %s", FramingChA.CStr());
+	} else if (Msg.IsGet() && Msg.GetCommand() == TAdriaMsg::RES_TABLE) {
+		// the generator sends the whole table on its next tick
+		TableRequested = true;
+	} else if (Msg.IsPush() && Msg.GetCommand() == TAdriaMsg::RES_TABLE) {
+		// predictions come back as res_table pushes, they answer all pending requests
+		TLock Lock(StatSection);
+		for (int i = 0; i < PredSendTmV.Len(); i++) {
+			PredLatV.Add(CurrTm - PredSendTmV[i]);
+		}
+		PredSendTmV.Clr(false);
+	} else if (Msg.IsPush() && Msg.GetCommand() == TAdriaMsg::HISTORY && Msg.GetComponentId() == SUB_COMPONENT_ID) {
+		// the snapshot sent on subscribing and then the updates
+		TLock Lock(StatSection);
+		if (Msg.GetParams().GetStr().SearchStr(";update=1") != -1) {
+			HistUpdatesRecv++;
+		} else {
+			HistSnapshotsRecv++;
+		}
+	} else if (Msg.IsPush() && (Msg.GetCommand() == TAdriaMsg::HISTORY || Msg.GetCommand() == TAdriaMsg::STATS)) {
+		const TChView& ComponentId = Msg.GetComponentId();
+		const int PrefixLen = REQ_ID_PREFIX.Len();
+		if (ComponentId.Len() <= PrefixLen) { return; }
+
+		const int ReqId = TChView(ComponentId.GetBf() + PrefixLen, ComponentId.Len() - PrefixLen).GetInt();
+
+		TLock Lock(StatSection);
+		if (ReqIdSendTmH.IsKey(ReqId)) {
+			const uint64 LatMicros = CurrTm - ReqIdSendTmH.GetDat(ReqId);
+			if (Msg.GetCommand() == TAdriaMsg::HISTORY) {
+				HistLatV.Add(LatMicros);
+				HistBytes += Msg.GetContent().Len();
+			} else {
+				StatsLatV.Add(LatMicros);
+			}
+			ReqIdSendTmH.DelKey(ReqId);
+		}
+	} else if (Msg.IsPush() && Msg.GetCommand() == TAdriaMsg::RULES) {
+		Notify->OnNotifyFmt(TNotifyType::ntInfo, "Received rules, length: %d", Msg.GetContent().Len());
+	} else {
+		Notify->OnNotifyFmt(TNotifyType::ntWarn, "Unexpected message: %s", Msg.GetStr().CStr());
+	}
+}
+
+void TMockBus::Generate() {
+	const uint64 EndTm = StartTm + uint64(DurationSecs) * 1000000;
+
+	const double PushPeriod = PushRate > 0 ? 1e6 / PushRate : 0;
+	const double HistPeriod = HistRate > 0 ? 1e6 / HistRate : 0;
+	const double PredPeriod = PredRate > 0 ? 1e6 / PredRate : 0;
+	const double StatsPeriod = StatsRate > 0 ? 1e6 / StatsRate : 0;
+
+	double NextPushTm = StartTm, NextHistTm = StartTm, NextPredTm = StartTm, NextStatsTm = StartTm;
+	uint64 NextReportTm = StartTm + 1000000;
+	uint64 PrevPushes = 0, PrevBytes = 0;
+
+	TMem Out;
+
+	if (!SubCanIdV.Empty()) {
+		TLock Lock(SendSection);
+		AddSubRequest(TAdriaMsg::HISTORY_SUB, Out);
+		Send(Out);
+	}
+
+	while (Running) {
+		const uint64 CurrTm = TUtils::GetCurrTimeMicros();
+		if (CurrTm >= EndTm) { break; }
+
+		// everything due in this tick goes out in a single send
+		bool SendFailed = false;
+		{
+			TLock Lock(SendSection);
+			Out.Clr(false);
+
+			if (TableRequested) {
+				TableRequested = false;
+				AddPush(CanIdV.Len(), Out);
+			}
+			while (PushPeriod > 0 && NextPushTm <= CurrTm) {
+				AddPush(TblWidth, Out);
+				NextPushTm += PushPeriod;
+			}
+			while (HistPeriod > 0 && NextHistTm <= CurrTm) {
+				TChA ParamChA;
+				for (int CanN = 0; CanN < HistBatch; CanN++) {
+					if (CanN > 0) { ParamChA += ','; }
+					ParamChA += TInt::GetStr(CanIdV[Rnd.GetUniDevInt(CanIdV.Len())]);
+				}
+				ParamChA += HistParamStr;
+
+				AddRequest(TAdriaMsg::HISTORY, ParamChA, Out);
+				NextHistTm += HistPeriod;
+			}
+			while (PredPeriod > 0 && NextPredTm <= CurrTm) {
+				AddRequest(TAdriaMsg::PREDICTION, TChA(), Out);
+				NextPredTm += PredPeriod;
+			}
+			while (StatsPeriod > 0 && NextStatsTm <= CurrTm) {
+				AddRequest(TAdriaMsg::STATS, TChA(), Out);
+				NextStatsTm += StatsPeriod;
+			}
+
+			if (!Out.Empty()) {
+				try {
+					Send(Out);
+				} catch (const PExcept& Except) {
+					Notify->OnNotifyFmt(TNotifyType::ntErr, "Failed to send: %s", Except->GetMsgStr().CStr());
+					SendFailed = true;
+				}
+			}
+		}
+		if (SendFailed) { break; }
+
+		if (CurrTm >= NextReportTm) {
+			ReportProgress(CurrTm - StartTm, PrevPushes, PrevBytes);
+			PrevPushes = PushesSent;
+			PrevBytes = BytesSent;
+			NextReportTm += 1000000;
+		}
+
+		TSysProc::Sleep(1);
+	}
+
+	if (Running && !SubCanIdV.Empty()) {
+		try {
+			TLock Lock(SendSection);
+			Out.Clr(false);
+			AddSubRequest(TAdriaMsg::HISTORY_UNSUB, Out);
+			Send(Out);
+		} catch (const PExcept& Except) {
+			Notify->OnNotifyFmt(TNotifyType::ntErr, "Failed to unsubscribe: %s", Except->GetMsgStr().CStr());
+		}
+	}
+
+	// stop the reader as well
+	Running = false;
+	shutdown(ClientFd, SHUT_RDWR);
+}
+
+void TMockBus::AddPush(const int& NEntries, TMem& Out) {
+	TChA ContentChA;
+
+	for (int i = 0; i < NEntries; i++) {
+		const int CanId = SampleCanId();
+
+		// random walk of the value
+		float Val = (float) (CanValV[CanId] + Rnd.GetNrmDev());
+		CanValV[CanId] = Val;
+
+		ContentChA += (char) CanId;
+		ContentChA += (char) 1;		// type float
+
+		const char* ValCh = (const char*) &Val;
+		for (int ChN = 0; ChN < 4; ChN++) {
+			ContentChA += ValCh[ChN];
+		}
+	}
+
+	TAdriaMsg::Encode(TAdriaMsgMethod::ammPush, TAdriaMsg::RES_TABLE, TChA(), TChA(),
+			ContentChA, BinaryFraming, Out);
+
+	PushesSent++;
+	EntriesSent += NEntries;
+}
+
+void TMockBus::AddRequest(const TChA& Command, const TChA& Params, TMem& Out) {
+	TLock Lock(StatSection);
+
+	const int ReqId = NextReqId++;
+	const uint64 CurrTm = TUtils::GetCurrTimeMicros();
+
+	if (Command == TAdriaMsg::PREDICTION) {
+		PredSendTmV.Add(CurrTm);
+	} else {
+		ReqIdSendTmH.AddDat(ReqId, CurrTm);
+	}
+
+	TAdriaMsg::Encode(TAdriaMsgMethod::ammGet, Command, Params, REQ_ID_PREFIX + TInt::GetStr(ReqId),
+			TChView(), BinaryFraming, Out);
+
+	RequestsSent++;
+}
+
+void TMockBus::AddSubRequest(const TChA& Command, TMem& Out) {
+	TChA ParamChA;
+	for (int CanN = 0; CanN < SubCanIdV.Len(); CanN++) {
+		if (CanN > 0) { ParamChA += ','; }
+		ParamChA += TInt::GetStr(SubCanIdV[CanN]);
+	}
+
+	TAdriaMsg::Encode(TAdriaMsgMethod::ammGet, Command, ParamChA, SUB_COMPONENT_ID,
+			TChView(), BinaryFraming, Out);
+
+	TLock Lock(StatSection);
+	RequestsSent++;
+}
+
+int TMockBus::SampleCanId() {
+	const double Prob = Rnd.GetUniDev();
+	for (int i = 0; i < CanCdfV.Len(); i++) {
+		if (Prob <= CanCdfV[i]) { return CanIdV[i]; }
+	}
+	return CanIdV.Last();
+}
+
+void TMockBus::Send(const TMem& Out) {
+	TLock Lock(SendSection);
+
+	int SentN = 0;
+	while (SentN < Out.Len()) {
+		const int Sent = (int) send(ClientFd, Out.GetBf() + SentN, Out.Len() - SentN, MSG_NOSIGNAL);
+		if (Sent <= 0) {
+			throw TExcept::New("Failed to write to socket!", "TMockBus::Send");
+		}
+		SentN += Sent;
+	}
+
+	BytesSent += SentN;
+}
+
+void TMockBus::SendMsg(const TAdriaMsgMethod& Method, const TChA& Command, const TChA& ComponentId, const TChView& Content) {
+	TMem Out;
+	TAdriaMsg::Encode(Method, Command, TChA(), ComponentId, Content, BinaryFraming, Out);
+	Send(Out);
+}
+
+void TMockBus::ReportProgress(const uint64& ElapsedMicros, const uint64& PrevPushes, const uint64& PrevBytes) {
+	TLock Lock(StatSection);
+
+	Notify->OnNotifyFmt(TNotifyType::ntInfo, "%3ds pushes: %lu/s, sent: %.1f KB/s, pending history: %d, history: %d, predictions: %d",
+			int(ElapsedMicros / 1000000), PushesSent - PrevPushes, (BytesSent - PrevBytes) / 1024.0,
+			ReqIdSendTmH.Len(), HistLatV.Len(), PredLatV.Len());
+}
+
+void TMockBus::ReportFinal() {
+	TLock Lock(StatSection);
+
+	const double Secs = TMath::Mx(double(TUtils::GetCurrTimeMicros() - StartTm) / 1e6, 1e-3);
+
+	Notify->OnNotify(TNotifyType::ntInfo, "========================================");
+	Notify->OnNotifyFmt(TNotifyType::ntInfo, "duration:        %.1f s", Secs);
+	Notify->OnNotifyFmt(TNotifyType::ntInfo, "framing:         %s", BinaryFraming ? "binary" : "text");
+	Notify->OnNotifyFmt(TNotifyType::ntInfo, "pushes sent:     %lu (%.1f/s)", PushesSent, PushesSent / Secs);
+	Notify->OnNotifyFmt(TNotifyType::ntInfo, "entries sent:    %lu (%.1f/s)", EntriesSent, EntriesSent / Secs);
+	Notify->OnNotifyFmt(TNotifyType::ntInfo, "bytes sent:      %lu (%.1f KB/s)", BytesSent, BytesSent / Secs / 1024);
+	Notify->OnNotifyFmt(TNotifyType::ntInfo, "requests sent:   %lu", RequestsSent);
+	Notify->OnNotifyFmt(TNotifyType::ntInfo, "messages recv:   %lu (%.1f KB/s)", MsgsRecv, BytesRecv / Secs / 1024);
+	Notify->OnNotifyFmt(TNotifyType::ntInfo, "unanswered:      %d", ReqIdSendTmH.Len() + PredSendTmV.Len());
+
+	if (!HistLatV.Empty()) {
+		Notify->OnNotifyFmt(TNotifyType::ntInfo, "history reply:   %.1f bytes on average (%s)",
+				double(HistBytes) / HistLatV.Len(), HistParamStr.Empty() ? "default" : HistParamStr.CStr());
+	}
+
+	if (!SubCanIdV.Empty()) {
+		Notify->OnNotifyFmt(TNotifyType::ntInfo, "history subs:    %d CAN IDs, %lu snapshots, %lu updates (%.1f/s)",
+				SubCanIdV.Len(), HistSnapshotsRecv, HistUpdatesRecv, HistUpdatesRecv / Secs);
+	}
+
+	ReportLatency("history", HistLatV);
+	ReportLatency("prediction", PredLatV);
+	ReportLatency("stats", StatsLatV);
+}
+
+void TMockBus::ReportLatency(const TStr& Nm, TUInt64V& LatV) const {
+	if (LatV.Empty()) {
+		Notify->OnNotifyFmt(TNotifyType::ntInfo, "%-10s latency: no responses", Nm.CStr());
+		return;
+	}
+
+	LatV.Sort();
+	Notify->OnNotifyFmt(TNotifyType::ntInfo, "%-10s latency [ms] n=%d p50=%.2f p90=%.2f p99=%.2f p99.9=%.2f max=%.2f",
+			Nm.CStr(), LatV.Len(),
+			GetPercentile(LatV, 0.5) / 1e3, GetPercentile(LatV, 0.9) / 1e3,
+			GetPercentile(LatV, 0.99) / 1e3, GetPercentile(LatV, 0.999) / 1e3,
+			LatV.Last().Val / 1e3);
+}
+
+uint64 TMockBus::GetPercentile(const TUInt64V& SortedV, const double& Perc) {
+	const int Idx = TMath::Mn(int(Perc * SortedV.Len()), SortedV.Len()-1);
+	return SortedV[Idx];
+}
+
+
+int main(int argc, char* argv[]) {
+	try {
+		Env = TEnv(argc, argv, Notify);
+		Env.SetNoLine();
+
+		TMockBus Bus(Env);
+		Bus.Run();
+	} catch (const PExcept& Except) {
+		Notify->OnNotify(TNotifyType::ntErr, Except->GetMsgStr());
+		return 1;
+	} catch (...) {
+		Notify->OnNotify(TNotifyType::ntErr, "Unknown exception, exiting...");
+		return 2;
+	}
+
+	return 0;
+}
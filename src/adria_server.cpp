@@ -40,9 +40,9 @@ void TDataProvider::TSampleHistThread::Run() {
 			Notify->OnNotify(TNotifyType::ntInfo, "History loop...");
 
 			DataProvider->SampleWaterLevel();
+			DataProvider->SampleHist();
 
 			if (LoopIdx % (SleepTm / SampleWaterLevelTm) == 0) {
-				DataProvider->SampleHist();
 				DataProvider->LearnFreshWaterLevel();
 				DataProvider->MakePredictions();
 				LoopIdx = 0;
@@ -82,7 +82,6 @@ void TDataProvider::TRuleThread::Run() {
 			Notify->OnNotify(TNotifyType::ntInfo, "Starting rule loop...");
 
 			DataProvider->DelOldRuleInst();
-			DataProvider->PersistRuleInstV();
 
 			if (Count++ % 3 == 0) {
 				DataProvider->GenRules();
@@ -102,6 +101,70 @@ void TDataProvider::TRuleThread::Run() {
 	}
 }
 
+/////////////////////////////////////////////////////////////////////
+// TPersistThread
+uint64 TDataProvider::TPersistThread::SleepTm = 1000*10;	// 10s
+
+TDataProvider::TPersistThread::TPersistThread(TDataProvider* Provider, const PNotify& _Notify):
+		DataProvider(Provider),
+		Running(false),
+		Notify(_Notify) {
+	Notify->OnNotify(TNotifyType::ntInfo, "Persist thread initialized!");
+}
+
+void TDataProvider::TPersistThread::Run() {
+	Running = true;
+
+	while (Running) {
+		try {
+			DataProvider->CheckpointIfDue();
+		} catch (const PExcept& Except) {
+			Notify->OnNotify(TNotifyType::ntErr, "TDataProvider::TPersistThread::Run: failed to checkpoint!");
+			Notify->OnNotify(TNotifyType::ntErr, Except->GetMsgStr());
+		} catch (...) {
+			Notify->OnNotify(TNotifyType::ntErr, "TDataProvider::TPersistThread::Run: WTF!? failed to catch exception!");
+		}
+
+		TSysProc::Sleep(TPersistThread::SleepTm);
+	}
+}
+
+/////////////////////////////////////////////////////////////////////
+// TReadingsLogThread
+uint64 TDataProvider::TReadingsLogThread::SleepTm = 250;	// 250ms
+
+TDataProvider::TReadingsLogThread::TReadingsLogThread(TDataProvider* Provider, const PNotify& _Notify):
+		DataProvider(Provider),
+		Running(false),
+		Notify(_Notify) {}
+
+void TDataProvider::TReadingsLogThread::Run() {
+	Running = true;
+
+	while (Running) {
+		DataProvider->FlushReadingsLog();
+		TSysProc::Sleep(TReadingsLogThread::SleepTm);
+	}
+}
+
+/////////////////////////////////////////////////////////////////////
+// TLoadThread
+TDataProvider::TLoadThread::TLoadThread(TDataProvider* Provider, const TStructType& _StructType):
+		DataProvider(Provider),
+		StructType(_StructType) {}
+
+void TDataProvider::TLoadThread::Run() {
+	switch (StructType) {
+	case stHist: {
+		DataProvider->LoadHistV();
+		break;
+	} case stRuleInst: {
+		DataProvider->LoadRuleInstV();
+		break;
+	}
+	}
+}
+
 /////////////////////////////////////////////////////////////////////
 // TOnlineRuleThread
 //const uint64 TDataProvider::TOnlineRuleThread::SLEEP_TM = 15000;
@@ -134,9 +197,10 @@ void TDataProvider::TRuleThread::Run() {
 
 /////////////////////////////////////////////////////////////////////
 // Data handler
-const bool TDataProvider::LOG_READINGS = false;
 
-uint64 TDataProvider::HistDur = 1000*60*60*24*7;	// one week
+uint64 TDataProvider::HistDur = uint64(1000)*60*60*24*90;	// three months
+int TDataProvider::HistSeriesMxMem = 1024*1024;				// 1MB per CAN ID
+uint64 TDataProvider::CheckpointTm = 1000*60*60;			// 1h
 uint64 TDataProvider::RuleWindowTm = 1000*60*60*24*3;	// 3 days
 int TDataProvider::EntryTblLen = 256;
 TIntStrH TDataProvider::CanIdVarNmH;
@@ -147,6 +211,8 @@ TIntV TDataProvider::RuleEffectCanV;
 TIntV TDataProvider::RuleObsCanV;
 TIntIntH TDataProvider::RuleEventCanIdIdxH;
 TIntIntH TDataProvider::RuleObsCanIdIdxH;
+TBoolV TDataProvider::IsRuleEventCanV;
+TVec<TSamplePolicy> TDataProvider::SamplePolicyV;
 
 bool TDataProvider::FillCanHs() {
 	CanIdVarNmH.AddDat(103, "temp_cabin");
@@ -163,6 +229,24 @@ bool TDataProvider::FillCanHs() {
 	CanIdVarNmH.AddDat(160, "hum_sc");
 	CanIdVarNmH.AddDat(161, "lum_sc");
 
+	// history sampling policies, the CAN IDs without a policy of their own
+	// store a change at most once a minute and a flat signal every 10 minutes
+	SamplePolicyV.Gen(EntryTblLen, EntryTblLen);
+	const uint64 Sec = 1000;
+	SamplePolicyV[103] = TSamplePolicy(60*Sec, 0.1);		// temperatures
+	SamplePolicyV[104] = TSamplePolicy(60*Sec, 0.1);
+	SamplePolicyV[122] = TSamplePolicy(60*Sec, 0.1);
+	SamplePolicyV[147] = TSamplePolicy(60*Sec, 0.1);
+	SamplePolicyV[159] = TSamplePolicy(60*Sec, 0.1);
+	SamplePolicyV[123] = TSamplePolicy(60*Sec, 0.5);		// humidities
+	SamplePolicyV[148] = TSamplePolicy(60*Sec, 0.5);
+	SamplePolicyV[160] = TSamplePolicy(60*Sec, 0.5);
+	SamplePolicyV[124] = TSamplePolicy(10*Sec, 0, 0.05);	// luminosities change quickly
+	SamplePolicyV[149] = TSamplePolicy(10*Sec, 0, 0.05);
+	SamplePolicyV[161] = TSamplePolicy(10*Sec, 0, 0.05);
+	SamplePolicyV[TUtils::BATTERY_LS_CANID] = TSamplePolicy(60*Sec, 0, 0.005);
+	SamplePolicyV[TUtils::FRESH_WATER_CANID] = TSamplePolicy(60*Sec, 1);
+
 	CanIdPredCanIdH.AddDat(TUtils::BATTERY_LS_CANID, 212);	// battery living space
 	CanIdPredCanIdH.AddDat(TUtils::FRESH_WATER_CANID, 210);	// fresh water
 	CanIdPredCanIdH.AddDat(TUtils::WASTE_WATER_CANID, 211);	// waste water
@@ -184,8 +268,10 @@ bool TDataProvider::FillCanHs() {
 	RuleObsCanV.Add(147);	// temperature living space
 
 	// add to sets for faster lookup
+	IsRuleEventCanV.Gen(EntryTblLen, EntryTblLen);
 	for (int i = 0; i < RuleEffectCanV.Len(); i++) {
 		RuleEventCanIdIdxH.AddDat(RuleEffectCanV[i], i);
+		IsRuleEventCanV[RuleEffectCanV[i]] = true;
 	}
 	for (int i = 0; i < RuleObsCanV.Len(); i++) {
 		RuleObsCanIdIdxH.AddDat(RuleObsCanV[i], i);
@@ -201,16 +287,47 @@ TDataProvider::TDataProvider(const TStr& _DbPath, const PNotify& _Notify):
 		DbPath(_DbPath),
 		EntryTbl(TDataProvider::EntryTblLen, TDataProvider::EntryTblLen),
 		HistH(),
+		HistCache(),
 		RuleInstV(),
 		WaterLevelV(),
+		ReadingsLog(),
+		Wal(),
+		LastCheckpointTm(0),
+		HistVer(0),
+		PersistedHistVer(0),
+		RuleVer(0),
+		PersistedRuleVer(0),
+		WaterVer(0),
+		PersistedWaterVer(0),
+		Checkpoints(0),
+		FailedCheckpoints(0),
+		SkippedCheckpoints(0),
+		LastLockTm(0),
+		MxLockTm(0),
+		LastPersistTm(0),
+		MxPersistTm(0),
+		PendingLoads(0),
+		HistLoadTm(0),
+		RuleLoadTm(0),
+		WaterLoadTm(0),
+		ReplayTm(0),
+		StartupTm(0),
 		WaterLevelReg(DbPath, _Notify),
 //		RuleGenerator(DbPath, _Notify),
 		HistThread(),
 		RuleThread(),
+		PersistThread(),
+		HistLoadThread(),
+		ReadingsLogThread(),
 //		OnlineRuleThread(),
+		PredictionCallback(NULL),
+		RulesCallback(NULL),
+		HistCallback(NULL),
 		DataSection(TCriticalSectionType::cstRecursive),
 		HistSection(TCriticalSectionType::cstRecursive),
 		RuleSection(TCriticalSectionType::cstRecursive),
+		PersistSection(TCriticalSectionType::cstRecursive),
+		CheckpointSection(TCriticalSectionType::cstRecursive),
 		Notify(_Notify) {
 
 	LoadStructs();
@@ -218,18 +335,38 @@ TDataProvider::TDataProvider(const TStr& _DbPath, const PNotify& _Notify):
 	Notify->OnNotify(TNotifyType::ntInfo, "Data provider initialized!");
 }
 
+TDataProvider::~TDataProvider() {
+	// history may still be loading
+	if (!HistLoadThread.Empty()) {
+		HistLoadThread->Join();
+	}
+	// the log writes the rest of the readings when it is released
+	if (!ReadingsLogThread.Empty()) {
+		((TReadingsLogThread*) ReadingsLogThread())->Stop();
+		ReadingsLogThread->Join();
+	}
+}
+
 void TDataProvider::OnConnected() {
 	Notify->OnNotify(TNotifyType::ntInfo, "TDataProvider::OnConnected: starting threads...");
 
 	try {
+		// the threads keep running over reconnects
+		if (!HistThread.Empty()) {
+			Notify->OnNotify(TNotifyType::ntInfo, "TDataProvider::OnConnected: threads already running");
+			return;
+		}
+
 		// init threads
 		HistThread = new TSampleHistThread(this, Notify);
 		RuleThread = new TRuleThread(this, Notify);
+		PersistThread = new TPersistThread(this, Notify);
 //		OnlineRuleThread = new TOnlineRuleThread(this, Notify);
 
 		// start threads
 		HistThread->Start();
 		RuleThread->Start();
+		PersistThread->Start();
 //		OnlineRuleThread->Start();
 	} catch (const PExcept& Except) {
 		Notify->OnNotify(TNotifyType::ntErr, "TDataProvider: failed to start threads!!");
@@ -240,14 +377,23 @@ void TDataProvider::OnConnected() {
 void TDataProvider::AddRec(const int& CanId, const PJsonVal& Rec) {
 	try {
 		if (CanId < 0 || CanId >= TDataProvider::EntryTblLen) { return; }
+
+		const uint64 Tm = TUtils::GetCurrTimeStamp();
+		TIntFltKdV RecV;
+
 		{
 			TLock Lock(DataSection);
 
 			// put the entry into the state table
 			EntryTbl[CanId] = Rec->GetObjNum("value");
 
-			AddRecToLog(CanId, Rec);
+			AddRecToLog(Tm, CanId, EntryTbl[CanId]);
+			RecV.Add(TIntFltKd(CanId, EntryTbl[CanId]));
 		}
+
+		FlushReadingsLog();
+		AddToHist(RecV, Tm);
+
 		if (RuleEventCanIdIdxH.IsKey(CanId)) {
 			AddRuleInstance(CanId);
 		}
@@ -257,23 +403,113 @@ void TDataProvider::AddRec(const int& CanId, const PJsonVal& Rec) {
 	}
 }
 
-void TDataProvider::AddRuleInstance(const int& CanId) {
+void TDataProvider::AddRecBatch(const uint8* Tbl, const int& Len, const uint64& Tm) {
 	try {
-		TLock Lock(RuleSection);
+		const int NEntries = Len / TAdriaMsg::BYTES_PER_EL;
+
+		int NInvalid = 0;
+
+		TIntFltKdV RecV(NEntries, 0);
+		// one rule instance per event CAN ID in the table, a repeated event
+		// replaces its instance with the state at its last record
+		TVec<TFltV> RuleStateVV;
+		TIntIntH EventInstNH;
+
+		{
+			TLock Lock(DataSection);
+
+			for (int EntryIdx = 0; EntryIdx < NEntries; EntryIdx++) {
+				const uint8* Entry = Tbl + EntryIdx*TAdriaMsg::BYTES_PER_EL;
+
+				const int CanId = Entry[0];
+
+				float Val;
+				switch (Entry[1]) {
+				case 0: {
+					Val = (float) (char) Entry[2];
+					break;
+				} case 1: {
+					memcpy(&Val, Entry + 2, sizeof(float));
+					break;
+				} default: {
+					NInvalid++;
+					continue;
+				}
+				}
+
+				if (CanId >= TDataProvider::EntryTblLen) { continue; }
+
+				// put the entry into the state table
+				EntryTbl[CanId] = Val;
+				AddRecToLog(Tm, CanId, Val);
+				RecV.Add(TIntFltKd(CanId, Val));
+
+				if (IsRuleEventCanV[CanId]) {
+					const int KeyId = EventInstNH.GetKeyId(CanId);
+					if (KeyId < 0) {
+						const int InstN = RuleStateVV.Add();
+						EventInstNH.AddDat(CanId, InstN);
+						GetRuleStateV(RuleStateVV[InstN]);
+					} else {
+						GetRuleStateV(RuleStateVV[EventInstNH[KeyId]]);
+					}
+				}
+			}
+		}
 
-		TFltV StateV(RuleEffectCanV.Len() + RuleObsCanV.Len(),0);
+		// the log is written outside DataSection
+		FlushReadingsLog();
+		AddToHist(RecV, Tm);
 
-		for (int i = 0; i < RuleEffectCanV.Len(); i++) {
-			const int& CanId = RuleEffectCanV[i];
-			StateV.Add(EntryTbl[CanId]);
+		if (!RuleStateVV.Empty()) {
+			AddRuleInstances(RuleStateVV, Tm);
 		}
-		for (int i = 0; i < RuleObsCanV.Len(); i++) {
-			const int& CanId = RuleObsCanV[i];
-			StateV.Add(EntryTbl[CanId]);
+		if (NInvalid > 0) {
+			Notify->OnNotifyFmt(TNotifyType::ntWarn, "Skipped %d records with invalid type of measurement!", NInvalid);
+		}
+	} catch (const PExcept& Except) {
+		Notify->OnNotify(TNotifyType::ntErr, "Unable to add records to base!");
+		Notify->OnNotify(TNotifyType::ntErr, Except->GetMsgStr());
+	}
+}
+
+void TDataProvider::AddRuleInstance(const int& CanId) {
+	TVec<TFltV> StateVV(1);
+	{
+		TLock Lock(DataSection);
+		GetRuleStateV(StateVV[0]);
+	}
+	AddRuleInstances(StateVV, TUtils::GetCurrTimeStamp());
+}
+
+void TDataProvider::GetRuleStateV(TFltV& StateV) const {
+	StateV.Gen(RuleEffectCanV.Len() + RuleObsCanV.Len(),0);
+
+	for (int i = 0; i < RuleEffectCanV.Len(); i++) {
+		const int& CanId = RuleEffectCanV[i];
+		StateV.Add(EntryTbl[CanId]);
+	}
+	for (int i = 0; i < RuleObsCanV.Len(); i++) {
+		const int& CanId = RuleObsCanV[i];
+		StateV.Add(EntryTbl[CanId]);
+	}
+}
+
+void TDataProvider::AddRuleInstances(const TVec<TFltV>& StateVV, const uint64& Tm) {
+	try {
+		TLock Lock(RuleSection);
+
+		for (int InstN = 0; InstN < StateVV.Len(); InstN++) {
+			RuleInstV.Add(TKeyDat<TUInt64,TFltV>(Tm, StateVV[InstN]));
 		}
 
-		uint64 Tm = TUtils::GetCurrTimeStamp();
-		RuleInstV.Add(TKeyDat<TUInt64,TFltV>(Tm, StateV));
+		TMOut RecOut;
+		TUInt64(Tm).Save(RecOut);
+		TInt(StateVV.Len()).Save(RecOut);
+		for (int InstN = 0; InstN < StateVV.Len(); InstN++) {
+			StateVV[InstN].Save(RecOut);
+		}
+		WriteWal(srtRuleInstV, RecOut);
 	} catch (const PExcept& Except) {
 		Notify->OnNotify(TNotifyType::ntErr, "Unable to add an instance to the rule DB!");
 		Notify->OnNotify(TNotifyType::ntErr, Except->GetMsgStr());
@@ -294,6 +530,11 @@ void TDataProvider::DelOldRuleInst() {
 
 		if (StartRuleIdx > 0) {
 			RuleInstV.Del(0, StartRuleIdx-1);
+
+			TMOut RecOut;
+			TUInt64(OldestTm).Save(RecOut);
+			WriteWal(srtRuleDel, RecOut);
+
 			Notify->OnNotifyFmt(TNotifyType::ntInfo, "Deleted %d instances...", StartRuleIdx);
 		}
 	} catch (const PExcept& Except) {
@@ -302,20 +543,65 @@ void TDataProvider::DelOldRuleInst() {
 	}
 }
 
-void TDataProvider::GetHistory(const int& CanId, TUInt64FltKdV& HistoryV) {
-	Notify->OnNotifyFmt(TNotifyType::ntInfo, "Fetching history for CAN: %d", CanId);
+int TDataProvider::GetHistory(const THistQuery& Query, TVec<TUInt64FltKdV>& HistoryVV, TVec<TTmBucketV>& BucketVV) {
+	const TIntV& CanIdV = Query.CanIdV;
 
-	if (!HistH.IsKey(CanId)) {
-		Notify->OnNotifyFmt(TNotifyType::ntWarn, "Tried to fetch untracked history: %d. Ignoring!", CanId);
-		return;
-	}
+	Notify->OnNotifyFmt(TNotifyType::ntInfo, "Fetching history for CANs: %s", Query.GetCanIdStr().CStr());
 
 	try {
-		TLock Lck(HistSection);
-		HistoryV.AddV(HistH.GetDat(CanId));
+		// the raw samples are decoded from copies of the series after the
+		// lock is released, the copies share the immutable sealed chunks
+		TVec<TTmSeries> SnapV;
+		THistSnapClr<TVec<TTmSeries>> SnapClr(HistSection, SnapV);
+		int ResN;
+
+		{
+			// all the series are read under a single lock
+			TLock Lck(HistSection);
+
+			// the series in one reply share the resolution, pick the coarsest
+			// which any of them needs
+			ResN = Query.ResN;
+			if (ResN < 0) {
+				ResN = TTmSeries::RES_RAW;
+				for (int CanN = 0; CanN < CanIdV.Len(); CanN++) {
+					if (!HistH.IsKey(CanIdV[CanN])) { continue; }
+					ResN = TMath::Mx(ResN, HistH.GetDat(CanIdV[CanN]).SelectRes(Query.MxPoints, Query.FromTm, Query.ToTm));
+				}
+			}
+
+			HistoryVV.Gen(ResN == TTmSeries::RES_RAW ? CanIdV.Len() : 0);
+			BucketVV.Gen(ResN == TTmSeries::RES_RAW ? 0 : CanIdV.Len());
+			SnapV.Gen(ResN == TTmSeries::RES_RAW ? CanIdV.Len() : 0);
+
+			for (int CanN = 0; CanN < CanIdV.Len(); CanN++) {
+				const int& CanId = CanIdV[CanN];
+
+				// untracked series are sent empty so the reply matches the request
+				if (!HistH.IsKey(CanId)) {
+					Notify->OnNotifyFmt(TNotifyType::ntWarn, "Tried to fetch untracked history: %d. Ignoring!", CanId);
+					continue;
+				}
+
+				// the buckets are already aggregated, only the requested slice is copied
+				const TTmSeries& Series = HistH.GetDat(CanId);
+				if (ResN == TTmSeries::RES_RAW) {
+					Series.GetSnapshot(SnapV[CanN]);
+				} else {
+					Series.GetNewestFirst(ResN, BucketVV[CanN], Query.GetMxPoints(), Query.FromTm, Query.ToTm);
+				}
+			}
+		}
+
+		for (int CanN = 0; CanN < SnapV.Len(); CanN++) {
+			SnapV[CanN].GetNewestFirst(HistoryVV[CanN], Query.GetMxPoints(), Query.FromTm, Query.ToTm);
+		}
+
+		return ResN;
 	} catch (const PExcept& Except) {
-		Notify->OnNotifyFmt(TNotifyType::ntErr, "Failed to retrieve history for CAN: %d", CanId);
+		Notify->OnNotifyFmt(TNotifyType::ntErr, "Failed to retrieve history for CANs: %s", Query.GetCanIdStr().CStr());
 		Notify->OnNotify(TNotifyType::ntErr, Except->GetMsgStr());
+		return TTmSeries::RES_RAW;
 	}
 }
 
@@ -510,6 +796,11 @@ void TDataProvider::LearnFreshWaterLevel() {
 		Notify->OnNotifyFmt(TNotifyType::ntInfo, "Deleting water %d level instances...", LastIdx);
 		if (LastIdx > 0) {
 			TLock Lck(HistSection);
+
+			TMOut RecOut;
+			TUInt64(WaterLevelV[LastIdx].Val1).Save(RecOut);
+			WriteWal(srtWaterDel, RecOut);
+
 			WaterLevelV.Del(0, LastIdx-1);
 		}
 	} catch (const PExcept& Except) {
@@ -519,54 +810,139 @@ void TDataProvider::LearnFreshWaterLevel() {
 }
 
 
-void TDataProvider::AddRecToLog(const int& CanId, const PJsonVal& Rec) {
-	if (!LOG_READINGS) { return; }
+void TDataProvider::AddRecToLog(const uint64& Tm, const int& CanId, const double& Val) {
+	if (ReadingsLog.Empty()) { return; }
 
 	try {
+		ReadingsLog->Add(Tm, CanId, Val);
+	} catch (const PExcept& Except) {
+		Notify->OnNotify(TNotifyType::ntErr, "Unable to add record to the readings log!");
+		Notify->OnNotify(TNotifyType::ntErr, Except->GetMsgStr());
+	}
+}
+
+void TDataProvider::StartReadingsLog(const TReadingsLogFormat& Format) {
+	const TStr FName = Format == rlfTxt ? TUtils::GetLogFName(DbPath) : TUtils::GetBinLogFName(DbPath);
+	Notify->OnNotifyFmt(TNotifyType::ntInfo, "Logging readings to %s", FName.CStr());
+
+	{
 		TLock Lock(DataSection);
+		ReadingsLog = TAdriaReadingsLog::New(FName, Format);
+	}
+
+	if (ReadingsLogThread.Empty()) {
+		ReadingsLogThread = new TReadingsLogThread(this, Notify);
+		ReadingsLogThread->Start();
+	}
+}
+
+void TDataProvider::FlushReadingsLog() {
+	if (ReadingsLog.Empty()) { return; }
+
+	try {
+		ReadingsLog->FlushIfDue();
+	} catch (const PExcept& Except) {
+		Notify->OnNotify(TNotifyType::ntErr, "Unable to flush the readings log!");
+		Notify->OnNotify(TNotifyType::ntErr, Except->GetMsgStr());
+	}
+}
+
+PJsonVal TDataProvider::GetReadingsLogStatJson() {
+	return ReadingsLog.Empty() ? TJsonVal::NewObj() : ReadingsLog->GetStatJson();
+}
+
+void TDataProvider::AddToHist(const TIntFltKdV& RecV, const uint64& Tm) {
+	try {
+		TIntFltH SampleH;
 
-		const TStr LogFName = TUtils::GetLogFName(DbPath);
+		{
+			TLock Lck(HistSection);
+
+			// store the readings which pass the sampling policy of their series
+			for (int RecN = 0; RecN < RecV.Len(); RecN++) {
+				const int& CanId = RecV[RecN].Key;
+				const TFlt& Val = RecV[RecN].Dat;
+
+				// the series of a CAN ID is created with its first reading
+				int KeyId = HistH.GetKeyId(CanId);
+				if (KeyId == -1) {
+					KeyId = HistH.AddKey(CanId);
+					Notify->OnNotifyFmt(TNotifyType::ntInfo, "Tracking history of CAN ID %d", CanId);
+				}
 
-		bool LogExists = TFile::Exists(LogFName);
-		TFOut Out(LogFName, true);
+				TTmSeries& Series = HistH[KeyId];
+				if (SamplePolicyV[CanId].IsSample(Series, Tm, Val) && Series.Add(Tm, Val)) {
+					SampleH.AddDat(CanId, Val);
+				}
+			}
 
-		if (LogExists) { Out.PutCh('\n'); }
-		Out.PutStr(Rec->GetObjStr("timestamp"));
-		Out.PutCh(',');
-		Out.PutInt(CanId);
-		Out.PutCh(',');
-		Out.PutFlt(Rec->GetObjNum("value"));
+			if (!SampleH.Empty()) {
+				TIntV SampledCanIdV;	SampleH.GetKeyV(SampledCanIdV);
+				HistCache.Invalidate(SampledCanIdV);
+
+				TMOut RecOut;
+				TUInt64(Tm).Save(RecOut);
+				TInt(SampleH.Len()).Save(RecOut);
+				int KeyId = SampleH.FFirstKeyId();
+				while (SampleH.FNextKeyId(KeyId)) {
+					SampleH.GetKey(KeyId).Save(RecOut);
+					SampleH[KeyId].Save(RecOut);
+				}
+				WriteWal(srtHistSamples, RecOut);
+			}
+		}
 
-		Out.Flush();
+		// notify the subscribers outside the lock
+		if (HistCallback != NULL && !SampleH.Empty()) {
+			HistCallback->OnHistSampled(Tm, SampleH);
+		}
 	} catch (const PExcept& Except) {
-		Notify->OnNotify(TNotifyType::ntErr, "Unable to add record to base!");
+		Notify->OnNotify(TNotifyType::ntErr, "Failed to add readings to history!");
 		Notify->OnNotify(TNotifyType::ntErr, Except->GetMsgStr());
 	}
 }
 
 void TDataProvider::SampleHistFromV(const TFltV& StateV, const uint64& SampleTm) {
 	try {
+		// re-evaluate the policies of the tracked series on the current state, this
+		// stores the heartbeats of flat signals and the changes held back by the period
+		TIntFltKdV RecV;
+		{
+			TLock Lck(HistSection);
+
+			RecV.Gen(HistH.Len(), 0);
+			int KeyId = HistH.FFirstKeyId();
+			while (HistH.FNextKeyId(KeyId)) {
+				const int& CanId = HistH.GetKey(KeyId);
+				RecV.Add(TIntFltKd(CanId, StateV[CanId]));
+			}
+		}
+
+		// takes the lock itself and notifies the subscribers without it
+		AddToHist(RecV, SampleTm);
+
 		TLock Lck(HistSection);
 
-		// add the current values to history
-		TIntV KeyV;	HistH.GetKeyV(KeyV);
+		// remove the outdated entries and keep the series within their quota
+		const uint64 MnTm = SampleTm > HistDur ? SampleTm - HistDur : 0;
 
-		for (int KeyIdx = 0; KeyIdx < KeyV.Len(); KeyIdx++) {
-			const int& CanId = KeyV[KeyIdx];
-			const TFlt Val = StateV[CanId];
-			HistH.GetDat(CanId).Ins(0, TUInt64FltKd(SampleTm, Val));
-		}
+		TIntV TrimmedCanIdV;
+		int KeyId = HistH.FFirstKeyId();
+		while (HistH.FNextKeyId(KeyId)) {
+			TTmSeries& Series = HistH[KeyId];
 
-		// remove the outdated entries
-		for (int KeyIdx = 0; KeyIdx < KeyV.Len(); KeyIdx++) {
-			const int& CanId = KeyV[KeyIdx];
+			const int SeriesDeleted = Series.DelBefore(MnTm) + Series.Trim(HistSeriesMxMem);
+			if (SeriesDeleted > 0) {
+				TMOut RecOut;
+				HistH.GetKey(KeyId).Save(RecOut);
+				TUInt64(Series.GetMnTm()).Save(RecOut);
+				WriteWal(srtHistDel, RecOut);
 
-			TUInt64FltKdV& HistV = HistH.GetDat(CanId);
-			while (HistV.Last().Key < SampleTm - HistDur) {
-				HistV.DelLast();
+				TrimmedCanIdV.Add(HistH.GetKey(KeyId));
 			}
 		}
 
+		if (!TrimmedCanIdV.Empty()) { HistCache.Invalidate(TrimmedCanIdV); }
 	} catch (const PExcept& Except) {
 		Notify->OnNotify(TNotifyType::ntErr, "Failed to sample history!");
 		Notify->OnNotify(TNotifyType::ntErr, Except->GetMsgStr());
@@ -574,9 +950,7 @@ void TDataProvider::SampleHistFromV(const TFltV& StateV, const uint64& SampleTm)
 }
 
 void TDataProvider::SampleHist() {
-	Notify->OnNotify(TNotifyType::ntInfo, "Adding current state to history...");
 	SampleHistFromV(EntryTbl, TUtils::GetCurrTimeStamp());
-	PersistHist();
 }
 
 void TDataProvider::SampleWaterLevel() {
@@ -589,7 +963,11 @@ void TDataProvider::SampleWaterLevel() {
 		{
 			TLock Lck(HistSection);
 			WaterLevelV.Add(TUInt64FltPr(Tm, WaterLevel));
-			PersistWaterLevelV();
+
+			TMOut RecOut;
+			TUInt64(Tm).Save(RecOut);
+			WaterLevel.Save(RecOut);
+			WriteWal(srtWaterLevel, RecOut);
 		}
 	} catch (const PExcept& Except) {
 		Notify->OnNotify(TNotifyType::ntErr, "Failed to sample fresh water level!");
@@ -830,181 +1208,821 @@ void TDataProvider::InterpretApriori(const TVec<TPair<TIntV,TInt>>& RuleIdxV, TV
 void TDataProvider::LoadStructs() {
 	Notify->OnNotify(TNotifyType::ntInfo, "Initializing history...");
 
-	try {
-		TLock Lck(HistSection);
+	const uint64 StartTm = TUtils::GetCurrTimeMicros();
 
-		LoadHistV();
-		LoadRuleInstV();
-		LoadWaterLevelV();
+	{
+		TLock Lck(PersistSection);
+		// history and the rest, nothing is saved until both are loaded
+		PendingLoads = 2;
+	}
+
+	try {
+		const TStr WalFName = TUtils::GetWalFName(DbPath);
 
-		Notify->OnNotify(TNotifyType::ntInfo, "History initialized!");
+		// the old log keeps the changes since the last checkpoint, the
+		// changes made while loading go to a new one
+		TAdriaWal::MoveRecs(WalFName, TUtils::GetPrevWalFName(DbPath));
+		Wal = TAdriaWal::New(WalFName);
 	} catch (const PExcept& Except) {
-		Notify->OnNotify(TNotifyType::ntErr, "Failed to initialize history!");
+		Notify->OnNotify(TNotifyType::ntErr, "Failed to open the write-ahead log!");
 		Notify->OnNotify(TNotifyType::ntErr, Except->GetMsgStr());
+		Wal.Clr();
 	}
-}
-
-void TDataProvider::LoadHistV() {
-	Notify->OnNotify(TNotifyType::ntInfo, "TDataProvider::LoadHistV: Loading history...");
 
+	// the structures are always loaded, a checkpoint would otherwise
+	// overwrite them with empty ones
+	PThread RuleLoadThread;
 	try {
-		TLock Lck(HistSection);
+		// history is merged with the new samples when it is loaded, so
+		// the readings don't wait for it
+		HistLoadThread = new TLoadThread(this, TLoadThread::stHist);
+		HistLoadThread->Start();
+	} catch (const PExcept& Except) {
+		Notify->OnNotify(TNotifyType::ntErr, "Failed to start loading history in the background!");
+		Notify->OnNotify(TNotifyType::ntErr, Except->GetMsgStr());
+		HistLoadThread.Clr();
+	}
+	try {
+		RuleLoadThread = new TLoadThread(this, TLoadThread::stRuleInst);
+		RuleLoadThread->Start();
+	} catch (const PExcept& Except) {
+		Notify->OnNotify(TNotifyType::ntErr, "Failed to start loading rule instances in parallel!");
+		Notify->OnNotify(TNotifyType::ntErr, Except->GetMsgStr());
+		RuleLoadThread.Clr();
+	}
 
-		const TStr HistFName = TUtils::GetHistFName(DbPath);
-		const TStr BackupFName = TUtils::GetHistBackupFName(DbPath);
+	LoadWaterLevelV();
+	if (RuleLoadThread.Empty()) {
+		LoadRuleInstV();
+	} else {
+		RuleLoadThread->Join();
+	}
 
-		if (!TUtils::LoadStruct(HistFName, BackupFName, HistH, Notify)) {
-			Notify->OnNotify(TNotifyType::ntInfo, "History doesn't exist or is corrupt! Creating new history vector...");
+	{
+		TLock HistLck(HistSection);
+		TLock RuleLck(RuleSection);
 
-			// get CAN IDs
-			TIntV KeyV;	TDataProvider::CanIdVarNmH.GetKeyV(KeyV);
-			HistH.Clr();
+		// the history records are replayed by the history loader
+		const uint64 ReplayStartTm = TUtils::GetCurrTimeMicros();
+		ReplayWal(false, HistH);
 
-			for (int i = 0; i < KeyV.Len(); i++) {
-				const TInt& CanId = KeyV[i];
+		TLock Lck(PersistSection);
+		ReplayTm = TUtils::GetCurrTimeMicros() - ReplayStartTm;
+	}
 
-				HistH.AddDat(CanId, TUInt64FltKdV());
-			}
+	Notify->OnNotify(TNotifyType::ntInfo, "History initialized!");
 
-			PersistHist();
-		}
-	} catch (const PExcept& Except) {
-		Notify->OnNotify(TNotifyType::ntErr, "TDataProvider::LoadHistV: Failed to load history!");
-		Notify->OnNotify(TNotifyType::ntErr, Except->GetMsgStr());
+	// without the loader thread history is loaded here
+	if (HistLoadThread.Empty()) {
+		LoadHistV();
 	}
-}
 
-void TDataProvider::LoadRuleInstV() {
-	Notify->OnNotify(TNotifyType::ntInfo, "Loading instances for learning rules...");
+	{
+		TLock Lck(PersistSection);
+		StartupTm = TUtils::GetCurrTimeMicros() - StartTm;
+	}
 
-	try {
-		TLock Lck(RuleSection);
+	OnStructLoaded();
+}
 
-		const TStr RuleFNm = TUtils::GetRuleFName(DbPath);
-		const TStr BackupRuleFNm = TUtils::GetBackupRuleFName(DbPath);
+void TDataProvider::WriteWal(const TStateRecType& Type, const TMOut& RecOut) {
+	SetDirty(Type);
+	if (Wal.Empty()) { return; }
 
-		if (!TUtils::LoadStruct(RuleFNm, BackupRuleFNm, RuleInstV, Notify)) {
-			Notify->OnNotify(TNotifyType::ntInfo, "Rule instances don't exist or are corrupt, leaving empty vector...");
-			PersistRuleInstV();
-		}
+	try {
+		Wal->Write((uchar) Type, RecOut);
 	} catch (const PExcept& Except) {
-		Notify->OnNotify(TNotifyType::ntErr, "Failed to load instances for learning rules!");
+		Notify->OnNotify(TNotifyType::ntErr, "Failed to write to the write-ahead log!");
 		Notify->OnNotify(TNotifyType::ntErr, Except->GetMsgStr());
 	}
 }
 
-void TDataProvider::LoadWaterLevelV() {
-	Notify->OnNotify(TNotifyType::ntInfo, "Loading instances for predicting water level...");
-
-	try {
-		TLock Lck(HistSection);
-
-		const TStr WLevelFNm = TUtils::GetWaterLevelFNm(DbPath);
-		const TStr BackupWLevelFNm = TUtils::GetBackupWLevelFNm(DbPath);
-
-		if (!TUtils::LoadStruct(WLevelFNm, BackupWLevelFNm, WaterLevelV, Notify)) {
-			Notify->OnNotify(TNotifyType::ntInfo, "TDataProvider::LoadWaterLevelV: Water levels are missing or corrupt, loaded empty vector...");
-			PersistWaterLevelV();
-		}
-	} catch (const PExcept& Except) {
-		Notify->OnNotify(TNotifyType::ntErr, "Failed to load instances for predicting water level!");
-		Notify->OnNotify(TNotifyType::ntErr, Except->GetMsgStr());
+void TDataProvider::SetDirty(const uchar& Type) {
+	switch (Type) {
+	case srtHistSamples:
+	case srtHistDel: {
+		HistVer++;
+		break;
+	} case srtRuleInst:
+	case srtRuleInstV:
+	case srtRuleDel: {
+		RuleVer++;
+		break;
+	} case srtWaterLevel:
+	case srtWaterDel: {
+		WaterVer++;
+		break;
+	}
 	}
 }
 
-void TDataProvider::PersistHist() {
-	Notify->OnNotify(TNotifyType::ntInfo, "Persisting history...");
+int TDataProvider::ReplayWal(const bool& HistRecs, THash<TInt, TTmSeries>& SeriesH) {
+	Notify->OnNotifyFmt(TNotifyType::ntInfo, "Replaying the %s records of the write-ahead log...",
+			HistRecs ? "history" : "other");
 
+	int Recs = 0;
 	try {
-		TLock Lock(HistSection);
-
-		const TStr HistFName = TUtils::GetHistFName(DbPath);
-		const TStr BackupFName = TUtils::GetHistBackupFName(DbPath);
+		// the current log only holds old records if it couldn't be moved
+		// to the old one at startup
+		TStrV FNameV;
+		FNameV.Add(TUtils::GetPrevWalFName(DbPath));
+		if (Wal.Empty()) { FNameV.Add(TUtils::GetWalFName(DbPath)); }
+
+		for (int FNameN = 0; FNameN < FNameV.Len(); FNameN++) {
+			const TStr& FName = FNameV[FNameN];
+			if (!TFile::Exists(FName)) { continue; }
+
+			TAdriaWalReader Reader(FName);
+
+			uchar Type;
+			TMem RecBf;
+			while (Reader.Next(Type, RecBf)) {
+				const bool IsHistRec = Type == srtHistSamples || Type == srtHistDel;
+				if (IsHistRec != HistRecs) { continue; }
+
+				TMIn SIn(RecBf.GetBf(), RecBf.Len());
+				ReplayRec(Type, SIn, SeriesH);
+				// the history loader marks history when it merges it
+				if (!HistRecs) { SetDirty(Type); }
+				Recs++;
+			}
 
-		TUtils::PersistStruct(HistFName, BackupFName, HistH, Notify);
+			// both loaders read the log, warn once
+			if (Reader.IsTorn() && !HistRecs) {
+				Notify->OnNotifyFmt(TNotifyType::ntWarn, "%s ends with a damaged record, the record was dropped!", FName.CStr());
+			}
+		}
 
-		Notify->OnNotify(TNotifyType::ntInfo, "History persisted!");
+		Notify->OnNotifyFmt(TNotifyType::ntInfo, "Replayed %d records!", Recs);
 	} catch (const PExcept& Except) {
-		Notify->OnNotify(TNotifyType::ntErr, "Failed to persist history!");
+		Notify->OnNotify(TNotifyType::ntErr, "Failed to replay the write-ahead log!");
 		Notify->OnNotify(TNotifyType::ntErr, Except->GetMsgStr());
 	}
-}
-
-void TDataProvider::PersistRuleInstV() {
-	Notify->OnNotify(TNotifyType::ntInfo, "Persisting rules...");
-
-	try {
-		TLock Lck(RuleSection);
 
-		const TStr RuleFName = TUtils::GetRuleFName(DbPath);
-		const TStr BackupRuleFName = TUtils::GetBackupRuleFName(DbPath);
+	return Recs;
+}
 
-		// remove the file and create a new file
-		if (TFile::Exists(RuleFName)) {
-			TFile::Del(RuleFName);
+void TDataProvider::ReplayRec(const uchar& Type, TSIn& SIn, THash<TInt, TTmSeries>& SeriesH) {
+	switch (Type) {
+	case srtHistSamples: {
+		const uint64 Tm = TUInt64(SIn);
+		const int Samples = TInt(SIn);
+		for (int SampleN = 0; SampleN < Samples; SampleN++) {
+			const TInt CanId(SIn);
+			const TFlt Val(SIn);
+
+			// samples are stored at increasing times, older ones are already there
+			TTmSeries& Series = SeriesH.AddDat(CanId);
+			if (Series.Empty() || Tm > Series.GetLastTm()) {
+				Series.Add(Tm, Val);
+			}
 		}
-
-		// save a new rule file
-		{
-			TFOut Out(RuleFName);
-			RuleInstV.Save(Out);
+		break;
+	} case srtHistDel: {
+		const TInt CanId(SIn);
+		const uint64 MnTm = TUInt64(SIn);
+		if (SeriesH.IsKey(CanId)) {
+			SeriesH.GetDat(CanId).DelBefore(MnTm);
 		}
-
-		// the new file is created, now create a new backup file
-		// first remove the old backup file
-		if (TFile::Exists(BackupRuleFName)) {
-			TFile::Del(BackupRuleFName);
+		break;
+	} case srtRuleInst: {
+		const int NInst = TInt(SIn);
+		const uint64 Tm = TUInt64(SIn);
+		const TFltV StateV(SIn);
+		if (RuleInstV.Empty() || Tm > RuleInstV.Last().Key) {
+			for (int i = 0; i < NInst; i++) {
+				RuleInstV.Add(TKeyDat<TUInt64,TFltV>(Tm, StateV));
+			}
 		}
-
-		// save a new rule file
-		{
-			TFOut Out(BackupRuleFName);
-			RuleInstV.Save(Out);
+		break;
+	} case srtRuleInstV: {
+		const uint64 Tm = TUInt64(SIn);
+		const int NInst = TInt(SIn);
+		const bool IsNew = RuleInstV.Empty() || Tm > RuleInstV.Last().Key;
+		for (int InstN = 0; InstN < NInst; InstN++) {
+			const TFltV StateV(SIn);
+			if (IsNew) { RuleInstV.Add(TKeyDat<TUInt64,TFltV>(Tm, StateV)); }
 		}
-	} catch (const PExcept& Except) {
-		Notify->OnNotify(TNotifyType::ntErr, "Failed to persist rule instances!");
-		Notify->OnNotify(TNotifyType::ntErr, Except->GetMsgStr());
+		break;
+	} case srtRuleDel: {
+		const uint64 OldestTm = TUInt64(SIn);
+		int DelN = 0;
+		while (DelN < RuleInstV.Len() && RuleInstV[DelN].Key < OldestTm) { DelN++; }
+		if (DelN > 0) { RuleInstV.Del(0, DelN-1); }
+		break;
+	} case srtWaterLevel: {
+		const uint64 Tm = TUInt64(SIn);
+		const TFlt WaterLevel(SIn);
+		if (WaterLevelV.Empty() || Tm > WaterLevelV.Last().Val1) {
+			WaterLevelV.Add(TUInt64FltPr(Tm, WaterLevel));
+		}
+		break;
+	} case srtWaterDel: {
+		const uint64 MnTm = TUInt64(SIn);
+		int DelN = 0;
+		while (DelN < WaterLevelV.Len() && WaterLevelV[DelN].Val1 < MnTm) { DelN++; }
+		if (DelN > 0) { WaterLevelV.Del(0, DelN-1); }
+		break;
+	} default: {
+		Notify->OnNotifyFmt(TNotifyType::ntWarn, "Unknown write-ahead log record: %d", (int) Type);
+	}
 	}
 }
 
-void TDataProvider::PersistWaterLevelV() {
-	Notify->OnNotify(TNotifyType::ntInfo, "Persisting water levels...");
+bool TDataProvider::Checkpoint() {
+	// one checkpoint at a time, they share the old log and the temporary
+	// files and the persisted versions are only touched here
+	TLock CheckpointLck(CheckpointSection);
+
+	{
+		TLock Lck(PersistSection);
+		if (PendingLoads > 0) { return false; }
+	}
+
+	try {
+		const TStr WalFName = TUtils::GetWalFName(DbPath);
+		const TStr PrevWalFName = TUtils::GetPrevWalFName(DbPath);
+
+		THash<TInt, TTmSeries> HistSnap;
+		THistSnapClr<THash<TInt, TTmSeries>> HistSnapClr(HistSection, HistSnap);
+		TVec<TKeyDat<TUInt64,TFltV>> RuleInstSnap;
+		TUInt64FltPrV WaterLevelSnap;
+
+		bool SaveHist, SaveRules, SaveWater;
+		uint64 SnapHistVer, SnapRuleVer, SnapWaterVer;
+		uint64 LockTm;
+
+		{
+			TLock HistLck(HistSection);
+			TLock RuleLck(RuleSection);
+
+			const uint64 LockStartTm = TUtils::GetCurrTimeMicros();
+
+			SaveHist = HistVer != PersistedHistVer;
+			SaveRules = RuleVer != PersistedRuleVer;
+			SaveWater = WaterVer != PersistedWaterVer;
+
+			if (!SaveHist && !SaveRules && !SaveWater && !Wal.Empty()) {
+				TLock Lck(PersistSection);
+				SkippedCheckpoints++;
+				LastCheckpointTm = TUtils::GetCurrTimeStamp();
+				return true;
+			}
+
+			Notify->OnNotify(TNotifyType::ntInfo, "Checkpointing...");
+
+			// copy the changed structures, the sealed chunks of the history are
+			// immutable and shared with the copy
+			if (SaveHist) {
+				int KeyId = HistH.FFirstKeyId();
+				while (HistH.FNextKeyId(KeyId)) {
+					HistH[KeyId].GetSnapshot(HistSnap.AddDat(HistH.GetKey(KeyId)));
+				}
+			}
+			if (SaveRules) { RuleInstSnap = RuleInstV; }
+			if (SaveWater) { WaterLevelSnap = WaterLevelV; }
+
+			SnapHistVer = HistVer;
+			SnapRuleVer = RuleVer;
+			SnapWaterVer = WaterVer;
+
+			// the changes from now on go to a new log, the old one is
+			// dropped once the copies are saved
+			if (Wal.Empty()) {
+				TAdriaWal::MoveRecs(WalFName, PrevWalFName);
+				Wal = TAdriaWal::New(WalFName);
+			} else {
+				Wal->Rotate(PrevWalFName);
+			}
+
+			LockTm = TUtils::GetCurrTimeMicros() - LockStartTm;
+		}
+
+		// encode and write without holding the locks
+		const uint64 PersistStartTm = TUtils::GetCurrTimeMicros();
+
+		bool Persisted = true;
+		if (SaveHist) {
+			if (PersistHist(HistSnap)) { PersistedHistVer = SnapHistVer; } else { Persisted = false; }
+		}
+		if (SaveRules) {
+			if (PersistRuleInstV(RuleInstSnap)) { PersistedRuleVer = SnapRuleVer; } else { Persisted = false; }
+		}
+		if (SaveWater) {
+			if (PersistWaterLevelV(WaterLevelSnap)) { PersistedWaterVer = SnapWaterVer; } else { Persisted = false; }
+		}
+
+		// a failed structure stays dirty and its changes stay in the old log
+		if (Persisted && TFile::Exists(PrevWalFName)) {
+			TFile::Del(PrevWalFName);
+		}
+
+		const uint64 PersistTm = TUtils::GetCurrTimeMicros() - PersistStartTm;
+
+		{
+			TLock Lck(PersistSection);
+
+			if (Persisted) { Checkpoints++; } else { FailedCheckpoints++; }
+			LastLockTm = LockTm;
+			MxLockTm = TMath::Mx(MxLockTm, LockTm);
+			LastPersistTm = PersistTm;
+			MxPersistTm = TMath::Mx(MxPersistTm, PersistTm);
+			LastCheckpointTm = TUtils::GetCurrTimeStamp();
+		}
+
+		Notify->OnNotifyFmt(TNotifyType::ntInfo, "Checkpoint %s, locks held %.2fms, saving took %.2fms",
+				Persisted ? "done" : "failed, keeping the old log", LockTm / 1e3, PersistTm / 1e3);
+
+		return Persisted;
+	} catch (const PExcept& Except) {
+		Notify->OnNotify(TNotifyType::ntErr, "Failed to checkpoint!");
+		Notify->OnNotify(TNotifyType::ntErr, Except->GetMsgStr());
+		return false;
+	}
+}
+
+void TDataProvider::CheckpointIfDue() {
+	// checked under the checkpoint lock, so a checkpoint which just
+	// finished, like the one made after loading, isn't repeated
+	TLock CheckpointLck(CheckpointSection);
+
+	bool Due;
+	{
+		TLock Lck(PersistSection);
+		// the first checkpoint is made by the last loader
+		Due = PendingLoads == 0 && TUtils::GetCurrTimeStamp() - LastCheckpointTm >= CheckpointTm;
+	}
+
+	if (Due) {
+		Checkpoint();
+	}
+}
+
+PJsonVal TDataProvider::GetPersistStatJson() {
+	TLock Lck(PersistSection);
+
+	PJsonVal StatJson = TJsonVal::NewObj();
+	StatJson->AddToObj("checkpoints", (double) Checkpoints);
+	StatJson->AddToObj("failed", (double) FailedCheckpoints);
+	StatJson->AddToObj("skipped", (double) SkippedCheckpoints);
+	StatJson->AddToObj("lastLockMs", LastLockTm / 1e3);
+	StatJson->AddToObj("maxLockMs", MxLockTm / 1e3);
+	StatJson->AddToObj("lastPersistMs", LastPersistTm / 1e3);
+	StatJson->AddToObj("maxPersistMs", MxPersistTm / 1e3);
+	if (!Wal.Empty()) { StatJson->AddToObj("wal", Wal->GetStatJson()); }
+
+	PJsonVal LoadJson = TJsonVal::NewObj();
+	LoadJson->AddToObj("loading", PendingLoads > 0);
+	LoadJson->AddToObj("readyMs", StartupTm / 1e3);
+	LoadJson->AddToObj("historyMs", HistLoadTm / 1e3);
+	LoadJson->AddToObj("ruleInstancesMs", RuleLoadTm / 1e3);
+	LoadJson->AddToObj("waterLevelsMs", WaterLoadTm / 1e3);
+	LoadJson->AddToObj("walReplayMs", ReplayTm / 1e3);
+	StatJson->AddToObj("load", LoadJson);
+
+	return StatJson;
+}
+
+bool TDataProvider::LoadHistFile(const TStr& FName, THash<TInt, TTmSeries>& SeriesH) {
+	if (!TFile::Exists(FName)) { return false; }
+
+	try {
+		PSIn SIn = TUtils::OpenStructFile(FName);
+		THistFile::Load(*SIn, SeriesH);
+		return true;
+	} catch (const PExcept& Except) {
+		Notify->OnNotifyFmt(TNotifyType::ntWarn, "Failed to load history from %s!", FName.CStr());
+		Notify->OnNotify(TNotifyType::ntWarn, Except->GetMsgStr());
+		SeriesH.Clr();
+		return false;
+	}
+}
+
+void TDataProvider::LoadHistV() {
+	Notify->OnNotify(TNotifyType::ntInfo, "TDataProvider::LoadHistV: Loading history...");
+
+	const uint64 StartTm = TUtils::GetCurrTimeMicros();
+
+	try {
+		const TStr HistFName = TUtils::GetHistFName(DbPath);
+		const TStr BackupFName = TUtils::GetHistBackupFName(DbPath);
+
+		// loaded aside without the lock, the samples stored in the
+		// meantime are merged in at the end
+		THash<TInt, TTmSeries> LoadH;
+		// holds the replaced chunks of HistH after the swap
+		THistSnapClr<THash<TInt, TTmSeries>> LoadClr(HistSection, LoadH);
+		THash<TInt, TUInt64FltKdV> HistVH;
+		if (LoadHistFile(HistFName, LoadH) || LoadHistFile(BackupFName, LoadH)) {
+			Notify->OnNotifyFmt(TNotifyType::ntInfo, "TDataProvider::LoadHistV: Loaded history of %d CAN IDs", LoadH.Len());
+		} else if (TUtils::LoadStruct(HistFName, BackupFName, HistVH, Notify)) {
+			// the old format stores every series as a vector, newest sample first
+			Notify->OnNotify(TNotifyType::ntInfo, "TDataProvider::LoadHistV: Converting history from the old format...");
+			LoadH.Clr();
+
+			int KeyId = HistVH.FFirstKeyId();
+			while (HistVH.FNextKeyId(KeyId)) {
+				LoadH.AddDat(HistVH.GetKey(KeyId)).SetNewestFirst(HistVH[KeyId]);
+			}
+
+			PersistHist(LoadH);
+		} else {
+			Notify->OnNotify(TNotifyType::ntInfo, "History doesn't exist or is corrupt! Creating new history vector...");
+
+			// get CAN IDs
+			TIntV KeyV;	TDataProvider::CanIdVarNmH.GetKeyV(KeyV);
+			LoadH.Clr();
+
+			for (int i = 0; i < KeyV.Len(); i++) {
+				const TInt& CanId = KeyV[i];
+
+				LoadH.AddDat(CanId, TTmSeries());
+			}
+
+			PersistHist(LoadH);
+		}
+
+		const int Recs = ReplayWal(true, LoadH);
+
+		{
+			TLock Lck(HistSection);
+
+			// the samples stored while loading are newer than the loaded ones
+			int KeyId = HistH.FFirstKeyId();
+			while (HistH.FNextKeyId(KeyId)) {
+				TTmSeries& Series = LoadH.AddDat(HistH.GetKey(KeyId));
+
+				TUInt64FltKdV SampleV;
+				HistH[KeyId].GetNewestFirst(SampleV);
+				for (int SampleN = SampleV.Len()-1; SampleN >= 0; SampleN--) {
+					const TUInt64FltKd& Sample = SampleV[SampleN];
+					if (Series.Empty() || Sample.Key > Series.GetLastTm()) {
+						Series.Add(Sample.Key, Sample.Dat);
+					}
+				}
+			}
+
+			HistH.Swap(LoadH);
+			if (Recs > 0) { SetDirty(srtHistSamples); }
+			HistCache.Invalidate();
+		}
+	} catch (const PExcept& Except) {
+		Notify->OnNotify(TNotifyType::ntErr, "TDataProvider::LoadHistV: Failed to load history!");
+		Notify->OnNotify(TNotifyType::ntErr, Except->GetMsgStr());
+	}
+
+	const uint64 LoadTm = TUtils::GetCurrTimeMicros() - StartTm;
+	{
+		TLock Lck(PersistSection);
+		HistLoadTm = LoadTm;
+	}
+
+	Notify->OnNotifyFmt(TNotifyType::ntInfo, "TDataProvider::LoadHistV: History loaded in %.2fms", LoadTm / 1e3);
+	OnStructLoaded();
+}
+
+void TDataProvider::LoadRuleInstV() {
+	Notify->OnNotify(TNotifyType::ntInfo, "Loading instances for learning rules...");
+
+	const uint64 StartTm = TUtils::GetCurrTimeMicros();
+
+	try {
+		TLock Lck(RuleSection);
+
+		const TStr RuleFNm = TUtils::GetRuleFName(DbPath);
+		const TStr BackupRuleFNm = TUtils::GetBackupRuleFName(DbPath);
+
+		if (!TUtils::LoadStruct(RuleFNm, BackupRuleFNm, RuleInstV, Notify)) {
+			Notify->OnNotify(TNotifyType::ntInfo, "Rule instances don't exist or are corrupt, leaving empty vector...");
+			PersistRuleInstV(RuleInstV);
+		}
+	} catch (const PExcept& Except) {
+		Notify->OnNotify(TNotifyType::ntErr, "Failed to load instances for learning rules!");
+		Notify->OnNotify(TNotifyType::ntErr, Except->GetMsgStr());
+	}
+
+	TLock Lck(PersistSection);
+	RuleLoadTm = TUtils::GetCurrTimeMicros() - StartTm;
+}
+
+void TDataProvider::LoadWaterLevelV() {
+	Notify->OnNotify(TNotifyType::ntInfo, "Loading instances for predicting water level...");
+
+	const uint64 StartTm = TUtils::GetCurrTimeMicros();
 
 	try {
 		TLock Lck(HistSection);
 
-		TUtils::PersistStruct(TUtils::GetWaterLevelFNm(DbPath), TUtils::GetBackupWLevelFNm(DbPath), WaterLevelV, Notify);
+		const TStr WLevelFNm = TUtils::GetWaterLevelFNm(DbPath);
+		const TStr BackupWLevelFNm = TUtils::GetBackupWLevelFNm(DbPath);
+
+		if (!TUtils::LoadStruct(WLevelFNm, BackupWLevelFNm, WaterLevelV, Notify)) {
+			Notify->OnNotify(TNotifyType::ntInfo, "TDataProvider::LoadWaterLevelV: Water levels are missing or corrupt, loaded empty vector...");
+			PersistWaterLevelV(WaterLevelV);
+		}
+	} catch (const PExcept& Except) {
+		Notify->OnNotify(TNotifyType::ntErr, "Failed to load instances for predicting water level!");
+		Notify->OnNotify(TNotifyType::ntErr, Except->GetMsgStr());
+	}
+
+	TLock Lck(PersistSection);
+	WaterLoadTm = TUtils::GetCurrTimeMicros() - StartTm;
+}
+
+void TDataProvider::OnStructLoaded() {
+	bool Loaded;
+	{
+		TLock Lck(PersistSection);
+		Loaded = --PendingLoads == 0;
+	}
+
+	// saves whatever was replayed or converted and drops the old log,
+	// serialized with the checkpoints of the persist thread
+	if (Loaded) {
+		Notify->OnNotify(TNotifyType::ntInfo, "All structures loaded!");
+		Checkpoint();
+	}
+}
+
+bool TDataProvider::PersistHist(const THash<TInt, TTmSeries>& SeriesH) {
+	Notify->OnNotify(TNotifyType::ntInfo, "Persisting history...");
+
+	try {
+		const TStr HistFName = TUtils::GetHistFName(DbPath);
+		const TStr BackupFName = TUtils::GetHistBackupFName(DbPath);
+
+		// the sealed chunks are saved without re-encoding
+		THistFile HistFile(SeriesH);
+		if (!TUtils::PersistStruct(HistFName, BackupFName, HistFile, Notify)) { return false; }
+
+		int Samples = 0, MemUsed = 0;
+		int KeyId = SeriesH.FFirstKeyId();
+		while (SeriesH.FNextKeyId(KeyId)) {
+			Samples += SeriesH[KeyId].Len();
+			MemUsed += SeriesH[KeyId].GetMemUsed();
+		}
+
+		Notify->OnNotifyFmt(TNotifyType::ntInfo, "History persisted, %d samples in %d bytes!", Samples, MemUsed);
+		return true;
+	} catch (const PExcept& Except) {
+		Notify->OnNotify(TNotifyType::ntErr, "Failed to persist history!");
+		Notify->OnNotify(TNotifyType::ntErr, Except->GetMsgStr());
+		return false;
+	}
+}
+
+bool TDataProvider::PersistRuleInstV(const TVec<TKeyDat<TUInt64,TFltV>>& InstV) {
+	Notify->OnNotify(TNotifyType::ntInfo, "Persisting rules...");
+
+	try {
+		return TUtils::PersistStruct(TUtils::GetRuleFName(DbPath), TUtils::GetBackupRuleFName(DbPath), InstV, Notify);
+	} catch (const PExcept& Except) {
+		Notify->OnNotify(TNotifyType::ntErr, "Failed to persist rule instances!");
+		Notify->OnNotify(TNotifyType::ntErr, Except->GetMsgStr());
+		return false;
+	}
+}
+
+bool TDataProvider::PersistWaterLevelV(const TUInt64FltPrV& LevelV) {
+	Notify->OnNotify(TNotifyType::ntInfo, "Persisting water levels...");
+
+	try {
+		return TUtils::PersistStruct(TUtils::GetWaterLevelFNm(DbPath), TUtils::GetBackupWLevelFNm(DbPath), LevelV, Notify);
 	} catch (const PExcept& Except) {
 		Notify->OnNotify(TNotifyType::ntErr, "TDataProvider::PersistWaterLevelV: Failed to persist water levels!");
 		Notify->OnNotify(TNotifyType::ntErr, Except->GetMsgStr());
+		return false;
+	}
+}
+
+
+//////////////////////////////////////////////////////////
+// Message worker
+const int TAdriaCommunicator::TMsgWorker::QUEUE_CAP = 1024;
+const int TAdriaCommunicator::TMsgWorker::MX_BATCH_LEN = 64;
+const int TAdriaCommunicator::TMsgWorker::IDLE_WAIT_MSECS = 10;
+
+TAdriaCommunicator::TMsgWorker::TMsgWorker(const TStr& _Name, TAdriaCommunicator* _Communicator,
+			const PNotify& _Notify):
+		Name(_Name),
+		Communicator(_Communicator),
+		MsgQ(QUEUE_CAP),
+		Blocker(),
+		MsgBatchV(MX_BATCH_LEN, 0),
+		Running(true),
+		Busy(false),
+		MxDepth(0),
+		Enqueued(0),
+		FullWaits(0),
+		Processed(0),
+		TotalQueueMicros(0),
+		MxQueueMicros(0),
+		TotalHandleMicros(0),
+		MxHandleMicros(0),
+		Notify(_Notify) {}
+
+void TAdriaCommunicator::TMsgWorker::Run() {
+	Notify->OnNotifyFmt(TNotifyType::ntInfo, "Started %s message worker.", Name.CStr());
+
+	PAdriaMsg Msg;
+	while (Running) {
+		try {
+			Busy = true;
+
+			// take what is queued, the whole batch is handed to the callbacks at once
+			const uint64 StartTm = TUtils::GetCurrTimeMicros();
+			while (MsgBatchV.Len() < MX_BATCH_LEN && MsgQ.Pop(Msg)) {
+				const uint64 QueueMicros = StartTm - TMath::Mn(StartTm, Msg->GetArrivalTm());
+
+				TotalQueueMicros += QueueMicros;
+				if (QueueMicros > MxQueueMicros) { MxQueueMicros = QueueMicros; }
+
+				MsgBatchV.Add(Msg);
+				Msg.Clr();
+			}
+
+			if (MsgBatchV.Empty()) {
+				Busy = false;
+				// the timeout covers a wake-up that came before we blocked
+				Blocker.Block(IDLE_WAIT_MSECS);
+				continue;
+			}
+
+			Communicator->OnMsgBatchReceived(MsgBatchV);
+
+			const uint64 HandleMicros = TUtils::GetCurrTimeMicros() - StartTm;
+			TotalHandleMicros += HandleMicros;
+			if (HandleMicros > MxHandleMicros) { MxHandleMicros = HandleMicros; }
+			Processed += MsgBatchV.Len();
+
+			// the messages are handled, recycle them
+			Communicator->MsgPool.Release(MsgBatchV);
+		} catch (const PExcept& Except) {
+			Notify->OnNotifyFmt(TNotifyType::ntErr, "TMsgWorker::Run: %s worker failed to handle messages: %s", Name.CStr(), Except->GetMsgStr().CStr());
+			MsgBatchV.Clr(false);
+		} catch (...) {
+			Notify->OnNotifyFmt(TNotifyType::ntErr, "TMsgWorker::Run: %s worker caught an unknown exception!", Name.CStr());
+			MsgBatchV.Clr(false);
+		}
+	}
+}
+
+void TAdriaCommunicator::TMsgWorker::Stop() {
+	Running = false;
+	Blocker.Release();
+}
+
+void TAdriaCommunicator::TMsgWorker::Add(PAdriaMsg& Msg) {
+	Enqueued++;
+
+	// the lane is full, stall the event loop until the worker catches up
+	// which in turn pushes back on the bus through TCP
+	if (!MsgQ.Push(Msg)) {
+		FullWaits++;
+		Blocker.Release();
+
+		do {
+			TSysProc::Sleep(1);
+		} while (Running && !MsgQ.Push(Msg));
 	}
+
+	const int Depth = MsgQ.Len();
+	if (Depth > MxDepth) { MxDepth = Depth; }
+}
+
+PJsonVal TAdriaCommunicator::TMsgWorker::GetStatJson() const {
+	PJsonVal StatJson = TJsonVal::NewObj();
+	StatJson->AddToObj("depth", MsgQ.Len());
+	StatJson->AddToObj("maxDepth", MxDepth);
+	StatJson->AddToObj("capacity", MsgQ.GetCap());
+	StatJson->AddToObj("enqueued", (double) Enqueued);
+	StatJson->AddToObj("fullWaits", (double) FullWaits);
+	StatJson->AddToObj("processed", (double) Processed);
+	StatJson->AddToObj("avgQueueMicros", Processed > 0 ? (double) TotalQueueMicros / Processed : 0.0);
+	StatJson->AddToObj("maxQueueMicros", (double) MxQueueMicros);
+	StatJson->AddToObj("avgHandleMicrosPerMsg", Processed > 0 ? (double) TotalHandleMicros / Processed : 0.0);
+	StatJson->AddToObj("maxHandleMicros", (double) MxHandleMicros);
+	return StatJson;
 }
 
 
 //////////////////////////////////////////////////////////
 // Adria Client
-TAdriaCommunicator::TAdriaCommunicator(const TStr& _Url, const int& _Port, const PNotify& _Notify):
+const int TAdriaCommunicator::MSG_POOL_SIZE = 64;
+const uint64 TAdriaCommunicator::SEND_HIGH_WATER_BYTES = 4 << 20;
+const int TAdriaCommunicator::MX_FLUSH_BYTES = 256 << 10;
+const int TAdriaCommunicator::RECONNECT_MIN_DELAY = 250;
+const int TAdriaCommunicator::RECONNECT_MAX_DELAY = 30000;
+const int TAdriaCommunicator::FRAMING_TIMEOUT = 5000;
+
+TAdriaCommunicator::TAdriaCommunicator(const TStr& _Url, const int& _Port, const PNotify& _Notify,
+			const bool& _Offline):
 		TSockEvent(),
 		Url(_Url),
 		Port(_Port),
+		Offline(_Offline),
 		SockHost(NULL),
 		Sock(NULL),
 		Notify(_Notify),
-		CurrMsg(TAdriaMsg::New(_Notify)),
+		Parser(_Notify),
+		MsgPool(MSG_POOL_SIZE, _Notify),
+		CurrMsg(MsgPool.Get()),
+		MsgBatchV(),
+		PriorityWorker(),
+		GeneralWorker(),
+		Capture(),
+		ChunkBf(),
+		SendQ(SEND_HIGH_WATER_BYTES),
+		FlushBf(MX_FLUSH_BYTES),
+		OfflineFrames(0),
+		FlushAsync(new uv_async_t),
+		FramingPending(false),
+		FramingTimer(new uv_timer_t),
+		ReconnectTimer(new uv_timer_t),
+		Rnd(0),
+		ReconnectAttempts(0),
+		DisconnectTm(0),
+		TotalReconnectAttempts(0),
+		Reconnects(0),
+		LastReconnectMSecs(0),
+		MxReconnectMSecs(0),
+		TotalReconnectMSecs(0),
 		MsgCallbacks(5,0),
 		SocketSection(TCriticalSectionType::cstRecursive),
 		CallbackSection(TCriticalSectionType::cstRecursive),
-		IsClosed(false) {
+		IsClosed(false),
+		IsConnected(false),
+		WorkersStopped(false),
+		BinaryFraming(false) {
+
+	// writers on any thread wake up the event loop through the async handle
+	uv_async_init(uv_default_loop(), FlushAsync, OnFlushAsync);
+	FlushAsync->data = this;
+
+	uv_timer_init(uv_default_loop(), ReconnectTimer);
+	ReconnectTimer->data = this;
+
+	uv_timer_init(uv_default_loop(), FramingTimer);
+	FramingTimer->data = this;
+
+	PriorityWorker = new TMsgWorker("priority", this, Notify);
+	GeneralWorker = new TMsgWorker("general", this, Notify);
+	PriorityWorker->Start();
+	GeneralWorker->Start();
+
+	if (!Offline) {
+		Connect();
+	}
+}
+
+TAdriaCommunicator::~TAdriaCommunicator() {
+	CloseConn();
+	StopWorkers();
+
+	// the handles are freed once libuv is done with them
+	FlushAsync->data = NULL;
+	uv_close((uv_handle_t*) FlushAsync, OnFlushAsyncClosed);
 
-	Connect();
+	uv_timer_stop(ReconnectTimer);
+	ReconnectTimer->data = NULL;
+	uv_close((uv_handle_t*) ReconnectTimer, OnReconnectTimerClosed);
+
+	uv_timer_stop(FramingTimer);
+	FramingTimer->data = NULL;
+	uv_close((uv_handle_t*) FramingTimer, OnFramingTimerClosed);
+	/*~TSockEvent();*/
 }
 
 void TAdriaCommunicator::OnConnect(const uint64& SockId) {
 	// compose adria protocol initialization request
 	Notify->OnNotifyFmt(TNotifyType::ntInfo, "Connected socket: %lu, writing desired inputs...", SockId);
 
-	Write("PUSH res_table|GET history,prediction&ANALYTICS,qm1\r\n");
-	Write("GET res_table\r\n");			// refresh the table
+	if (DisconnectTm > 0) {
+		const uint64 ReconnectMSecs = TTm::GetCurUniMSecs() - DisconnectTm;
+
+		Reconnects++;
+		LastReconnectMSecs = ReconnectMSecs;
+		TotalReconnectMSecs += ReconnectMSecs;
+		if (ReconnectMSecs > MxReconnectMSecs) { MxReconnectMSecs = ReconnectMSecs; }
+
+		Notify->OnNotifyFmt(TNotifyType::ntInfo, "Reconnected after %lu ms and %d attempts.", ReconnectMSecs, ReconnectAttempts);
+	}
+	ReconnectAttempts = 0;
+	DisconnectTm = 0;
+
+	// the new connection starts with the text framing, the binary frames
+	// queued before the drop wait until we know the bus still accepts it
+	BinaryFraming = false;
+	FramingPending = true;
+	uv_timer_start(FramingTimer, OnFramingTimer, FRAMING_TIMEOUT, 0);
+
+	// the handshake goes out before anything that was queued
+	Send(TMIn::New("PUSH res_table|GET history,history_sub,history_unsub,prediction,stats&ANALYTICS,qm1\r\n"));
+	Send(TMIn::New("GET res_table\r\n"));			// refresh the table
+	Send(TMIn::New("GET framing?binary\r\n"));		// ask for the compact binary framing
+
+	IsConnected = true;
+	ScheduleFlush();
 
 	OnAdriaConnected();
 }
@@ -1014,18 +2032,111 @@ void TAdriaCommunicator::OnRead(const uint64& SockId, const PSIn& SIn) {
 		{
 			TLock Lock(SocketSection);
 
-			// parse the protocol
-			CurrMsg->Read(SIn);
-		}
-		if (CurrMsg->IsComplete()) {
-			OnMsgReceived(CurrMsg);
+			// append the chunk to the receive buffer and parse all the complete
+			// frames, the trailing partial frame is resumed on the next read
+			if (Capture.Empty()) {
+				Parser.Feed(SIn);
+			} else {
+				// record the raw bytes before parsing them
+				Capture->Write(SIn, ChunkBf);
+				Parser.Feed(ChunkBf.GetBf(), ChunkBf.Len());
+			}
+
+			ReadMsgBatch(MsgBatchV);
 		}
+
+		// the workers handle and recycle the messages
+		DispatchMsgBatch(MsgBatchV);
 	} catch (const PExcept& Except) {
 		Notify->OnNotifyFmt(TNotifyType::ntErr, "Failed to Read: %s", Except->GetMsgStr().CStr());
 		Notify->OnNotify(TNotifyType::ntErr, "Reseting...");
 	}
 }
 
+void TAdriaCommunicator::ReadMsgBatch(TVec<PAdriaMsg>& MsgV, const uint64& CaptureTm) {
+	while (true) {
+		try {
+			if (!Parser.Next(*CurrMsg)) { break; }
+
+			CurrMsg->SetArrivalTm(TUtils::GetCurrTimeMicros());
+			CurrMsg->SetCaptureTm(CaptureTm);
+
+			// the framing negotiation is handled by the communicator itself
+			if (CurrMsg->IsPush() && CurrMsg->GetCommand() == TAdriaMsg::FRAMING) {
+				OnFramingReply(*CurrMsg);
+				continue;
+			}
+
+			// the message is handled after the receive buffer is reused
+			CurrMsg->MakeOwned();
+
+			MsgV.Add(CurrMsg);
+			CurrMsg = MsgPool.Get();
+		} catch (const PExcept& Except) {
+			// the parser skips the invalid frame, continue with the next one
+			Notify->OnNotifyFmt(TNotifyType::ntErr, "Failed to parse frame: %s", Except->GetMsgStr().CStr());
+		}
+	}
+}
+
+void TAdriaCommunicator::DispatchMsgBatch(TVec<PAdriaMsg>& MsgV) {
+	if (MsgV.Empty()) { return; }
+
+	bool HasPriority = false;
+	bool HasGeneral = false;
+
+	for (int i = 0; i < MsgV.Len(); i++) {
+		PAdriaMsg& Msg = MsgV[i];
+
+		if (Msg->IsPush() && Msg->GetCommand() == TAdriaMsg::RES_TABLE) {
+			GetWorker(PriorityWorker)->Add(Msg);
+			HasPriority = true;
+		} else {
+			GetWorker(GeneralWorker)->Add(Msg);
+			HasGeneral = true;
+		}
+	}
+
+	// the references were moved to the lanes
+	MsgV.Clr(false);
+
+	if (HasPriority) { GetWorker(PriorityWorker)->Wake(); }
+	if (HasGeneral) { GetWorker(GeneralWorker)->Wake(); }
+}
+
+void TAdriaCommunicator::WaitPipelineIdle() {
+	while (!GetWorker(PriorityWorker)->IsIdle() || !GetWorker(GeneralWorker)->IsIdle()) {
+		TSysProc::Sleep(10);
+	}
+}
+
+void TAdriaCommunicator::OnFramingReply(const TAdriaMsg& Msg) {
+	// the bus replies with the framing it accepted, anything but binary
+	// means it doesn't support it and we stay with the text framing
+	const bool IsBinary = Msg.GetContent() == TAdriaMsg::FRAMING_BINARY;
+	BinaryFraming = IsBinary;
+	Notify->OnNotifyFmt(TNotifyType::ntInfo, "Using %s framing.", IsBinary ? "binary" : "text");
+
+	FramingPending = false;
+	uv_timer_stop(FramingTimer);
+
+	// release or drop the held binary frames
+	ScheduleFlush();
+}
+
+void TAdriaCommunicator::OnFramingTimer(uv_timer_t* Timer ADRIA_UV_STATUS_ARG) {
+	TAdriaCommunicator* Communicator = (TAdriaCommunicator*) Timer->data;
+	if (Communicator == NULL || !Communicator->FramingPending) { return; }
+
+	Communicator->Notify->OnNotify(TNotifyType::ntWarn, "Bus didn't answer GET framing, staying with the text framing.");
+	Communicator->FramingPending = false;
+	Communicator->ScheduleFlush();
+}
+
+void TAdriaCommunicator::OnFramingTimerClosed(uv_handle_t* Handle) {
+	delete (uv_timer_t*) Handle;
+}
+
 void TAdriaCommunicator::OnGetHost(const PSockHost& SockHost) {
 	Notify->OnNotify(TNotifyType::ntInfo, "OnGetHost called...");
 
@@ -1038,6 +2149,7 @@ void TAdriaCommunicator::OnGetHost(const PSockHost& SockHost) {
 		Notify->OnNotify(TNotifyType::ntInfo, "Socket created!");
 	} else {
 		Notify->OnNotifyFmt(TNotifyType::ntErr, "Failed to connect to host %s: %s!", SockHost->GetHostNm().CStr(), SockHost->GetErrMsg().CStr());
+		Reconnect();
 	}
 }
 
@@ -1066,10 +2178,8 @@ void TAdriaCommunicator::OnError(const uint64& SockId, const int& ErrCd, const T
 }
 
 
-bool TAdriaCommunicator::Write(const PSIn& SIn) {
+bool TAdriaCommunicator::Send(const PSIn& SIn) {
 	try {
-		TLock Lock(SocketSection);
-
 		// send to socket
 		bool Ok;
 		TStr ErrMsg;
@@ -1090,7 +2200,89 @@ bool TAdriaCommunicator::Write(const PSIn& SIn) {
 }
 
 bool TAdriaCommunicator::Write(const TChA& Msg) {
-	return Write(TMIn::New(Msg));
+	TMem Frame(Msg.Len());
+	Frame.AddBf(Msg.CStr(), Msg.Len());
+	return Write(Frame);
+}
+
+bool TAdriaCommunicator::Write(const TMem& Frame, const bool& IsBinary) {
+	// replies to replayed traffic have nowhere to go
+	if (Offline) {
+		OfflineFrames++;
+		return true;
+	}
+
+	if (!SendQ.Push(Frame, IsBinary)) {
+		Notify->OnNotifyFmt(TNotifyType::ntWarn, "Send queue above high water mark (%lu bytes), dropping frame!", SendQ.GetBytes());
+		return false;
+	}
+
+	ScheduleFlush();
+	return true;
+}
+
+void TAdriaCommunicator::Flush() {
+	// keep the frames queued until the socket is connected
+	if (!IsConnected || Sock.Empty()) { return; }
+
+	const bool IsBinary = BinaryFraming;
+
+	// the binary frames can't be sent once the bus settled on the text framing
+	if (!IsBinary && !FramingPending) {
+		const int Dropped = SendQ.DelBinary();
+		if (Dropped > 0) {
+			Notify->OnNotifyFmt(TNotifyType::ntWarn, "Bus uses the text framing, dropping %d queued binary frames!", Dropped);
+		}
+	}
+
+	// while the framing is negotiated the frames go out up to the first binary one
+	FlushBf.Clr(false);
+	const int NFrames = SendQ.Peek(FlushBf, MX_FLUSH_BYTES, !IsBinary);
+
+	if (NFrames == 0) { return; }
+
+	// the frames stay queued if the send fails, they go out with the next
+	// flush or after reconnecting
+	if (!Send(TMIn::New(FlushBf.GetBf(), FlushBf.Len()))) { return; }
+	SendQ.OnSent(NFrames, FlushBf.Len());
+
+	// send the rest on the next tick so reads are not starved
+	if (!SendQ.Empty()) {
+		ScheduleFlush();
+	}
+}
+
+void TAdriaCommunicator::ScheduleFlush() {
+	// uv_async_send is thread safe, several calls before the loop
+	// wakes up result in a single callback
+	uv_async_send(FlushAsync);
+}
+
+void TAdriaCommunicator::OnFlushAsync(uv_async_t* Async ADRIA_UV_STATUS_ARG) {
+	TAdriaCommunicator* Communicator = (TAdriaCommunicator*) Async->data;
+	if (Communicator != NULL) {
+		Communicator->Flush();
+	}
+}
+
+void TAdriaCommunicator::OnFlushAsyncClosed(uv_handle_t* Handle) {
+	delete (uv_async_t*) Handle;
+}
+
+bool TAdriaCommunicator::WriteMsg(const TAdriaMsgMethod& Method, const TChA& Command,
+		const TChA& Params, const TChA& ComponentId, const TChView& Content) {
+	try {
+		// the framing can change on the event loop meanwhile, read it once
+		// and let the queued frame remember the one it was encoded in
+		const bool IsBinary = BinaryFraming.load();
+
+		TMem Frame;
+		TAdriaMsg::Encode(Method, Command, Params, ComponentId, Content, IsBinary, Frame);
+		return Write(Frame, IsBinary);
+	} catch (const PExcept& Except) {
+		Notify->OnNotifyFmt(TNotifyType::ntErr, "Failed to encode message: %s", Except->GetMsgStr().CStr());
+		return false;
+	}
 }
 
 void TAdriaCommunicator::Connect() {
@@ -1101,6 +2293,7 @@ void TAdriaCommunicator::Connect() {
 		TSockHost::GetAsyncSockHost(GetUrl(), this);
 	} catch (const PExcept& Except) {
 		Notify->OnNotifyFmt(TNotifyType::ntErr, "Failed to connect: %s", Except->GetMsgStr().CStr());
+		Reconnect();
 	} catch (...) {
 		Notify->OnNotify(TNotifyType::ntErr, "An unknown exception occurred while connecting!");
 		throw TExcept::New("Failed to connect socket!", "TAdriaClient::Connect()");
@@ -1110,46 +2303,202 @@ void TAdriaCommunicator::Connect() {
 void TAdriaCommunicator::CloseConn() {
 	Notify->OnNotify(TNotifyType::ntInfo, "TAdriaClient::CloseConn(): Disconnecting...");
 
+	// remember when the connection was lost to measure the reconnect
+	if (IsConnected) {
+		DisconnectTm = TTm::GetCurUniMSecs();
+	}
+
+	IsConnected = false;
 	Sock.Clr();
 
+	{
+		// a partial frame from the old connection is useless on the new one
+		TLock Lock(SocketSection);
+		Parser.Clr();
+	}
+
 	Notify->OnNotify(TNotifyType::ntInfo, "TAdriaClient::CloseConn(): Disconnected!");
 }
 
 void TAdriaCommunicator::Reconnect() {
+	if (IsClosed) { return; }
+
 	Notify->OnNotify(TNotifyType::ntInfo, "Reseting connection...");
 
 	try {
 		TSockEvent::UnReg(this);
-
-		sleep(1);
-
-		Connect();
-
-		Notify->OnNotify(TNotifyType::ntInfo, "Connection reset!");
 	} catch (const PExcept& Except) {
 		Notify->OnNotify(TNotifyType::ntErr, "An unknown exception occurred while reconnecting!");
 		Notify->OnNotify(TNotifyType::ntErr, Except->GetMsgStr());
 	}
+
+	// don't block the event loop, connect again from a timer
+	ScheduleReconnect();
+}
+
+void TAdriaCommunicator::ScheduleReconnect() {
+	// a drop can be reported by several callbacks, schedule only once
+	if (uv_is_active((uv_handle_t*) ReconnectTimer)) { return; }
+
+	// exponential backoff, half of the delay is random so the clients
+	// of a restarted bus don't all reconnect at the same moment
+	const int Exp = TMath::Mn(ReconnectAttempts, 16);
+	const uint64 MxDelay = TMath::Mn((uint64) RECONNECT_MIN_DELAY << Exp, (uint64) RECONNECT_MAX_DELAY);
+	const uint64 Delay = MxDelay/2 + Rnd.GetUniDevInt(int(MxDelay/2) + 1);
+
+	ReconnectAttempts++;
+	TotalReconnectAttempts++;
+
+	Notify->OnNotifyFmt(TNotifyType::ntInfo, "Reconnect attempt %d in %lu ms...", ReconnectAttempts, Delay);
+	uv_timer_start(ReconnectTimer, OnReconnectTimer, Delay, 0);
+}
+
+PJsonVal TAdriaCommunicator::GetReconnectStatJson() const {
+	PJsonVal StatJson = TJsonVal::NewObj();
+	StatJson->AddToObj("connected", IsConnected);
+	StatJson->AddToObj("attempts", ReconnectAttempts);
+	StatJson->AddToObj("totalAttempts", (double) TotalReconnectAttempts);
+	StatJson->AddToObj("reconnects", (double) Reconnects);
+	StatJson->AddToObj("lastMSecs", (double) LastReconnectMSecs);
+	StatJson->AddToObj("maxMSecs", (double) MxReconnectMSecs);
+	StatJson->AddToObj("avgMSecs", Reconnects > 0 ? (double) TotalReconnectMSecs / Reconnects : 0.0);
+	return StatJson;
+}
+
+void TAdriaCommunicator::OnReconnectTimer(uv_timer_t* Timer ADRIA_UV_STATUS_ARG) {
+	TAdriaCommunicator* Communicator = (TAdriaCommunicator*) Timer->data;
+	if (Communicator != NULL && !Communicator->IsClosed) {
+		Communicator->Connect();
+	}
+}
+
+void TAdriaCommunicator::OnReconnectTimerClosed(uv_handle_t* Handle) {
+	delete (uv_timer_t*) Handle;
+}
+
+void TAdriaCommunicator::StartCapture(const TStr& FNm) {
+	Notify->OnNotifyFmt(TNotifyType::ntInfo, "Capturing inbound traffic to %s...", FNm.CStr());
+
+	TLock Lock(SocketSection);
+	Capture = TAdriaCaptureWriter::New(FNm);
+}
+
+void TAdriaCommunicator::Replay(const TStr& FNm, const double& Speed) {
+	if (Speed > 0) {
+		Notify->OnNotifyFmt(TNotifyType::ntInfo, "Replaying %s at %.1fx speed...", FNm.CStr(), Speed);
+	} else {
+		Notify->OnNotifyFmt(TNotifyType::ntInfo, "Replaying %s as fast as possible...", FNm.CStr());
+	}
+
+	TAdriaCaptureReader Reader(FNm);
+	TMem ReplayBf;
+
+	const uint64 StartTm = TTm::GetCurUniMSecs();
+	const uint64 StartMicros = TUtils::GetCurrTimeMicros();
+
+	uint64 CaptureTm, FirstCaptureTm = 0, LastCaptureTm = 0;
+	uint64 Chunks = 0, Bytes = 0;
+
+	while (Reader.Next(CaptureTm, ReplayBf)) {
+		if (Chunks == 0) { FirstCaptureTm = CaptureTm; }
+		LastCaptureTm = CaptureTm;
+
+		// wait until the chunk is due
+		if (Speed > 0) {
+			const uint64 DueTm = StartTm + uint64((CaptureTm - FirstCaptureTm) / Speed);
+			const uint64 CurrTm = TTm::GetCurUniMSecs();
+			if (DueTm > CurrTm) {
+				TSysProc::Sleep(uint(DueTm - CurrTm));
+			}
+		}
+
+		{
+			// the data is stamped with the time it was captured at
+			TLock Lock(SocketSection);
+			Parser.Feed(ReplayBf.GetBf(), ReplayBf.Len());
+			ReadMsgBatch(MsgBatchV, CaptureTm);
+		}
+		DispatchMsgBatch(MsgBatchV);
+
+		Chunks++;
+		Bytes += ReplayBf.Len();
+	}
+
+	if (Reader.IsTorn()) {
+		Notify->OnNotifyFmt(TNotifyType::ntWarn, "%s ends with an incomplete chunk, the chunk was dropped!", FNm.CStr());
+	}
+
+	WaitPipelineIdle();
+
+	const double Secs = TMath::Mx(double(TUtils::GetCurrTimeMicros() - StartMicros) / 1e6, 1e-6);
+	const double CaptureSecs = double(LastCaptureTm - FirstCaptureTm) / 1e3;
+
+	Notify->OnNotifyFmt(TNotifyType::ntInfo, "Replayed %lu chunks, %lu bytes, %.1fs of traffic in %.2fs (%.1fx, %.1f KB/s).",
+			Chunks, Bytes, CaptureSecs, Secs, CaptureSecs / Secs, Bytes / Secs / 1024);
 }
 
 void TAdriaCommunicator::ShutDown() {
 	IsClosed = true;
 	CloseConn();
+	StopWorkers();
+}
+
+void TAdriaCommunicator::StopWorkers() {
+	if (WorkersStopped) { return; }
+	WorkersStopped = true;
+
+	GetWorker(PriorityWorker)->Stop();
+	GetWorker(GeneralWorker)->Stop();
+
+	// the workers call into the app and the data provider, wait until they
+	// finish the batch they are handling so the caller can tear those down
+	PriorityWorker->Join();
+	GeneralWorker->Join();
 }
 
 void TAdriaCommunicator::OnMsgReceived(const PAdriaMsg Msg) {
-	TVec<PAdriaMsgCallback> TempCallbacks;
-	{
-		TLock Lock(CallbackSection);
-		TempCallbacks.AddV(MsgCallbacks);
-	}
+	TVec<TAdriaMsgCallback*> TempCallbacks;	GetCallbacks(TempCallbacks);
 
-	CurrMsg = TAdriaMsg::New(Notify);
 	for (int i = 0; i < TempCallbacks.Len(); i++) {
 		TempCallbacks[i]->OnMsgReceived(Msg);
 	}
 }
 
+void TAdriaCommunicator::OnMsgBatchReceived(const TVec<PAdriaMsg>& MsgV) {
+	TVec<TAdriaMsgCallback*> TempCallbacks;	GetCallbacks(TempCallbacks);
+
+	for (int i = 0; i < TempCallbacks.Len(); i++) {
+		TempCallbacks[i]->OnMsgBatchReceived(MsgV);
+	}
+}
+
+PJsonVal TAdriaCommunicator::GetStatJson() {
+	PJsonVal StatJson = TJsonVal::NewObj();
+	StatJson->AddToObj("msgPool", MsgPool.GetStatJson());
+	StatJson->AddToObj("framing", BinaryFraming.load() ? "binary" : "text");
+	StatJson->AddToObj("sendQueue", SendQ.GetStatJson());
+	StatJson->AddToObj("reconnect", GetReconnectStatJson());
+	if (Offline) {
+		StatJson->AddToObj("offlineFrames", (double) OfflineFrames);
+	}
+	if (!Capture.Empty()) {
+		StatJson->AddToObj("capture", Capture->GetStatJson());
+	}
+
+	PJsonVal PipelineJson = TJsonVal::NewObj();
+	PipelineJson->AddToObj("priority", GetWorker(PriorityWorker)->GetStatJson());
+	PipelineJson->AddToObj("general", GetWorker(GeneralWorker)->GetStatJson());
+	StatJson->AddToObj("pipeline", PipelineJson);
+	return StatJson;
+}
+
+void TAdriaCommunicator::GetCallbacks(TVec<TAdriaMsgCallback*>& CallbackV) {
+	TLock Lock(CallbackSection);
+	for (int i = 0; i < MsgCallbacks.Len(); i++) {
+		CallbackV.Add(MsgCallbacks[i]());
+	}
+}
+
 void TAdriaCommunicator::OnAdriaConnected() {
 	Notify->OnNotify(TNotifyType::ntInfo, "OnAdriaConnected called...");
 
@@ -1170,16 +2519,28 @@ void TAdriaCommunicator::AddOnMsgReceivedCallback(const PAdriaMsgCallback& Callb
 }
 
 
+//////////////////////////////////////////////////////////
+// Message callback
+void TAdriaMsgCallback::OnMsgBatchReceived(const TVec<PAdriaMsg>& MsgV) {
+	for (int i = 0; i < MsgV.Len(); i++) {
+		OnMsgReceived(MsgV[i]);
+	}
+}
+
 /////////////////////////////////////////////////////////////////////////////
 // Adria - Server
 TAdriaApp::TAdriaApp(const PSockEvent& _Communicator, TDataProvider& _DataProvider, const PNotify& _Notify):
 		DataProvider(_DataProvider),
 		Communicator(_Communicator),
+		HistSubH(),
+		HistUpdatesSent(0),
+		SubSection(TCriticalSectionType::cstRecursive),
 		Notify(_Notify) {
 
 	((TAdriaCommunicator*) Communicator())->AddOnMsgReceivedCallback(this);
 	DataProvider.SetPredictionCallback(this);
 	DataProvider.SetRulesGeneratedCallback(this);
+	DataProvider.SetHistSampledCallback(this);
 }
 
 void TAdriaApp::OnMsgReceived(const PAdriaMsg& Msg) {
@@ -1188,8 +2549,14 @@ void TAdriaApp::OnMsgReceived(const PAdriaMsg& Msg) {
 			ProcessPushTable(Msg);
 		} else if (Msg->IsGet() && Msg->GetCommand() == TAdriaMsg::HISTORY) {
 			ProcessGetHistory(Msg);
+		} else if (Msg->IsGet() && Msg->GetCommand() == TAdriaMsg::HISTORY_SUB) {
+			ProcessGetHistorySub(Msg);
+		} else if (Msg->IsGet() && Msg->GetCommand() == TAdriaMsg::HISTORY_UNSUB) {
+			ProcessGetHistoryUnsub(Msg);
 		} else if (Msg->IsGet() && Msg->GetCommand() == TAdriaMsg::PREDICTION) {
 			ProcessGetPrediction(Msg);
+		} else if (Msg->IsGet() && Msg->GetCommand() == TAdriaMsg::STATS) {
+			ProcessGetStats(Msg);
 		} else {
 			Notify->OnNotifyFmt(TNotifyType::ntWarn, "Invalid message: %s", Msg->GetStr().CStr());
 		}
@@ -1201,6 +2568,12 @@ void TAdriaApp::OnMsgReceived(const PAdriaMsg& Msg) {
 
 void TAdriaApp::OnConnected() {
 	try {
+		// the components subscribe again after a reconnect
+		{
+			TLock Lock(SubSection);
+			HistSubH.Clr();
+		}
+
 		DataProvider.OnConnected();
 	} catch (const PExcept& Except) {
 		Notify->OnNotify(TNotifyType::ntErr, "Failed to run TAdriaServer::OnConnected()");
@@ -1208,6 +2581,69 @@ void TAdriaApp::OnConnected() {
 	}
 }
 
+void TAdriaApp::OnHistSampled(const uint64& SampleTm, const TIntFltH& SampleH) {
+	try {
+		TLock Lock(SubSection);
+
+		// every subscriber gets the new point of each of its series, encoded
+		// as a reply to GET history with one point per series, the series
+		// with the same encoding share a message
+		int KeyId = HistSubH.FFirstKeyId();
+		while (HistSubH.FNextKeyId(KeyId)) {
+			const TStr& ComponentId = HistSubH.GetKey(KeyId);
+			const THash<TInt, THistQuery>& CanQueryH = HistSubH[KeyId];
+
+			TVec<THistQuery> UpdateQueryV;
+			TVec<TVec<TUInt64FltKdV>> HistoryVVV;
+
+			int CanKeyId = CanQueryH.FFirstKeyId();
+			while (CanQueryH.FNextKeyId(CanKeyId)) {
+				const int& CanId = CanQueryH.GetKey(CanKeyId);
+				if (!SampleH.IsKey(CanId)) { continue; }
+
+				const THistQuery& CanQuery = CanQueryH[CanKeyId];
+
+				int QueryN = 0;
+				while (QueryN < UpdateQueryV.Len() && (UpdateQueryV[QueryN].Enc != CanQuery.Enc ||
+						UpdateQueryV[QueryN].Decimals != CanQuery.Decimals)) {
+					QueryN++;
+				}
+				if (QueryN == UpdateQueryV.Len()) {
+					UpdateQueryV.Add(CanQuery);
+					UpdateQueryV.Last().CanIdV.Clr();
+					HistoryVVV.Add();
+				}
+
+				UpdateQueryV[QueryN].CanIdV.Add(CanId);
+				TVec<TUInt64FltKdV>& HistoryVV = HistoryVVV[QueryN];
+				HistoryVV.Add();
+				HistoryVV.Last().Add(TUInt64FltKd(SampleTm, SampleH.GetDat(CanId)));
+			}
+
+			for (int QueryN = 0; QueryN < UpdateQueryV.Len(); QueryN++) {
+				const THistQuery& UpdateQuery = UpdateQueryV[QueryN];
+
+				TChA ParamChA = UpdateQuery.GetCanIdStr();
+				ParamChA += ";update=1";
+				if (UpdateQuery.Enc != hetTxt) {
+					ParamChA += ";enc=";
+					ParamChA += THistCodec::GetEncNm(UpdateQuery.Enc);
+				}
+
+				TChA ContentChA = "";
+				THistCodec::Encode(HistoryVVV[QueryN], UpdateQuery.Enc, UpdateQuery.Decimals, ContentChA);
+
+				((TAdriaCommunicator*) Communicator())->WriteMsg(TAdriaMsgMethod::ammPush, TAdriaMsg::HISTORY,
+						ParamChA, ComponentId, ContentChA);
+				HistUpdatesSent++;
+			}
+		}
+	} catch (const PExcept& Except) {
+		Notify->OnNotify(TNotifyType::ntErr, "Failed to push history updates!");
+		Notify->OnNotify(TNotifyType::ntErr, Except->GetMsgStr());
+	}
+}
+
 void TAdriaApp::OnPrediction(const TInt& CanId, const TFlt& Val) {
 	try {
 		TInt PredCanId = TDataProvider::CanIdPredCanIdH.GetDat(CanId);
@@ -1225,9 +2661,8 @@ void TAdriaApp::OnPrediction(const TInt& CanId, const TFlt& Val) {
 			ContentChA += *(ValueCh + i);
 		}
 
-		TChA Msg = "PUSH res_table\r\nLength=" + TInt(ContentChA.Len()).GetStr() + "\r\n" + ContentChA + "\r\n";
-
-		((TAdriaCommunicator*) Communicator())->Write(Msg);
+		((TAdriaCommunicator*) Communicator())->WriteMsg(TAdriaMsgMethod::ammPush, TAdriaMsg::RES_TABLE,
+				TChA(), TChA(), ContentChA);
 	} catch (const PExcept& Except) {
 		Notify->OnNotify(TNotifyType::ntErr, "Failed to process prediction callback!");
 		Notify->OnNotify(TNotifyType::ntErr, Except->GetMsgStr());
@@ -1275,8 +2710,8 @@ void TAdriaApp::OnRulesGenerated(const TVec<TPair<TStrV,TStr>>& RuleV) {
 			FOut.PutStr(LogStr);
 		}
 
-		TChA Msg = TChA("PUSH rules\r\nLength=") + TInt(RuleStr.Len()).GetStr() + "\r\n" + RuleStr + "\r\n";
-		((TAdriaCommunicator*) Communicator())->Write(Msg);
+		((TAdriaCommunicator*) Communicator())->WriteMsg(TAdriaMsgMethod::ammPush, TAdriaMsg::RULES,
+				TChA(), TChA(), RuleStr);
 	} catch (const PExcept& Except) {
 		Notify->OnNotify(TNotifyType::ntErr, "Failed to process rules generated callback!");
 		Notify->OnNotify(TNotifyType::ntErr, Except->GetMsgStr());
@@ -1287,113 +2722,179 @@ void TAdriaApp::ShutDown() {
 	((TAdriaCommunicator*) Communicator())->ShutDown();
 }
 
-void TAdriaApp::ParseTable(const TChA& Table, THash<TUInt, TFlt>& CanIdValH) {
-	int NEntries = Table.Len() / TAdriaMsg::BYTES_PER_EL;
+void TAdriaApp::ProcessPushTable(const PAdriaMsg& Msg) {
+	try {
+		// the records are decoded straight into the state table
+		const TChView& Table = Msg->GetContent();
+		DataProvider.AddRecBatch((const uint8*) Table.GetBf(), Table.Len(), Msg->GetTmStamp());
+	} catch (const PExcept& Except) {
+		Notify->OnNotify(TNotifyType::ntErr, "Failed to process PUSH res_table!");
+		Notify->OnNotify(TNotifyType::ntErr, Except->GetMsgStr());
+	}
+}
 
-	int StartIdx;
-	TUInt CanId;
-	float Val;
-	unsigned char Type;
-	for (int EntryIdx = 0; EntryIdx < NEntries; EntryIdx++) {
-		StartIdx = EntryIdx*TAdriaMsg::BYTES_PER_EL;
+void TAdriaApp::ProcessGetHistory(const PAdriaMsg& Msg) {
+	Notify->OnNotify(TNotifyType::ntInfo, "Received history request...");
 
-		CanId = TUInt((unsigned char) Table[StartIdx]);
-		Type = Table[StartIdx + 1];
+	try {
+		const TStr ComponentId = Msg->GetComponentId().GetStr();
 
-		switch (Type) {
-		case 0: {
-			Val = (float) Table[StartIdx + 2];
-			break;
-		} case 1: {
-			Val = *((float*) (Table.CStr() + StartIdx + 2));
-			break;
-		} default: {
-			throw TExcept::New("Invalid type of measurement!!");
-		}
+		THistQuery Query;
+		if (!THistQuery::Parse(Msg->GetParams(), Query)) {
+			Notify->OnNotifyFmt(TNotifyType::ntWarn, "Invalid history request: %s", Msg->GetParams().GetStr().CStr());
+			return;
 		}
 
-		CanIdValH.AddDat(CanId, Val);
+		SendHistory(Query, ComponentId);
+	} catch (const PExcept& Except) {
+		Notify->OnNotify(TNotifyType::ntErr, "Failed to process GET history!");
+		Notify->OnNotify(TNotifyType::ntErr, Except->GetMsgStr());
 	}
 }
 
+void TAdriaApp::ProcessGetHistorySub(const PAdriaMsg& Msg) {
+	Notify->OnNotify(TNotifyType::ntInfo, "Received history subscription...");
 
-void TAdriaApp::ProcessPushTable(const PAdriaMsg& Msg) {
 	try {
-		TStr TimeStr = TAdriaUtils::TUtils::GetCurrTimeStr();
+		const TStr ComponentId = Msg->GetComponentId().GetStr();
 
-		// parse the table
-		THash<TUInt, TFlt> CanIdValH;
-		const TChA& Table = Msg->GetContent();
+		THistQuery Query;
+		if (!THistQuery::Parse(Msg->GetParams(), Query)) {
+			Notify->OnNotifyFmt(TNotifyType::ntWarn, "Invalid history subscription: %s", Msg->GetParams().GetStr().CStr());
+			return;
+		}
 
-		ParseTable(Table, CanIdValH);
+		// the updates are single raw samples, so a rollup resolution, an
+		// end time or aligned series can't be honored for them
+		if (Query.ResN >= 0 || Query.ToTm != TUInt64::Mx || Query.Align) {
+			Notify->OnNotifyFmt(TNotifyType::ntWarn, "History subscriptions don't support res, to or align: %s",
+					Msg->GetParams().GetStr().CStr());
+			return;
+		}
 
-		TUIntV KeyV;	CanIdValH.GetKeyV(KeyV);
-		for (int i = 0; i < KeyV.Len(); i++) {
-			TUInt CanId = KeyV[i];
-			TFlt Val = CanIdValH(CanId);
+		// subscribe before taking the snapshot, so no sample is missed,
+		// a sample taken in between may be sent twice
+		{
+			TLock Lock(SubSection);
 
-			PJsonVal RecJson = TJsonVal::NewObj();
-			RecJson->AddToObj("timestamp", TimeStr);
-			RecJson->AddToObj("value", Val);
+			// every CAN ID keeps the encoding it was subscribed with
+			THash<TInt, THistQuery>& CanQueryH = HistSubH.AddDat(ComponentId);
+			for (int CanN = 0; CanN < Query.CanIdV.Len(); CanN++) {
+				const int& CanId = Query.CanIdV[CanN];
 
-			DataProvider.AddRec(CanId, RecJson);
+				THistQuery& CanQuery = CanQueryH.AddDat(CanId);
+				CanQuery = Query;
+				CanQuery.CanIdV.Gen(1, 0);
+				CanQuery.CanIdV.Add(CanId);
+			}
 		}
+
+		Notify->OnNotifyFmt(TNotifyType::ntInfo, "%s subscribed to history of CANs: %s",
+				ComponentId.CStr(), Query.GetCanIdStr().CStr());
+
+		// initial snapshot
+		SendHistory(Query, ComponentId);
 	} catch (const PExcept& Except) {
-		Notify->OnNotify(TNotifyType::ntErr, "Failed to process PUSH res_table!");
+		Notify->OnNotify(TNotifyType::ntErr, "Failed to process GET history_sub!");
 		Notify->OnNotify(TNotifyType::ntErr, Except->GetMsgStr());
 	}
 }
 
-void TAdriaApp::ProcessGetHistory(const PAdriaMsg& Msg) {
-	Notify->OnNotify(TNotifyType::ntInfo, "Received history request...");
-
+void TAdriaApp::ProcessGetHistoryUnsub(const PAdriaMsg& Msg) {
 	try {
-		const TStr ComponentId = Msg->GetComponentId();
-		const TInt CanId = TStr(Msg->GetParams()).GetInt();
+		const TStr ComponentId = Msg->GetComponentId().GetStr();
+
+		TLock Lock(SubSection);
 
-		TUInt64FltKdV HistoryV;	DataProvider.GetHistory(CanId, HistoryV);
+		if (!HistSubH.IsKey(ComponentId)) { return; }
+
+		// without parameters all the subscriptions of the component are dropped
+		THistQuery Query;
+		if (Msg->GetParams().Empty()) {
+			HistSubH.DelKey(ComponentId);
+		} else if (THistQuery::Parse(Msg->GetParams(), Query)) {
+			THash<TInt, THistQuery>& CanQueryH = HistSubH.GetDat(ComponentId);
+			for (int CanN = 0; CanN < Query.CanIdV.Len(); CanN++) {
+				CanQueryH.DelIfKey(Query.CanIdV[CanN]);
+			}
+			if (CanQueryH.Empty()) { HistSubH.DelKey(ComponentId); }
+		} else {
+			Notify->OnNotifyFmt(TNotifyType::ntWarn, "Invalid history unsubscription: %s", Msg->GetParams().GetStr().CStr());
+			return;
+		}
+
+		Notify->OnNotifyFmt(TNotifyType::ntInfo, "%s unsubscribed from history", ComponentId.CStr());
+	} catch (const PExcept& Except) {
+		Notify->OnNotify(TNotifyType::ntErr, "Failed to process GET history_unsub!");
+		Notify->OnNotify(TNotifyType::ntErr, Except->GetMsgStr());
+	}
+}
 
-		int NHist = HistoryV.Len();
+void TAdriaApp::SendHistory(const THistQuery& Query, const TStr& ComponentId) {
+	try {
+		// dashboards keep polling the same queries while the history only
+		// changes every few minutes, so the encoded replies are cached
+		THistReplyCache& HistCache = DataProvider.GetHistCache();
+		const TStr CacheKey = Query.GetKey();
 
-		// content
 		TChA ContentChA = "";
-		for (int i = 0; i < NHist; i++) {
-			const TUInt64FltKd& HistEntry = HistoryV[i];
+		TChA ParamChA = "";
+		int NHist;
 
-			ContentChA += HistEntry.Key.GetStr();
+		if (!HistCache.Get(CacheKey, ParamChA, ContentChA, NHist)) {
+			const uint64 StartTm = TUtils::GetCurrTimeMicros();
+			TUInt64V VersionV;	HistCache.GetVersionV(Query.CanIdV, VersionV);
 
-			ContentChA += ',';
+			TVec<TUInt64FltKdV> HistoryVV;
+			TVec<TTmBucketV> BucketVV;
+			const int ResN = DataProvider.GetHistory(Query, HistoryVV, BucketVV);
 
-			ContentChA += HistEntry.Dat.GetStr();
+			// content, see THistCodec for the format, all the requested
+			// series are sent in a single reply
+			const bool Align = Query.Align && Query.CanIdV.Len() > 1;
+			ParamChA = Query.GetCanIdStr();
 
-			if (i < NHist-1) {
-				ContentChA += ',';
-			}
-		}
+			NHist = 0;
+			if (ResN == TTmSeries::RES_RAW) {
+				for (int i = 0; i < HistoryVV.Len(); i++) { NHist += HistoryVV[i].Len(); }
+
+				if (Align) {
+					THistCodec::EncodeAligned(HistoryVV, Query.Enc, Query.Decimals, ContentChA);
+				} else {
+					THistCodec::Encode(HistoryVV, Query.Enc, Query.Decimals, ContentChA);
+				}
+			} else {
+				for (int i = 0; i < BucketVV.Len(); i++) { NHist += BucketVV[i].Len(); }
 
-		ContentChA += "\r\n";
+				if (Align) {
+					THistCodec::EncodeAligned(BucketVV, Query.Enc, Query.Decimals, ContentChA);
+				} else {
+					THistCodec::Encode(BucketVV, Query.Enc, Query.Decimals, ContentChA);
+				}
 
-		// generate PUSH message
-		// first line
-		TChA Msg = "PUSH history?";
-		Msg += CanId.GetStr();
-		Msg += "&";
-		Msg += ComponentId;
-		Msg += "\r\n";
+				// tell the client which resolution it got
+				ParamChA += ";res=";
+				ParamChA += TTmSeries::GetResNm(ResN);
+			}
 
-		// second line
-		Msg += "Length=";
-		Msg += TInt(ContentChA.Len()-2).GetStr();
-		Msg += "\r\n";
+			if (Query.Enc != hetTxt) {
+				ParamChA += ";enc=";
+				ParamChA += THistCodec::GetEncNm(Query.Enc);
+			}
+			if (Align) {
+				ParamChA += ";align=1";
+			}
 
-		Msg += ContentChA;
+			HistCache.Add(CacheKey, Query.CanIdV, VersionV, ParamChA, ContentChA, NHist, TUtils::GetCurrTimeMicros() - StartTm);
+		}
 
 		Notify->OnNotifyFmt(TNotifyType::ntInfo, "Sending history response. Number of values: %d", NHist);
 
-		// write the message to the socket
-		((TAdriaCommunicator*) Communicator())->Write(Msg);
+		// write the PUSH message to the socket
+		((TAdriaCommunicator*) Communicator())->WriteMsg(TAdriaMsgMethod::ammPush, TAdriaMsg::HISTORY,
+				ParamChA, ComponentId, ContentChA);
 	} catch (const PExcept& Except) {
-		Notify->OnNotify(TNotifyType::ntErr, "Failed to process GET history!");
+		Notify->OnNotify(TNotifyType::ntErr, "Failed to send history!");
 		Notify->OnNotify(TNotifyType::ntErr, Except->GetMsgStr());
 	}
 }
@@ -1407,3 +2908,32 @@ void TAdriaApp::ProcessGetPrediction(const PAdriaMsg& Msg) {
 		Notify->OnNotify(TNotifyType::ntErr, Except->GetMsgStr());
 	}
 }
+
+void TAdriaApp::ProcessGetStats(const PAdriaMsg& Msg) {
+	try {
+		Notify->OnNotify(TNotifyType::ntInfo, "Received stats request!");
+
+		PJsonVal StatJson = TJsonVal::NewObj();
+		StatJson->AddToObj("communicator", ((TAdriaCommunicator*) Communicator())->GetStatJson());
+		StatJson->AddToObj("historyCache", DataProvider.GetHistCache().GetStatJson());
+		StatJson->AddToObj("persistence", DataProvider.GetPersistStatJson());
+		StatJson->AddToObj("readingsLog", DataProvider.GetReadingsLogStatJson());
+
+		{
+			TLock Lock(SubSection);
+
+			PJsonVal SubJson = TJsonVal::NewObj();
+			SubJson->AddToObj("subscribers", HistSubH.Len());
+			SubJson->AddToObj("updatesSent", (double) HistUpdatesSent);
+			StatJson->AddToObj("historySubs", SubJson);
+		}
+
+		const TChA ContentChA = TJsonVal::GetStrFromVal(StatJson);
+
+		((TAdriaCommunicator*) Communicator())->WriteMsg(TAdriaMsgMethod::ammPush, TAdriaMsg::STATS,
+				TChA(), Msg->GetComponentId().GetStr(), ContentChA);
+	} catch (const PExcept& Except) {
+		Notify->OnNotify(TNotifyType::ntErr, "Failed to process GET stats!");
+		Notify->OnNotify(TNotifyType::ntErr, Except->GetMsgStr());
+	}
+}
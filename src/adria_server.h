@@ -7,11 +7,21 @@
 #include <thread.h>
 #include <analytics.h>
 #include <utils.h>
+#include <history.h>
+#include <uv.h>
+
+// libuv 1.0 dropped the status argument of the handle callbacks
+#if UV_VERSION_MAJOR >= 1
+	#define ADRIA_UV_STATUS_ARG
+#else
+	#define ADRIA_UV_STATUS_ARG , int
+#endif
 
 namespace TAdriaServer {
 
 using namespace TAdriaUtils;
 using namespace TAdriaAnalytics;
+using namespace TAdriaHistory;
 
 class TPredictionCallback {
 public:
@@ -25,10 +35,29 @@ public:
 	virtual ~TRulesGeneratedCallback() {}
 };
 
+class THistSampledCallback {
+public:
+	// called after every sample was added to the history, SampleH maps
+	// the CAN IDs to the sampled values
+	virtual void OnHistSampled(const uint64& SampleTm, const TIntFltH& SampleH) = 0;
+	virtual ~THistSampledCallback() {}
+};
+
 /////////////////////////////////////////////////////////////////////
 // Backup log and backup DB handler
 class TDataProvider {
 private:
+	// types of the write-ahead log records, the payloads are:
+	enum TStateRecType {
+		srtHistSamples = 1,		// time, count, (CAN ID, value)*
+		srtHistDel,				// CAN ID, time before which the samples are removed
+		srtRuleInst,			// count, time, state vector
+		srtRuleDel,				// time before which the instances are removed
+		srtWaterLevel,			// time, level
+		srtWaterDel,			// time before which the levels are removed
+		srtRuleInstV			// time, count, state vector*
+	};
+
 	// A thread that periodically updates the history table
 	class TSampleHistThread: public TThread {
 	public:
@@ -64,6 +93,74 @@ private:
 		void Stop() { Running = false; }
 	};
 
+	// A thread that saves the structures in the background
+	class TPersistThread: public TThread {
+	private:
+		static uint64 SleepTm;
+
+		TDataProvider* DataProvider;
+		bool Running;
+
+		PNotify Notify;
+
+	public:
+		TPersistThread(TDataProvider* Provider, const PNotify& _Notify);
+		void Run();
+		void Stop() { Running = false; }
+	};
+
+	// A thread that writes the readings log when its oldest reading is due,
+	// so a quiet bus doesn't leave readings in memory
+	class TReadingsLogThread: public TThread {
+	private:
+		static uint64 SleepTm;
+
+		TDataProvider* DataProvider;
+		bool Running;
+
+		PNotify Notify;
+
+	public:
+		TReadingsLogThread(TDataProvider* Provider, const PNotify& _Notify);
+		void Run();
+		void Stop() { Running = false; }
+	};
+
+	// loads one of the persisted structures at startup
+	class TLoadThread: public TThread {
+	public:
+		enum TStructType {
+			stHist,
+			stRuleInst
+		};
+
+	private:
+		TDataProvider* DataProvider;
+		TStructType StructType;
+
+	public:
+		TLoadThread(TDataProvider* Provider, const TStructType& _StructType);
+		void Run();
+	};
+
+	// clears a copy of the history under HistSection when it goes out of scope,
+	// also when an exception is thrown, the copies share the chunks of HistH
+	// whose reference counts are not atomic
+	template <class TSnap>
+	class THistSnapClr {
+	private:
+		TCriticalSection& HistSection;
+		TSnap& Snap;
+
+	public:
+		THistSnapClr(TCriticalSection& _HistSection, TSnap& _Snap):
+				HistSection(_HistSection), Snap(_Snap) {}
+		~THistSnapClr() {
+			TLock Lck(HistSection);
+			Snap.Clr();
+		}
+	};
+
 //	class TOnlineRuleThread: public TThread {
 //	private:
 //		const static uint64 SLEEP_TM;
@@ -80,10 +177,10 @@ public:
 	static TIntIntH CanIdPredCanIdH;
 
 private:
-	const static bool LOG_READINGS;
-
 	static TIntStrH CanIdVarNmH;
 	static uint64 HistDur;
+	static int HistSeriesMxMem;					// memory quota of the raw samples of a single series in bytes
+	static uint64 CheckpointTm;					// how often the structures are saved and the log reset
 	static uint64 RuleWindowTm;
 	static int EntryTblLen;
 	static bool FillCanHs();
@@ -93,43 +190,81 @@ private:
 	static TIntV RuleObsCanV;
 	static TIntIntH RuleEventCanIdIdxH;
 	static TIntIntH RuleObsCanIdIdxH;
+	static TBoolV IsRuleEventCanV;				// dense lookup of RuleEventCanIdIdxH, indexed by CAN ID
+	static TVec<TSamplePolicy> SamplePolicyV;	// history sampling policies, indexed by CAN ID
 
 	const TStr DbPath;
 	TFltV EntryTbl;								// current state
-	THash<TInt, TUInt64FltKdV> HistH;			// history for showing graphs and making predictions
+	THash<TInt, TTmSeries> HistH;				// history for showing graphs and making predictions
+	THistReplyCache HistCache;					// encoded GET history replies, dropped when their series change
 	TVec<TKeyDat<TUInt64,TFltV>> RuleInstV;		// table that contains values used to learn association rules
 	TUInt64FltPrV WaterLevelV;
 
+	PAdriaReadingsLog ReadingsLog;				// every reading, off unless started
+	PAdriaWal Wal;								// changes since the last checkpoint
+	uint64 LastCheckpointTm;
+
+	// dirty tracking, a structure is saved when its version differs
+	// from the last saved version
+	uint64 HistVer, PersistedHistVer;
+	uint64 RuleVer, PersistedRuleVer;
+	uint64 WaterVer, PersistedWaterVer;
+
+	// checkpoint statistics, times in microseconds
+	uint64 Checkpoints;
+	uint64 FailedCheckpoints;
+	uint64 SkippedCheckpoints;
+	uint64 LastLockTm, MxLockTm;
+	uint64 LastPersistTm, MxPersistTm;
+
+	// startup loading, the structures still being loaded and the load
+	// times in microseconds
+	int PendingLoads;
+	uint64 HistLoadTm, RuleLoadTm, WaterLoadTm, ReplayTm, StartupTm;
+
 	TLinRegWrapper WaterLevelReg;
 //	TOnlineRuleGenerator RuleGenerator;
 
 	PThread HistThread;
 	PThread RuleThread;
+	PThread PersistThread;
+	PThread HistLoadThread;
+	PThread ReadingsLogThread;
 //	PThread OnlineRuleThread;
 
 	TPredictionCallback* PredictionCallback;
 	TRulesGeneratedCallback* RulesCallback;
+	THistSampledCallback* HistCallback;
 
 	TCriticalSection DataSection;
 	TCriticalSection HistSection;
 	TCriticalSection RuleSection;
+	TCriticalSection PersistSection;
+	TCriticalSection CheckpointSection;			// taken before all the other sections
 	PNotify Notify;
 
 public:
 	TDataProvider(const TStr& DbPath, const PNotify& _Notify);
 
-	virtual ~TDataProvider() { }
+	virtual ~TDataProvider();
 
 //	static void InitAggregates(TQm::PBase& Base, const PNotify& Notify);
 public:
 	void OnConnected();
 	// stores a new record
 	void AddRec(const int& CanId, const PJsonVal& Rec);
+	// stores all the records of a res_table push, each record takes
+	// TAdriaMsg::BYTES_PER_EL bytes: CAN ID, type and value
+	void AddRecBatch(const uint8* Tbl, const int& Len, const uint64& Tm);
 	// adds the current state to the table used for learning rules
 	void AddRuleInstance(const int& CanId);
+	// adds the rule instances of one table in one step
+	void AddRuleInstances(const TVec<TFltV>& StateVV, const uint64& Tm);
 	void DelOldRuleInst();
-	// returns the history of the sensor with the given CAN ID
-	void GetHistory(const int& CanId, TUInt64FltKdV& HistoryV);
+	// returns the history of every CAN ID in Query, raw samples are returned
+	// in HistoryVV and rollups in BucketVV, returns the resolution of the reply
+	int GetHistory(const THistQuery& Query, TVec<TUInt64FltKdV>& HistoryVV, TVec<TTmBucketV>& BucketVV);
+	THistReplyCache& GetHistCache() { return HistCache; }
 
 	// predictions
 	// predicts when the battery will be empty
@@ -145,14 +280,28 @@ public:
 
 	void SetPredictionCallback(TPredictionCallback* Callback) { PredictionCallback = Callback; }
 	void SetRulesGeneratedCallback(TRulesGeneratedCallback* Callback) { RulesCallback = Callback; }
+	void SetHistSampledCallback(THistSampledCallback* Callback) { HistCallback = Callback; }
+
+	// starts logging every reading to the readings log in the DB folder
+	void StartReadingsLog(const TReadingsLogFormat& Format);
+	PJsonVal GetReadingsLogStatJson();
 
 private:
 	// saves a record
 	void SaveRec(const int& CanId, const PJsonVal& Rec);
 	// adds a record to the external log
-	void AddRecToLog(const int& CanId, const PJsonVal& Rec);
+	void AddRecToLog(const uint64& Tm, const int& CanId, const double& Val);
+	// writes the readings log if it is due, called without DataSection held
+	void FlushReadingsLog();
+	// copies the rule columns of the state table, called with DataSection held
+	void GetRuleStateV(TFltV& StateV) const;
 
 	// sample data
+	// adds the readings which pass their sampling policy to history, called
+	// without HistSection held as the subscribers are notified after it
+	void AddToHist(const TIntFltKdV& RecV, const uint64& Tm);
+	// evaluates the sampling policies of all the series on a state vector
+	// and removes the outdated samples
 	void SampleHistFromV(const TFltV& StateV, const uint64& SampleTm);
 	void SampleHist();
 	void SampleWaterLevel();
@@ -166,16 +315,41 @@ private:
 				const TVec<TFltV>& ObsInstV, TIntVV& EventMat, TIntVV& ObsMat);
 	void InterpretApriori(const TVec<TPair<TIntV,TInt>>& RuleIdxV, TVec<TPair<TStrV,TStr>>& RuleV) const;
 
+	// write-ahead log
+	void WriteWal(const TStateRecType& Type, const TMOut& RecOut);
+	// bumps the version of the structure changed by a record of type Type
+	void SetDirty(const uchar& Type);
+	// applies the records of the old log on top of the loaded structures,
+	// either the history records into SeriesH or all the others, the
+	// records are idempotent so a log that is already part of the
+	// structures can be replayed again, returns the number of records
+	int ReplayWal(const bool& HistRecs, THash<TInt, TTmSeries>& SeriesH);
+	void ReplayRec(const uchar& Type, TSIn& SIn, THash<TInt, TTmSeries>& SeriesH);
+	// copies the changed structures and rotates the log under the locks,
+	// then saves the copies without holding them and drops the old log,
+	// nothing is saved until all the structures are loaded
+	bool Checkpoint();
+	void CheckpointIfDue();
+
 	// load methods
+	// loads the rule instances and water levels in parallel and starts
+	// loading history in the background, readings are accepted before
+	// the old history is loaded
 	void LoadStructs();
+	// loads history, replays its log records and merges in the
+	// samples which arrived in the meantime
 	void LoadHistV();
+	// loads history.bin directly into SeriesH, returns false if it fails
+	bool LoadHistFile(const TStr& FName, THash<TInt, TTmSeries>& SeriesH);
 	void LoadRuleInstV();
 	void LoadWaterLevelV();
+	// called when a load finishes, the last one makes the first checkpoint
+	void OnStructLoaded();
 
-	// save methods
-	void PersistHist();
-	void PersistRuleInstV();
-	void PersistWaterLevelV();
+	// save methods, return true if success
+	bool PersistHist(const THash<TInt, TTmSeries>& SeriesH);
+	bool PersistRuleInstV(const TVec<TKeyDat<TUInt64,TFltV>>& InstV);
+	bool PersistWaterLevelV(const TUInt64FltPrV& LevelV);
 
 private:
 	// helpers
@@ -184,6 +358,7 @@ private:
 
 public:
 	const TStr& GetDbPath() const { return DbPath; }
+	PJsonVal GetPersistStatJson();
 };
 
 /////////////////////////////////////////////////////////
@@ -197,6 +372,8 @@ public:
 	friend class TPt<TAdriaMsgCallback>;
 public:
 	virtual void OnMsgReceived(const PAdriaMsg& Msg) = 0;
+	// called with all the frames parsed from a single read, in order
+	virtual void OnMsgBatchReceived(const TVec<PAdriaMsg>& MsgV);
 	virtual void OnConnected() = 0;
 
 	virtual ~TAdriaMsgCallback() {}
@@ -205,18 +382,108 @@ public:
 
 /////////////////////////////////////////////////////////
 // Adria socket client
-// receives messages and calls the callback
+// receives messages and calls the callback, outgoing frames are queued
+// and sent from the event loop, coalesced into one send per loop tick
+//
+// the event loop only parses the frames, they are handled by worker threads:
+// PUSH res_table updates go through a priority lane, everything else through
+// the general lane, so a slow request doesn't hold up the sensor updates
 class TAdriaCommunicator : public TSockEvent {
 private:
+	// a pipeline stage, handles the messages of one lane in its own thread
+	class TMsgWorker: public TThread {
+	private:
+		const static int QUEUE_CAP;
+		const static int MX_BATCH_LEN;
+		const static int IDLE_WAIT_MSECS;
+
+		const TStr Name;
+		TAdriaCommunicator* Communicator;
+
+		TSpscQueue<PAdriaMsg> MsgQ;
+		TBlocker Blocker;
+		TVec<PAdriaMsg> MsgBatchV;
+		volatile bool Running;
+		volatile bool Busy;
+
+		// statistics, written by the worker or the producer only
+		int MxDepth;
+		uint64 Enqueued;
+		uint64 FullWaits;
+		uint64 Processed;
+		uint64 TotalQueueMicros;
+		uint64 MxQueueMicros;
+		uint64 TotalHandleMicros;
+		uint64 MxHandleMicros;
+
+		PNotify Notify;
+
+	public:
+		TMsgWorker(const TStr& _Name, TAdriaCommunicator* _Communicator, const PNotify& _Notify);
+
+		void Run();
+		void Stop();
+
+		// called by the event loop thread only, waits while the lane is full
+		void Add(PAdriaMsg& Msg);
+		// wakes the worker after a batch was added
+		void Wake() { Blocker.Release(); }
+		// true when the lane is empty and nothing is being handled
+		bool IsIdle() const { return !Busy && MsgQ.Empty(); }
+
+		PJsonVal GetStatJson() const;
+	};
+
+
+	const static int MSG_POOL_SIZE;
+	const static uint64 SEND_HIGH_WATER_BYTES;
+	const static int MX_FLUSH_BYTES;
+	const static int RECONNECT_MIN_DELAY;
+	const static int RECONNECT_MAX_DELAY;
+	const static int FRAMING_TIMEOUT;
+
 	const TStr Url;
 	const int Port;
+	// an offline communicator has no socket, it only handles replayed traffic
+	const bool Offline;
 
 	PSockHost SockHost;
 	PSock Sock;
 
 	PNotify Notify;
 
+	TAdriaMsgParser Parser;
+	TAdriaMsgPool MsgPool;
 	PAdriaMsg CurrMsg;
+	TVec<PAdriaMsg> MsgBatchV;
+
+	// pipeline stages
+	PThread PriorityWorker;
+	PThread GeneralWorker;
+
+	// raw inbound traffic capture
+	PAdriaCaptureWriter Capture;
+	TMem ChunkBf;
+
+	TAdriaSendQueue SendQ;
+	TMem FlushBf;
+	uint64 OfflineFrames;
+	uv_async_t* FlushAsync;
+	// set from connecting until the bus answers GET framing or the request
+	// times out, meanwhile the queued binary frames are held back
+	bool FramingPending;
+	uv_timer_t* FramingTimer;
+
+	// reconnecting
+	uv_timer_t* ReconnectTimer;
+	TRnd Rnd;
+	int ReconnectAttempts;
+	uint64 DisconnectTm;
+	uint64 TotalReconnectAttempts;
+	uint64 Reconnects;
+	uint64 LastReconnectMSecs;
+	uint64 MxReconnectMSecs;
+	uint64 TotalReconnectMSecs;
 
 	TVec<PAdriaMsgCallback> MsgCallbacks;
 
@@ -224,15 +491,24 @@ private:
 	TCriticalSection CallbackSection;
 
 	bool IsClosed;
+	bool IsConnected;
+	bool WorkersStopped;
+	// set once the bus acknowledges the binary framing, until then
+	// (and if it never does) messages are written as text, written by
+	// the event loop and read by the workers when they encode replies
+	std::atomic<bool> BinaryFraming;
 
 public:
-	TAdriaCommunicator(const TStr& _Url, const int& _Port, const PNotify& _Notify=TStdNotify::New());
+	TAdriaCommunicator(const TStr& _Url, const int& _Port, const PNotify& _Notify=TStdNotify::New(),
+			const bool& _Offline=false);
 
 public:
 	static PSockEvent New(const TStr& _Url, const int& _Port, const PNotify& _Notify=TStdNotify::New())
 		{ return new TAdriaCommunicator(_Url, _Port, _Notify); }
+	static PSockEvent NewOffline(const PNotify& _Notify=TStdNotify::New())
+		{ return new TAdriaCommunicator("", 0, _Notify, true); }
 
-	~TAdriaCommunicator() { CloseConn(); /*~TSockEvent();*/ }
+	~TAdriaCommunicator();
 
 public:
 	TSockEvent& operator=(const TSockEvent&){Fail; return *this;}
@@ -249,21 +525,69 @@ public:
 	void OnError(const uint64& SockId, const int& ErrCd, const TStr& ErrStr);
 	void OnGetHost(const PSockHost& SockHost);
 
-	bool Write(const PSIn& SIn);
+	// queues the frame for sending, returns false if the send
+	// queue is above the high water mark and the frame was dropped
 	bool Write(const TChA& Msg);
+	bool Write(const TMem& Frame, const bool& IsBinary=false);
+	// encodes the message in the negotiated framing and writes it to the socket
+	bool WriteMsg(const TAdriaMsgMethod& Method, const TChA& Command, const TChA& Params,
+			const TChA& ComponentId, const TChView& Content=TChView());
 	void ShutDown();
 
+	// records the inbound byte stream into the capture file
+	void StartCapture(const TStr& FNm);
+	// feeds a capture through the parser and the pipeline as if it arrived
+	// from the socket, Speed is relative to the original, 0 is as fast as possible
+	void Replay(const TStr& FNm, const double& Speed);
+
 public:
 	const TStr& GetUrl() const { return Url; }
 	const int& GetPort() const { return Port; }
 
+	PJsonVal GetStatJson();
+
 	void AddOnMsgReceivedCallback(const PAdriaMsgCallback& Callback);
 	void OnMsgReceived(const PAdriaMsg Msg);
+	void OnMsgBatchReceived(const TVec<PAdriaMsg>& MsgV);
 	void OnAdriaConnected();
 
 private:
+	// parses all the complete frames in the receive buffer into MsgV,
+	// CaptureTm is the capture time of replayed traffic, 0 for live traffic
+	void ReadMsgBatch(TVec<PAdriaMsg>& MsgV, const uint64& CaptureTm=0);
+	// hands the parsed messages over to the pipeline stages and clears MsgV
+	void DispatchMsgBatch(TVec<PAdriaMsg>& MsgV);
+	// waits until the pipeline stages handled all the messages
+	void WaitPipelineIdle();
+	TMsgWorker* GetWorker(const PThread& Worker) const { return (TMsgWorker*) Worker(); }
+	// the callbacks are never removed, so the pointers stay valid and
+	// worker threads don't touch the reference counts
+	void GetCallbacks(TVec<TAdriaMsgCallback*>& CallbackV);
+
+	// sends directly to the socket, must be called from the event loop
+	bool Send(const PSIn& SIn);
+	// sends the queued frames, called from the event loop
+	void Flush();
+	void ScheduleFlush();
+
+	static void OnFlushAsync(uv_async_t* Async ADRIA_UV_STATUS_ARG);
+	static void OnFlushAsyncClosed(uv_handle_t* Handle);
+
+	// schedules a connection attempt after a jittered exponential backoff
+	void ScheduleReconnect();
+	PJsonVal GetReconnectStatJson() const;
+
+	static void OnReconnectTimer(uv_timer_t* Timer ADRIA_UV_STATUS_ARG);
+	static void OnReconnectTimerClosed(uv_handle_t* Handle);
+	// handles the bus' reply to the framing negotiation request
+	void OnFramingReply(const TAdriaMsg& Msg);
+	static void OnFramingTimer(uv_timer_t* Timer ADRIA_UV_STATUS_ARG);
+	static void OnFramingTimerClosed(uv_handle_t* Handle);
+
 	void Connect();
 	void CloseConn();
+	// stops the pipeline stages and waits for them to finish
+	void StopWorkers();
 	void Reconnect();
 };
 
@@ -273,7 +597,7 @@ private:
 class TAdriaApp;
 typedef TPt<TAdriaApp> PAdriaApp;
 class TAdriaApp: public TAdriaMsgCallback, public TPredictionCallback,
-					public TRulesGeneratedCallback {
+					public TRulesGeneratedCallback, public THistSampledCallback {
 private:
 	TCRef CRef;
 public:
@@ -282,6 +606,12 @@ private:
 	TDataProvider& DataProvider;
 	PSockEvent Communicator;
 
+	// history subscriptions of every component, the query of each subscribed
+	// CAN ID holds the encoding of its updates
+	THash<TStr, THash<TInt, THistQuery>> HistSubH;
+	uint64 HistUpdatesSent;
+	TCriticalSection SubSection;
+
 	PNotify Notify;
 public:
 	TAdriaApp(const PSockEvent& _Communicator, TDataProvider& _DataProvider, const PNotify& _Notify = TStdNotify::New());
@@ -294,14 +624,19 @@ public:
 	void OnConnected();
 	void OnPrediction(const TInt& CanId, const TFlt& Val);
 	void OnRulesGenerated(const TVec<TPair<TStrV,TStr>>& RuleV);
+	void OnHistSampled(const uint64& SampleTm, const TIntFltH& SampleH);
 
 	void ShutDown();
 
 private:
-	void ParseTable(const TChA& Table, THash<TUInt, TFlt>& CanIdValH);
 	void ProcessPushTable(const PAdriaMsg& Msg);
 	void ProcessGetHistory(const PAdriaMsg& Msg);
+	void ProcessGetHistorySub(const PAdriaMsg& Msg);
+	void ProcessGetHistoryUnsub(const PAdriaMsg& Msg);
+	// encodes and sends the reply to a GET history query
+	void SendHistory(const THistQuery& Query, const TStr& ComponentId);
 	void ProcessGetPrediction(const PAdriaMsg& Msg);
+	void ProcessGetStats(const PAdriaMsg& Msg);
 };
 
 
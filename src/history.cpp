@@ -0,0 +1,1164 @@
+#include "history.h"
+
+using namespace TAdriaHistory;
+
+////////////////////////////////////////////////////
+// TBitWriter
+void TBitWriter::PutBit(const bool& Bit) {
+	if (BitN % 8 == 0) { Bf += char(0); }
+	if (Bit) { Bf[BitN / 8] |= char(0x80 >> (BitN % 8)); }
+	BitN++;
+}
+
+void TBitWriter::PutBits(const uint64& Val, const int& NBits) {
+	for (int BitIdx = NBits-1; BitIdx >= 0; BitIdx--) {
+		PutBit(((Val >> BitIdx) & 1) != 0);
+	}
+}
+
+////////////////////////////////////////////////////
+// TBitReader
+bool TBitReader::GetBit() {
+	EAssertR(BitN < 8*Bf.Len(), "TBitReader::GetBit: Read past the end of the buffer!");
+	const bool Bit = (uchar(Bf[BitN / 8]) & (0x80 >> (BitN % 8))) != 0;
+	BitN++;
+	return Bit;
+}
+
+uint64 TBitReader::GetBits(const int& NBits) {
+	uint64 Val = 0;
+	for (int BitIdx = 0; BitIdx < NBits; BitIdx++) {
+		Val = (Val << 1) | (GetBit() ? 1 : 0);
+	}
+	return Val;
+}
+
+////////////////////////////////////////////////////
+// TTmChunk
+namespace {
+	// delta-of-delta buckets, every bucket is prefixed with as many
+	// one bits as its index followed by a zero, the last bucket has
+	// no terminating zero
+	const int DOD_BUCKETS = 5;
+	const int DOD_BITS[DOD_BUCKETS] = { 7, 9, 12, 32, 64 };
+
+	uint64 GetDblBits(const double& Val) {
+		uint64 Bits; memcpy(&Bits, &Val, sizeof(Bits));
+		return Bits;
+	}
+
+	double GetBitsDbl(const uint64& Bits) {
+		double Val; memcpy(&Val, &Bits, sizeof(Val));
+		return Val;
+	}
+
+	bool FitsBits(const int64& Val, const int& NBits) {
+		if (NBits >= 64) { return true; }
+		const int64 Mx = (int64(1) << (NBits-1)) - 1;
+		return -Mx-1 <= Val && Val <= Mx;
+	}
+
+	int64 SignExtend(const uint64& Val, const int& NBits) {
+		if (NBits >= 64) { return int64(Val); }
+		const uint64 SignBit = uint64(1) << (NBits-1);
+		return int64((Val ^ SignBit) - SignBit);
+	}
+
+	void PutDod(TBitWriter& Writer, const int64& Dod) {
+		if (Dod == 0) {
+			Writer.PutBit(false);
+			return;
+		}
+
+		for (int BucketN = 0; BucketN < DOD_BUCKETS; BucketN++) {
+			const int NBits = DOD_BITS[BucketN];
+			if (FitsBits(Dod, NBits)) {
+				Writer.PutBits(0xFFFFFFFF, BucketN+1);
+				if (BucketN < DOD_BUCKETS-1) { Writer.PutBit(false); }
+				Writer.PutBits(uint64(Dod), NBits);
+				return;
+			}
+		}
+	}
+
+	int64 GetDod(TBitReader& Reader) {
+		if (!Reader.GetBit()) { return 0; }
+
+		int BucketN = 0;
+		while (BucketN < DOD_BUCKETS-1 && Reader.GetBit()) { BucketN++; }
+
+		const int NBits = DOD_BITS[BucketN];
+		return SignExtend(Reader.GetBits(NBits), NBits);
+	}
+}
+
+TTmChunk::TTmChunk(const TUInt64V& TmV, const TFltV& ValV):
+		CRef(),
+		StartTm(0),
+		EndTm(0),
+		Samples(TmV.Len()),
+		Bf() {
+
+	EAssertR(!TmV.Empty() && TmV.Len() == ValV.Len(), "TTmChunk: Invalid samples!");
+
+	StartTm = TmV[0];
+	EndTm = TmV.Last();
+
+	TBitWriter Writer(Bf);
+
+	// the first sample is stored as it is
+	uint64 PrevTm = TmV[0];
+	uint64 PrevValBits = GetDblBits(ValV[0]);
+	Writer.PutBits(PrevTm, 64);
+	Writer.PutBits(PrevValBits, 64);
+
+	int64 PrevDelta = 0;
+	int PrevLead = -1;
+	int PrevTrail = 0;
+
+	for (int SampleN = 1; SampleN < Samples; SampleN++) {
+		// timestamp
+		const uint64 Tm = TmV[SampleN];
+		const int64 Delta = int64(Tm - PrevTm);
+		PutDod(Writer, Delta - PrevDelta);
+		PrevTm = Tm;
+		PrevDelta = Delta;
+
+		// value
+		const uint64 ValBits = GetDblBits(ValV[SampleN]);
+		const uint64 Xor = ValBits ^ PrevValBits;
+		PrevValBits = ValBits;
+
+		if (Xor == 0) {
+			Writer.PutBit(false);
+			continue;
+		}
+
+		Writer.PutBit(true);
+
+		const int Lead = TMath::Mn(__builtin_clzll(Xor), 31);
+		const int Trail = __builtin_ctzll(Xor);
+
+		if (PrevLead >= 0 && Lead >= PrevLead && Trail >= PrevTrail) {
+			// the meaningful bits fit into the previous window
+			Writer.PutBit(false);
+			Writer.PutBits(Xor >> PrevTrail, 64 - PrevLead - PrevTrail);
+		} else {
+			const int MeaningfulBits = 64 - Lead - Trail;
+			Writer.PutBit(true);
+			Writer.PutBits(Lead, 5);
+			Writer.PutBits(MeaningfulBits - 1, 6);
+			Writer.PutBits(Xor >> Trail, MeaningfulBits);
+			PrevLead = Lead;
+			PrevTrail = Trail;
+		}
+	}
+}
+
+TTmChunk::TTmChunk(TSIn& SIn):
+		CRef(),
+		StartTm(TUInt64(SIn)),
+		EndTm(TUInt64(SIn)),
+		Samples(TInt(SIn)),
+		Bf(SIn) {
+
+	EAssertR(Samples > 0 && StartTm <= EndTm, "TTmChunk: Invalid chunk!");
+}
+
+void TTmChunk::Save(TSOut& SOut) const {
+	TUInt64(StartTm).Save(SOut);
+	TUInt64(EndTm).Save(SOut);
+	TInt(Samples).Save(SOut);
+	Bf.Save(SOut);
+}
+
+void TTmChunk::Decode(TUInt64V& TmV, TFltV& ValV) const {
+	TBitReader Reader(Bf);
+
+	uint64 Tm = Reader.GetBits(64);
+	uint64 ValBits = Reader.GetBits(64);
+	TmV.Add(Tm);
+	ValV.Add(GetBitsDbl(ValBits));
+
+	int64 Delta = 0;
+	int Lead = 0;
+	int Trail = 0;
+
+	for (int SampleN = 1; SampleN < Samples; SampleN++) {
+		Delta += GetDod(Reader);
+		Tm += Delta;
+
+		if (Reader.GetBit()) {
+			if (Reader.GetBit()) {
+				Lead = int(Reader.GetBits(5));
+				Trail = 64 - Lead - (int(Reader.GetBits(6)) + 1);
+				EAssertR(Trail >= 0, "TTmChunk::Decode: Corrupt chunk!");
+			}
+			ValBits ^= Reader.GetBits(64 - Lead - Trail) << Trail;
+		}
+
+		TmV.Add(Tm);
+		ValV.Add(GetBitsDbl(ValBits));
+	}
+}
+
+////////////////////////////////////////////////////
+// binary search over time ordered vectors
+namespace {
+	// index of the first time after Tm
+	int GetFirstAfter(const TUInt64V& TmV, const uint64& Tm) {
+		int LowN = 0, HighN = TmV.Len();
+		while (LowN < HighN) {
+			const int MidN = (LowN + HighN) / 2;
+			if (TmV[MidN] > Tm) { HighN = MidN; } else { LowN = MidN+1; }
+		}
+		return LowN;
+	}
+
+	// index of the first time not before Tm
+	int GetFirstNotBefore(const TUInt64V& TmV, const uint64& Tm) {
+		return Tm == 0 ? 0 : GetFirstAfter(TmV, Tm-1);
+	}
+}
+
+////////////////////////////////////////////////////
+// TTmBucket
+void TTmBucket::Add(const double& Val) {
+	Count++;
+	Mn = TMath::Mn(Mn, (float) Val);
+	Mx = TMath::Mx(Mx, (float) Val);
+}
+
+void TTmBucket::Hold(const double& Val, const uint64& FromTm, const uint64& ToTm) {
+	if (ToTm <= FromTm) { return; }
+
+	// a value carried over from the previous bucket is part of this one
+	Mn = TMath::Mn(Mn, (float) Val);
+	Mx = TMath::Mx(Mx, (float) Val);
+	Area += Val * double(ToTm - FromTm);
+	Avg = (float) (Area / double(ToTm - HeldFromTm));
+}
+
+////////////////////////////////////////////////////
+// TTmRollup
+void TTmRollup::Add(const uint64& Tm, const double& Val) {
+	const uint64 StartTm = Tm - Tm % Width;
+
+	if (!BucketV.Empty() && BucketV.Last().StartTm == StartTm) {
+		TTmBucket& Bucket = BucketV.Last();
+		Bucket.Hold(LastVal, LastTm, Tm);
+		Bucket.Add(Val);
+	} else if (!BucketV.Empty()) {
+		// the previous value is held until the end of its bucket and
+		// from the start of the new one until the new sample
+		TTmBucket& PrevBucket = BucketV.Last();
+		PrevBucket.Hold(LastVal, LastTm, PrevBucket.StartTm + Width);
+
+		TTmBucket Bucket(StartTm, StartTm, Val);
+		Bucket.Hold(LastVal, StartTm, Tm);
+		BucketV.Add(Bucket);
+	} else {
+		BucketV.Add(TTmBucket(StartTm, Tm, Val));
+	}
+
+	LastTm = Tm;
+	LastVal = Val;
+}
+
+void TTmRollup::DelBefore(const uint64& MnTm) {
+	int DelBuckets = 0;
+	while (DelBuckets < BucketV.Len() && BucketV[DelBuckets].StartTm + Width <= MnTm) {
+		DelBuckets++;
+	}
+	if (DelBuckets > 0) { BucketV.Del(0, DelBuckets-1); }
+}
+
+int TTmRollup::Len(const uint64& FromTm, const uint64& ToTm) const {
+	return TMath::Mx(GetFirstAfter(ToTm) - GetFirstEndingAfter(FromTm), 0);
+}
+
+void TTmRollup::GetNewestFirst(TTmBucketV& OutBucketV, const int& MxPoints,
+		const uint64& FromTm, const uint64& ToTm) const {
+
+	const int BBucketN = GetFirstEndingAfter(FromTm);
+	const int EBucketN = GetFirstAfter(ToTm);
+
+	int Points = TMath::Mx(EBucketN - BBucketN, 0);
+	if (MxPoints >= 0) { Points = TMath::Mn(Points, MxPoints); }
+
+	OutBucketV.Gen(Points, 0);
+	for (int BucketN = EBucketN-1; OutBucketV.Len() < Points; BucketN--) {
+		OutBucketV.Add(BucketV[BucketN]);
+	}
+}
+
+int TTmRollup::GetFirstAfter(const uint64& Tm) const {
+	int LowN = 0, HighN = BucketV.Len();
+	while (LowN < HighN) {
+		const int MidN = (LowN + HighN) / 2;
+		if (BucketV[MidN].StartTm > Tm) { HighN = MidN; } else { LowN = MidN+1; }
+	}
+	return LowN;
+}
+
+int TTmRollup::GetFirstEndingAfter(const uint64& Tm) const {
+	return Tm < Width ? 0 : GetFirstAfter(Tm - Width);
+}
+
+////////////////////////////////////////////////////
+// TTmSeries
+namespace {
+	const char* RES_NMS[] = { "raw", "1h", "1d" };
+	const uint64 RES_WIDTHS[] = { 1, uint64(1000)*60*60, uint64(1000)*60*60*24 };
+}
+
+const int TTmSeries::CHUNK_SAMPLES = 128;
+const int TTmSeries::RES_RAW = 0;
+const int TTmSeries::RESOLUTIONS = 3;
+
+int TTmSeries::GetResN(const TChView& ResNm) {
+	for (int ResN = 0; ResN < RESOLUTIONS; ResN++) {
+		if (ResNm == RES_NMS[ResN]) { return ResN; }
+	}
+	return -1;
+}
+
+const char* TTmSeries::GetResNm(const int& ResN) {
+	EAssertR(0 <= ResN && ResN < RESOLUTIONS, "TTmSeries::GetResNm: Invalid resolution!");
+	return RES_NMS[ResN];
+}
+
+TTmSeries::TTmSeries():
+		ChunkV(),
+		HeadTmV(),
+		HeadValV(),
+		MnTm(0),
+		Samples(0),
+		LastVal(0),
+		RollupV() {}
+
+TTmSeries::TTmSeries(TSIn& SIn):
+		ChunkV(SIn),
+		HeadTmV(SIn),
+		HeadValV(SIn),
+		MnTm(TUInt64(SIn)),
+		Samples(0),
+		LastVal(0),
+		RollupV() {
+
+	EAssertR(HeadTmV.Len() == HeadValV.Len(), "TTmSeries: Invalid head!");
+	Samples = CountSamples();
+
+	if (!HeadValV.Empty()) {
+		LastVal = HeadValV.Last();
+	} else if (!ChunkV.Empty()) {
+		TUInt64V TmV;	TFltV ValV;
+		ChunkV.Last()->Decode(TmV, ValV);
+		LastVal = ValV.Last();
+	}
+}
+
+void TTmSeries::Save(TSOut& SOut) const {
+	ChunkV.Save(SOut);
+	HeadTmV.Save(SOut);
+	HeadValV.Save(SOut);
+	TUInt64(MnTm).Save(SOut);
+}
+
+void TTmSeries::GetSnapshot(TTmSeries& Snap) const {
+	Snap.ChunkV = ChunkV;
+	Snap.HeadTmV = HeadTmV;
+	Snap.HeadValV = HeadValV;
+	Snap.MnTm = MnTm;
+	Snap.Samples = Samples;
+	Snap.LastVal = LastVal;
+	Snap.RollupV.Clr();
+}
+
+bool TTmSeries::Add(const uint64& Tm, const double& Val) {
+	// keep the series ordered by time
+	if (Tm < MnTm || (!Empty() && Tm < GetLastTm())) { return false; }
+
+	HeadTmV.Add(Tm);
+	HeadValV.Add(Val);
+	LastVal = Val;
+	Samples++;
+
+	for (int RollupN = 0; RollupN < RollupV.Len(); RollupN++) {
+		RollupV[RollupN].Add(Tm, Val);
+	}
+
+	if (HeadTmV.Len() >= CHUNK_SAMPLES) { Seal(); }
+
+	return true;
+}
+
+int TTmSeries::DelBefore(const uint64& _MnTm) {
+	if (_MnTm <= MnTm) { return 0; }
+
+	MnTm = _MnTm;
+
+	// drop the chunks which expired as a whole
+	int DelChunks = 0;
+	while (DelChunks < ChunkV.Len() && ChunkV[DelChunks]->GetEndTm() < MnTm) {
+		DelChunks++;
+	}
+	if (DelChunks > 0) { ChunkV.Del(0, DelChunks-1); }
+
+	// the head only holds expired samples once all the chunks are gone
+	if (ChunkV.Empty()) {
+		int DelSamples = 0;
+		while (DelSamples < HeadTmV.Len() && HeadTmV[DelSamples] < MnTm) {
+			DelSamples++;
+		}
+		if (DelSamples > 0) {
+			HeadTmV.Del(0, DelSamples-1);
+			HeadValV.Del(0, DelSamples-1);
+		}
+	}
+
+	for (int RollupN = 0; RollupN < RollupV.Len(); RollupN++) {
+		RollupV[RollupN].DelBefore(MnTm);
+	}
+
+	const int OldSamples = Samples;
+	Samples = CountSamples();
+	return OldSamples - Samples;
+}
+
+void TTmSeries::Clr() {
+	ChunkV.Clr();
+	HeadTmV.Clr();
+	HeadValV.Clr();
+	MnTm = 0;
+	Samples = 0;
+	LastVal = 0;
+	RollupV.Clr();
+}
+
+uint64 TTmSeries::GetLastTm() const {
+	EAssertR(!Empty(), "TTmSeries::GetLastTm: The series is empty!");
+	return HeadTmV.Empty() ? ChunkV.Last()->GetEndTm() : HeadTmV.Last().Val;
+}
+
+double TTmSeries::GetLastVal() const {
+	EAssertR(!Empty(), "TTmSeries::GetLastVal: The series is empty!");
+	return LastVal;
+}
+
+int TTmSeries::GetMemUsed() const {
+	int MemUsed = GetRawMemUsed();
+	for (int RollupN = 0; RollupN < RollupV.Len(); RollupN++) {
+		MemUsed += RollupV[RollupN].GetMemUsed();
+	}
+	return MemUsed;
+}
+
+int TTmSeries::GetRawMemUsed() const {
+	int MemUsed = (int) sizeof(TTmSeries) + ChunkV.Reserved()*(int) sizeof(PTmChunk) +
+			HeadTmV.Reserved()*(int) sizeof(TUInt64) + HeadValV.Reserved()*(int) sizeof(TFlt);
+	for (int ChunkN = 0; ChunkN < ChunkV.Len(); ChunkN++) {
+		MemUsed += ChunkV[ChunkN]->GetMemUsed();
+	}
+	return MemUsed;
+}
+
+int TTmSeries::GetResLen(const int& ResN, const uint64& FromTm, const uint64& ToTm) const {
+	EAssertR(0 <= ResN && ResN < RESOLUTIONS, "TTmSeries::GetResLen: Invalid resolution!");
+
+	if (ResN != RES_RAW) { return GetRollup(ResN).Len(FromTm, ToTm); }
+	if (FromTm <= MnTm && ToTm == TUInt64::Mx) { return Samples; }
+	return CountRange(FromTm, ToTm);
+}
+
+int TTmSeries::SelectRes(const int& MxPoints, const uint64& FromTm, const uint64& ToTm) const {
+	if (MxPoints < 0) { return RES_RAW; }
+
+	// start with the coarsest resolution, which is the cheapest to count
+	int ResN = RESOLUTIONS-1;
+	while (ResN > RES_RAW && GetResLen(ResN-1, FromTm, ToTm) <= MxPoints) {
+		ResN--;
+	}
+	return ResN;
+}
+
+void TTmSeries::GetNewestFirst(TUInt64FltKdV& HistV, const int& MxPoints,
+		const uint64& FromTm, const uint64& ToTm) const {
+
+	const uint64 BTm = TMath::Mx(FromTm, MnTm);
+	const int Points = MxPoints >= 0 ? TMath::Mn(MxPoints, Samples) : Samples;
+
+	HistV.Gen(TMath::Mn(Points, CHUNK_SAMPLES), 0);
+
+	// the head holds the newest samples
+	for (int SampleN = GetFirstAfter(HeadTmV, ToTm)-1; SampleN >= 0; SampleN--) {
+		if (HistV.Len() == Points || HeadTmV[SampleN] < BTm) { return; }
+		HistV.Add(TUInt64FltKd(HeadTmV[SampleN], HeadValV[SampleN]));
+	}
+
+	// only decode the chunks which overlap the range
+	TUInt64V TmV(CHUNK_SAMPLES, 0);
+	TFltV ValV(CHUNK_SAMPLES, 0);
+	for (int ChunkN = GetFirstChunkAfter(ToTm)-1; ChunkN >= 0; ChunkN--) {
+		if (ChunkV[ChunkN]->GetEndTm() < BTm) { return; }
+
+		TmV.Clr(false);
+		ValV.Clr(false);
+		ChunkV[ChunkN]->Decode(TmV, ValV);
+
+		for (int SampleN = GetFirstAfter(TmV, ToTm)-1; SampleN >= 0; SampleN--) {
+			if (HistV.Len() == Points || TmV[SampleN] < BTm) { return; }
+			HistV.Add(TUInt64FltKd(TmV[SampleN], ValV[SampleN]));
+		}
+	}
+}
+
+void TTmSeries::GetNewestFirst(const int& ResN, TTmBucketV& BucketV, const int& MxPoints,
+		const uint64& FromTm, const uint64& ToTm) const {
+
+	EAssertR(RES_RAW < ResN && ResN < RESOLUTIONS, "TTmSeries::GetNewestFirst: Invalid rollup resolution!");
+	GetRollup(ResN).GetNewestFirst(BucketV, MxPoints, TMath::Mx(FromTm, MnTm), ToTm);
+}
+
+int TTmSeries::Trim(const int& MxMem) {
+	const int OldSamples = Samples;
+
+	// drop the oldest chunks, the head is never dropped
+	while (!ChunkV.Empty() && GetRawMemUsed() > MxMem) {
+		DelBefore(ChunkV[0]->GetEndTm() + 1);
+	}
+
+	return OldSamples - Samples;
+}
+
+void TTmSeries::SetNewestFirst(const TUInt64FltKdV& HistV) {
+	Clr();
+	for (int i = HistV.Len()-1; i >= 0; i--) {
+		Add(HistV[i].Key, HistV[i].Dat);
+	}
+}
+
+void TTmSeries::Seal() {
+	ChunkV.Add(TTmChunk::New(HeadTmV, HeadValV));
+	HeadTmV.Clr(false);
+	HeadValV.Clr(false);
+}
+
+int TTmSeries::CountSamples() const {
+	return CountRange(MnTm, TUInt64::Mx);
+}
+
+int TTmSeries::CountRange(const uint64& FromTm, const uint64& ToTm) const {
+	const uint64 BTm = TMath::Mx(FromTm, MnTm);
+	if (BTm > ToTm) { return 0; }
+
+	int Count = TMath::Mx(GetFirstAfter(HeadTmV, ToTm) - GetFirstNotBefore(HeadTmV, BTm), 0);
+
+	// chunks inside the range are counted as a whole, only the
+	// chunks on the boundaries of the range are decoded
+	TUInt64V TmV(CHUNK_SAMPLES, 0);
+	TFltV ValV(CHUNK_SAMPLES, 0);
+
+	const int EChunkN = GetFirstChunkAfter(ToTm);
+	for (int ChunkN = GetFirstChunkNotBefore(BTm); ChunkN < EChunkN; ChunkN++) {
+		const PTmChunk& Chunk = ChunkV[ChunkN];
+
+		if (BTm <= Chunk->GetStartTm() && Chunk->GetEndTm() <= ToTm) {
+			Count += Chunk->Len();
+		} else {
+			TmV.Clr(false);
+			ValV.Clr(false);
+			Chunk->Decode(TmV, ValV);
+			Count += TMath::Mx(GetFirstAfter(TmV, ToTm) - GetFirstNotBefore(TmV, BTm), 0);
+		}
+	}
+
+	return Count;
+}
+
+int TTmSeries::GetFirstChunkAfter(const uint64& Tm) const {
+	int LowN = 0, HighN = ChunkV.Len();
+	while (LowN < HighN) {
+		const int MidN = (LowN + HighN) / 2;
+		if (ChunkV[MidN]->GetStartTm() > Tm) { HighN = MidN; } else { LowN = MidN+1; }
+	}
+	return LowN;
+}
+
+int TTmSeries::GetFirstChunkNotBefore(const uint64& Tm) const {
+	int LowN = 0, HighN = ChunkV.Len();
+	while (LowN < HighN) {
+		const int MidN = (LowN + HighN) / 2;
+		if (ChunkV[MidN]->GetEndTm() >= Tm) { HighN = MidN; } else { LowN = MidN+1; }
+	}
+	return LowN;
+}
+
+const TTmRollup& TTmSeries::GetRollup(const int& ResN) const {
+	if (RollupV.Empty()) { InitRollups(); }
+	return RollupV[ResN-1];
+}
+
+void TTmSeries::InitRollups() const {
+	RollupV.Gen(RESOLUTIONS-1, 0);
+	for (int ResN = RES_RAW+1; ResN < RESOLUTIONS; ResN++) {
+		RollupV.Add(TTmRollup(RES_WIDTHS[ResN]));
+	}
+
+	// the rollups are not persisted, feed them the stored samples
+	TUInt64V TmV(CHUNK_SAMPLES, 0);
+	TFltV ValV(CHUNK_SAMPLES, 0);
+	for (int ChunkN = 0; ChunkN <= ChunkV.Len(); ChunkN++) {
+		if (ChunkN < ChunkV.Len()) {
+			TmV.Clr(false);
+			ValV.Clr(false);
+			ChunkV[ChunkN]->Decode(TmV, ValV);
+		} else {
+			TmV = HeadTmV;
+			ValV = HeadValV;
+		}
+
+		for (int SampleN = 0; SampleN < TmV.Len(); SampleN++) {
+			if (TmV[SampleN] < MnTm) { continue; }
+			for (int RollupN = 0; RollupN < RollupV.Len(); RollupN++) {
+				RollupV[RollupN].Add(TmV[SampleN], ValV[SampleN]);
+			}
+		}
+	}
+}
+
+////////////////////////////////////////////////////
+// TSamplePolicy
+bool TSamplePolicy::IsSample(const uint64& LastTm, const double& LastVal, const uint64& Tm,
+		const double& Val) const {
+	if (Tm < LastTm) { return false; }
+
+	const uint64 Gap = Tm - LastTm;
+	if (Gap < Period) { return false; }
+	if (Gap >= MxGap) { return true; }
+
+	const double Change = fabs(Val - LastVal);
+	return Change > AbsDeadband && Change > RelDeadband*fabs(LastVal);
+}
+
+bool TSamplePolicy::IsSample(const TTmSeries& Series, const uint64& Tm, const double& Val) const {
+	return Series.Empty() || IsSample(Series.GetLastTm(), Series.GetLastVal(), Tm, Val);
+}
+
+////////////////////////////////////////////////////
+// THistCodec
+namespace {
+	const char* ENC_NMS[] = { "txt", "f32", "q" };
+	const int ENCODINGS = 3;
+
+	const double POW10[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9 };
+	const uint64 UPOW10[] = { 1ull, 10ull, 100ull, 1000ull, 10000ull, 100000ull, 1000000ull,
+			10000000ull, 100000000ull, 1000000000ull };
+}
+
+void THistCodec::Encode(const TUInt64FltKdV& HistV, const THistEnc& Enc, const int& Decimals, TChA& Out) {
+	const int Points = HistV.Len();
+
+	if (Enc == hetTxt) {
+		for (int i = 0; i < Points; i++) {
+			if (i > 0) { Out += ','; }
+			AddUInt64(HistV[i].Key, Out);
+			Out += ',';
+			AddFlt(HistV[i].Dat, Out);
+		}
+		return;
+	}
+
+	const double Scale = POW10[Decimals];
+	AddBinHeader(Points, Enc, Decimals, Out);
+
+	uint64 PrevTm = 0;
+	int64 PrevQuant = 0;
+	for (int i = 0; i < Points; i++) {
+		const uint64 Tm = HistV[i].Key;
+		AddVarInt(i == 0 ? Tm : PrevTm - Tm, Out);
+		AddVal(HistV[i].Dat, Enc, Scale, PrevQuant, Out);
+		PrevTm = Tm;
+	}
+}
+
+void THistCodec::Encode(const TTmBucketV& BucketV, const THistEnc& Enc, const int& Decimals, TChA& Out) {
+	const int Points = BucketV.Len();
+
+	if (Enc == hetTxt) {
+		for (int i = 0; i < Points; i++) {
+			const TTmBucket& Bucket = BucketV[i];
+
+			if (i > 0) { Out += ','; }
+			AddUInt64(Bucket.StartTm, Out);
+			Out += ',';
+			AddFlt(Bucket.Avg, Out);
+			Out += ',';
+			AddFlt(Bucket.Mn, Out);
+			Out += ',';
+			AddFlt(Bucket.Mx, Out);
+			Out += ',';
+			AddUInt64(Bucket.Count, Out);
+		}
+		return;
+	}
+
+	const double Scale = POW10[Decimals];
+	AddBinHeader(Points, Enc, Decimals, Out);
+
+	uint64 PrevTm = 0;
+	int64 PrevAvg = 0, PrevMn = 0, PrevMx = 0;
+	for (int i = 0; i < Points; i++) {
+		const TTmBucket& Bucket = BucketV[i];
+
+		AddVarInt(i == 0 ? Bucket.StartTm : PrevTm - Bucket.StartTm, Out);
+		AddVal(Bucket.Avg, Enc, Scale, PrevAvg, Out);
+		AddVal(Bucket.Mn, Enc, Scale, PrevMn, Out);
+		AddVal(Bucket.Mx, Enc, Scale, PrevMx, Out);
+		AddVarInt(Bucket.Count, Out);
+		PrevTm = Bucket.StartTm;
+	}
+}
+
+void THistCodec::Encode(const TVec<TUInt64FltKdV>& HistVV, const THistEnc& Enc, const int& Decimals, TChA& Out) {
+	for (int SeriesN = 0; SeriesN < HistVV.Len(); SeriesN++) {
+		if (SeriesN > 0 && Enc == hetTxt) { Out += ';'; }
+		Encode(HistVV[SeriesN], Enc, Decimals, Out);
+	}
+}
+
+void THistCodec::Encode(const TVec<TTmBucketV>& BucketVV, const THistEnc& Enc, const int& Decimals, TChA& Out) {
+	for (int SeriesN = 0; SeriesN < BucketVV.Len(); SeriesN++) {
+		if (SeriesN > 0 && Enc == hetTxt) { Out += ';'; }
+		Encode(BucketVV[SeriesN], Enc, Decimals, Out);
+	}
+}
+
+void THistCodec::EncodeAligned(const TVec<TUInt64FltKdV>& HistVV, const THistEnc& Enc, const int& Decimals, TChA& Out) {
+	EncodeAlignedT(HistVV, Enc, Decimals, Out);
+}
+
+void THistCodec::EncodeAligned(const TVec<TTmBucketV>& BucketVV, const THistEnc& Enc, const int& Decimals, TChA& Out) {
+	EncodeAlignedT(BucketVV, Enc, Decimals, Out);
+}
+
+THistEnc THistCodec::GetEnc(const TChView& EncNm, bool& Ok) {
+	Ok = true;
+	for (int EncN = 0; EncN < ENCODINGS; EncN++) {
+		if (EncNm == ENC_NMS[EncN]) { return (THistEnc) EncN; }
+	}
+	Ok = false;
+	return hetTxt;
+}
+
+const char* THistCodec::GetEncNm(const THistEnc& Enc) {
+	return ENC_NMS[Enc];
+}
+
+void THistCodec::AddUInt64(const uint64& Val, TChA& Out) {
+	char Bf[20];
+	int BfL = 0;
+
+	uint64 Rest = Val;
+	do {
+		Bf[BfL++] = char('0' + Rest % 10);
+		Rest /= 10;
+	} while (Rest > 0);
+
+	while (BfL > 0) { Out += Bf[--BfL]; }
+}
+
+void THistCodec::AddFlt(const double& Val, TChA& Out) {
+	// %g prints 6 significant digits in fixed notation when the exponent
+	// is in [-4, 6), trailing zeros are removed
+	const double AbsVal = fabs(Val);
+
+	if (Val == 0) {
+		Out += 1 / Val < 0 ? "-0" : "0";
+		return;
+	}
+
+	if (1e-4 <= AbsVal && AbsVal < 1e6) {
+		int Exp = 5;
+		while (Exp > -4 && AbsVal < (Exp >= 0 ? POW10[Exp] : 1 / POW10[-Exp])) { Exp--; }
+
+		const int Decimals = 5 - Exp;
+		const double ScaledVal = AbsVal * POW10[Decimals];
+		const uint64 Scaled = (uint64) llround(ScaledVal);
+
+		// rounding up to the next power of ten changes the exponent and printf
+		// rounds ties to even while llround rounds them away from zero, leave
+		// those rare cases to printf
+		const bool IsTie = fabs(ScaledVal - floor(ScaledVal) - 0.5) < 1e-6;
+		if (Scaled < UPOW10[6] && !IsTie) {
+			if (Val < 0) { Out += '-'; }
+
+			AddUInt64(Scaled / UPOW10[Decimals], Out);
+
+			uint64 Frac = Scaled % UPOW10[Decimals];
+			if (Frac > 0) {
+				int FracDigits = Decimals;
+				while (Frac % 10 == 0) {
+					Frac /= 10;
+					FracDigits--;
+				}
+
+				Out += '.';
+				for (int DigitN = FracDigits-1; DigitN >= 0; DigitN--) {
+					Out += char('0' + (Frac / UPOW10[DigitN]) % 10);
+				}
+			}
+			return;
+		}
+	}
+
+	char Bf[32];
+	snprintf(Bf, sizeof(Bf), "%g", Val);
+	Out += Bf;
+}
+
+void THistCodec::AddVarInt(const uint64& Val, TChA& Out) {
+	uint64 Rest = Val;
+	while (Rest >= 0x80) {
+		Out += (char) ((Rest & 0x7F) | 0x80);
+		Rest >>= 7;
+	}
+	Out += (char) Rest;
+}
+
+void THistCodec::AddVal(const double& Val, const THistEnc& Enc, const double& Scale, int64& PrevQuant, TChA& Out) {
+	if (Enc == hetF32) {
+		const float FltVal = (float) Val;
+		const char* ValCh = (const char*) &FltVal;
+		for (int ChN = 0; ChN < 4; ChN++) {
+			Out += ValCh[ChN];
+		}
+	} else {
+		const int64 Quant = (int64) llround(Val * Scale);
+		const int64 Delta = Quant - PrevQuant;
+		AddVarInt((uint64(Delta) << 1) ^ uint64(Delta >> 63), Out);
+		PrevQuant = Quant;
+	}
+}
+
+void THistCodec::AddBinHeader(const int& Points, const THistEnc& Enc, const int& Decimals, TChA& Out) {
+	Out += (char) Enc;
+	Out += (char) Decimals;
+	AddVarInt(Points, Out);
+}
+
+namespace {
+	uint64 GetPointTm(const TUInt64FltKd& Sample) { return Sample.Key; }
+	double GetPointVal(const TUInt64FltKd& Sample) { return Sample.Dat; }
+	uint64 GetPointTm(const TTmBucket& Bucket) { return Bucket.StartTm; }
+	double GetPointVal(const TTmBucket& Bucket) { return Bucket.Avg; }
+}
+
+template <class TPoint>
+void THistCodec::EncodeAlignedT(const TVec<TVec<TPoint> >& PointVV, const THistEnc& Enc, const int& Decimals, TChA& Out) {
+	const int NSeries = PointVV.Len();
+	if (NSeries == 0) { return; }
+
+	// join the series on time, the rows are driven by the first series and
+	// all the series are ordered newest first, so one pass is enough
+	TIntV PosV(NSeries, NSeries);
+	for (int SeriesN = 0; SeriesN < NSeries; SeriesN++) { PosV[SeriesN] = 0; }
+
+	TIntV RowPosV;	// NSeries positions for every row
+	const TVec<TPoint>& FirstV = PointVV[0];
+	for (int PointN = 0; PointN < FirstV.Len(); PointN++) {
+		const uint64 Tm = GetPointTm(FirstV[PointN]);
+
+		bool IsRow = true;
+		for (int SeriesN = 1; SeriesN < NSeries && IsRow; SeriesN++) {
+			const TVec<TPoint>& PointV = PointVV[SeriesN];
+			int& PosN = PosV[SeriesN].Val;
+			while (PosN < PointV.Len() && GetPointTm(PointV[PosN]) > Tm) { PosN++; }
+			IsRow = PosN < PointV.Len() && GetPointTm(PointV[PosN]) == Tm;
+		}
+
+		if (!IsRow) { continue; }
+
+		RowPosV.Add(PointN);
+		for (int SeriesN = 1; SeriesN < NSeries; SeriesN++) {
+			RowPosV.Add(PosV[SeriesN]);
+		}
+	}
+
+	const int Rows = RowPosV.Len() / NSeries;
+
+	if (Enc == hetTxt) {
+		for (int RowN = 0; RowN < Rows; RowN++) {
+			if (RowN > 0) { Out += ','; }
+			AddUInt64(GetPointTm(FirstV[RowPosV[RowN*NSeries]]), Out);
+			for (int SeriesN = 0; SeriesN < NSeries; SeriesN++) {
+				Out += ',';
+				AddFlt(GetPointVal(PointVV[SeriesN][RowPosV[RowN*NSeries + SeriesN]]), Out);
+			}
+		}
+		return;
+	}
+
+	const double Scale = POW10[Decimals];
+	AddBinHeader(Rows, Enc, Decimals, Out);
+
+	uint64 PrevTm = 0;
+	TVec<int64> PrevQuantV(NSeries, NSeries);
+	for (int SeriesN = 0; SeriesN < NSeries; SeriesN++) { PrevQuantV[SeriesN] = 0; }
+
+	for (int RowN = 0; RowN < Rows; RowN++) {
+		const uint64 Tm = GetPointTm(FirstV[RowPosV[RowN*NSeries]]);
+		AddVarInt(RowN == 0 ? Tm : PrevTm - Tm, Out);
+		for (int SeriesN = 0; SeriesN < NSeries; SeriesN++) {
+			AddVal(GetPointVal(PointVV[SeriesN][RowPosV[RowN*NSeries + SeriesN]]), Enc, Scale, PrevQuantV[SeriesN], Out);
+		}
+		PrevTm = Tm;
+	}
+}
+
+////////////////////////////////////////////////////
+// THistQuery
+const int THistQuery::MX_CANS = 256;
+const int THistQuery::DEF_MX_POINTS = 1000;
+
+bool THistQuery::Parse(const TChView& Params, THistQuery& Query) {
+	Query = THistQuery();
+
+	int ChN = Params.SearchCh(';');
+	if (ChN < 0) { ChN = Params.Len(); }
+
+	// CAN IDs
+	int BChN = 0;
+	while (BChN <= ChN) {
+		int EChN = Params.SearchCh(',', BChN);
+		if (EChN < 0 || EChN > ChN) { EChN = ChN; }
+
+		const int CanId = Params.GetSubView(BChN, EChN).GetInt();
+		if (CanId < 0 || Query.CanIdV.Len() >= MX_CANS) { return false; }
+		Query.CanIdV.Add(CanId);
+
+		BChN = EChN+1;
+	}
+
+	while (ChN < Params.Len()) {
+		const int BChN = ChN+1;
+		int EChN = Params.SearchCh(';', BChN);
+		if (EChN < 0) { EChN = Params.Len(); }
+
+		const int EqChN = Params.SearchCh('=', BChN);
+		if (EqChN < 0 || EqChN > EChN) { return false; }
+
+		const TChView Key = Params.GetSubView(BChN, EqChN);
+		const TChView Val = Params.GetSubView(EqChN+1, EChN);
+
+		if (Key == "res") {
+			Query.ResN = TTmSeries::GetResN(Val);
+			if (Query.ResN < 0) { return false; }
+		} else if (Key == "points") {
+			Query.MxPoints = Val.GetInt();
+			if (Query.MxPoints < 0) { return false; }
+		} else if (Key == "limit") {
+			Query.Limit = Val.GetInt();
+			if (Query.Limit < 0) { return false; }
+		} else if (Key == "from") {
+			if (!Val.GetUInt64(Query.FromTm)) { return false; }
+		} else if (Key == "to") {
+			if (!Val.GetUInt64(Query.ToTm)) { return false; }
+		} else if (Key == "enc") {
+			bool Ok;
+			Query.Enc = THistCodec::GetEnc(Val, Ok);
+			if (!Ok) { return false; }
+		} else if (Key == "dec") {
+			Query.Decimals = Val.GetInt();
+			if (Query.Decimals < 0 || Query.Decimals > 9) { return false; }
+		} else if (Key == "align") {
+			if (!(Val == "0" || Val == "1")) { return false; }
+			Query.Align = Val == "1";
+		} else {
+			return false;
+		}
+
+		ChN = EChN;
+	}
+
+	// a plain request would return every raw sample of the retention window
+	if (Query.MxPoints < 0 && Query.Limit < 0) {
+		Query.MxPoints = DEF_MX_POINTS;
+	}
+
+	return Query.FromTm <= Query.ToTm;
+}
+
+int THistQuery::GetMxPoints() const {
+	if (MxPoints < 0) { return Limit; }
+	if (Limit < 0) { return MxPoints; }
+	return TMath::Mn(MxPoints, Limit);
+}
+
+TStr THistQuery::GetKey() const {
+	return TStr::Fmt("%s;%d;%d;%d;%s;%s;%d;%d;%d", GetCanIdStr().CStr(), ResN, MxPoints, Limit,
+			TUInt64::GetStr(FromTm).CStr(), TUInt64::GetStr(ToTm).CStr(), (int) Enc,
+			Enc == hetQuant ? Decimals : 0, CanIdV.Len() > 1 && Align ? 1 : 0);
+}
+
+TChA THistQuery::GetCanIdStr() const {
+	TChA CanIdChA;
+	for (int CanN = 0; CanN < CanIdV.Len(); CanN++) {
+		if (CanN > 0) { CanIdChA += ','; }
+		CanIdChA += TInt::GetStr(CanIdV[CanN]);
+	}
+	return CanIdChA;
+}
+
+////////////////////////////////////////////////////
+// THistReplyCache
+const int THistReplyCache::MX_ENTRIES = 256;
+
+THistReplyCache::THistReplyCache():
+		EntryH(),
+		CanVersionH(),
+		Epoch(0),
+		Bytes(0),
+		Hits(0),
+		Misses(0),
+		Rebuilds(0),
+		RebuildMicros(0),
+		Invalidations(0),
+		CacheSection(TCriticalSectionType::cstRecursive) {}
+
+bool THistReplyCache::Get(const TStr& Key, TChA& ParamChA, TChA& ContentChA, int& Points) {
+	TLock Lock(CacheSection);
+
+	const int KeyId = EntryH.GetKeyId(Key);
+	if (KeyId < 0) {
+		Misses++;
+		return false;
+	}
+
+	const TEntry& Entry = EntryH[KeyId];
+	if (!IsCurrent(Entry.CanIdV, Entry.VersionV)) {
+		DelEntry(KeyId);
+		Misses++;
+		return false;
+	}
+
+	ParamChA = Entry.ParamChA;
+	ContentChA = Entry.ContentChA;
+	Points = Entry.Points;
+
+	Hits++;
+	return true;
+}
+
+void THistReplyCache::Add(const TStr& Key, const TIntV& CanIdV, const TUInt64V& VersionV,
+		const TChA& ParamChA, const TChA& ContentChA, const int& Points,
+		const uint64& BuildMicros) {
+
+	TLock Lock(CacheSection);
+
+	Rebuilds++;
+	RebuildMicros += BuildMicros;
+
+	// one of the series was sampled in the meantime
+	if (!IsCurrent(CanIdV, VersionV)) { return; }
+
+	// distinct queries are few, the limit only guards against misbehaving clients
+	if (EntryH.Len() >= MX_ENTRIES && !EntryH.IsKey(Key)) {
+		EntryH.Clr();
+		Bytes = 0;
+	}
+
+	TEntry& Entry = EntryH.AddDat(Key);
+	Bytes += ContentChA.Len() - Entry.ContentChA.Len();
+	Entry.ParamChA = ParamChA;
+	Entry.ContentChA = ContentChA;
+	Entry.Points = Points;
+	Entry.CanIdV = CanIdV;
+	Entry.VersionV = VersionV;
+}
+
+void THistReplyCache::Invalidate(const TIntV& CanIdV) {
+	TLock Lock(CacheSection);
+
+	for (int CanN = 0; CanN < CanIdV.Len(); CanN++) {
+		CanVersionH.AddDat(CanIdV[CanN]).Val++;
+	}
+	Invalidations++;
+}
+
+void THistReplyCache::Invalidate() {
+	TLock Lock(CacheSection);
+
+	Epoch++;
+	EntryH.Clr();
+	Bytes = 0;
+	Invalidations++;
+}
+
+void THistReplyCache::GetVersionV(const TIntV& CanIdV, TUInt64V& VersionV) {
+	TLock Lock(CacheSection);
+
+	VersionV.Gen(CanIdV.Len()+1, 0);
+	for (int CanN = 0; CanN < CanIdV.Len(); CanN++) {
+		VersionV.Add(GetCanVersion(CanIdV[CanN]));
+	}
+	VersionV.Add(Epoch);
+}
+
+uint64 THistReplyCache::GetCanVersion(const int& CanId) const {
+	const int KeyId = CanVersionH.GetKeyId(CanId);
+	return KeyId < 0 ? 0 : (uint64) CanVersionH[KeyId];
+}
+
+bool THistReplyCache::IsCurrent(const TIntV& CanIdV, const TUInt64V& VersionV) const {
+	if (VersionV.Len() != CanIdV.Len()+1 || VersionV.Last() != Epoch) { return false; }
+
+	for (int CanN = 0; CanN < CanIdV.Len(); CanN++) {
+		if (VersionV[CanN] != GetCanVersion(CanIdV[CanN])) { return false; }
+	}
+	return true;
+}
+
+void THistReplyCache::DelEntry(const int& KeyId) {
+	Bytes -= EntryH[KeyId].ContentChA.Len();
+	EntryH.DelKeyId(KeyId);
+}
+
+PJsonVal THistReplyCache::GetStatJson() {
+	TLock Lock(CacheSection);
+
+	const uint64 Requests = Hits + Misses;
+
+	PJsonVal StatJson = TJsonVal::NewObj();
+	StatJson->AddToObj("entries", EntryH.Len());
+	StatJson->AddToObj("bytes", Bytes);
+	StatJson->AddToObj("hits", (double) Hits);
+	StatJson->AddToObj("misses", (double) Misses);
+	StatJson->AddToObj("hitRate", Requests > 0 ? double(Hits) / Requests : 0.0);
+	StatJson->AddToObj("rebuilds", (double) Rebuilds);
+	StatJson->AddToObj("avgRebuildMs", Rebuilds > 0 ? double(RebuildMicros) / Rebuilds / 1e3 : 0.0);
+	StatJson->AddToObj("invalidations", (double) Invalidations);
+	return StatJson;
+}
+
+////////////////////////////////////////////////////
+// THistFile
+const TStr THistFile::MAGIC = "ADRIAHIST2";
+
+void THistFile::Load(TSIn& SIn, THash<TInt, TTmSeries>& SeriesH) {
+	const int MagicLen = MAGIC.Len();
+
+	TMem MagicBf;
+	EAssertR(SIn.Len() >= MagicLen, "THistFile: Not a history file!");
+	for (int ChN = 0; ChN < MagicLen; ChN++) {
+		MagicBf += SIn.GetCh();
+	}
+	EAssertR(memcmp(MagicBf.GetBf(), MAGIC.CStr(), MagicLen) == 0, "THistFile: Not a history file!");
+
+	SeriesH.Load(SIn);
+}
+
+void THistFile::Save(TSOut& SOut) const {
+	SOut.PutBf(MAGIC.CStr(), MAGIC.Len());
+	SeriesH.Save(SOut);
+}
@@ -0,0 +1,448 @@
+#ifndef HISTORY_H_
+#define HISTORY_H_
+
+#include <base.h>
+#include <thread.h>
+#include <utils.h>
+
+namespace TAdriaHistory {
+
+using namespace TAdriaUtils;
+
+/////////////////////////////////////////////////////////
+// Bit stream
+// writes and reads single bits into a memory buffer, most significant
+// bit first
+class TBitWriter {
+private:
+	TMem& Bf;
+	int BitN;
+
+public:
+	TBitWriter(TMem& _Bf): Bf(_Bf), BitN(0) {}
+
+	void PutBit(const bool& Bit);
+	// writes the lowest NBits bits of Val
+	void PutBits(const uint64& Val, const int& NBits);
+};
+
+class TBitReader {
+private:
+	const TMem& Bf;
+	int BitN;
+
+public:
+	TBitReader(const TMem& _Bf): Bf(_Bf), BitN(0) {}
+
+	bool GetBit();
+	uint64 GetBits(const int& NBits);
+};
+
+/////////////////////////////////////////////////////////
+// Time series chunk
+// an immutable block of consecutive samples, timestamps are stored
+// as delta-of-deltas and values are XOR-ed with the previous value
+// as in Facebook's Gorilla, so regularly sampled sensors which rarely
+// change take only a few bits per sample
+//
+// chunks are never modified after they are created so they are shared
+// between series copies and written to disk as they are
+class TTmChunk;
+typedef TPt<TTmChunk> PTmChunk;
+class TTmChunk {
+private:
+  TCRef CRef;
+public:
+  friend class TPt<TTmChunk>;
+private:
+	uint64 StartTm;
+	uint64 EndTm;
+	int Samples;
+	TMem Bf;
+
+	TTmChunk(const TUInt64V& TmV, const TFltV& ValV);
+	TTmChunk(TSIn& SIn);
+
+public:
+	static PTmChunk New(const TUInt64V& TmV, const TFltV& ValV) { return new TTmChunk(TmV, ValV); }
+	static PTmChunk Load(TSIn& SIn) { return new TTmChunk(SIn); }
+
+	void Save(TSOut& SOut) const;
+
+	uint64 GetStartTm() const { return StartTm; }
+	uint64 GetEndTm() const { return EndTm; }
+	int Len() const { return Samples; }
+	int GetMemUsed() const { return (int) sizeof(TTmChunk) + Bf.Len(); }
+
+	// appends the decoded samples to TmV and ValV, oldest first
+	void Decode(TUInt64V& TmV, TFltV& ValV) const;
+};
+
+/////////////////////////////////////////////////////////
+// Rollup bucket
+// aggregate of the samples which fall into one time bucket, the average is
+// weighted by time, every sample holds its value until the next one
+class TTmBucket {
+public:
+	uint64 StartTm;
+	float Mn;
+	float Mx;
+	float Avg;
+	int Count;
+	// integral of the held values over [HeldFromTm, time of the last update]
+	uint64 HeldFromTm;
+	double Area;
+
+	TTmBucket(): StartTm(0), Mn(0), Mx(0), Avg(0), Count(0), HeldFromTm(0), Area(0) {}
+	TTmBucket(const uint64& _StartTm, const uint64& Tm, const double& Val):
+		StartTm(_StartTm), Mn((float) Val), Mx((float) Val), Avg((float) Val), Count(1),
+		HeldFromTm(Tm), Area(0) {}
+
+	// adds a sample to the minimum, maximum and count
+	void Add(const double& Val);
+	// adds Val held over [FromTm, ToTm) to the average and the range
+	void Hold(const double& Val, const uint64& FromTm, const uint64& ToTm);
+};
+
+typedef TVec<TTmBucket> TTmBucketV;
+
+/////////////////////////////////////////////////////////
+// Rollup
+// fixed width buckets of a series, updated as samples are added
+class TTmRollup {
+private:
+	uint64 Width;
+	TTmBucketV BucketV;		// oldest first
+	// the newest sample, held until the next one arrives
+	uint64 LastTm;
+	double LastVal;
+
+public:
+	TTmRollup(const uint64& _Width=1): Width(_Width), BucketV(), LastTm(0), LastVal(0) {}
+
+	void Add(const uint64& Tm, const double& Val);
+	// removes the buckets which end before MnTm
+	void DelBefore(const uint64& MnTm);
+	void Clr() { BucketV.Clr(); }
+
+	int Len() const { return BucketV.Len(); }
+	// number of buckets which overlap [FromTm, ToTm]
+	int Len(const uint64& FromTm, const uint64& ToTm) const;
+	int GetMemUsed() const { return BucketV.Reserved()*(int) sizeof(TTmBucket); }
+
+	// copies at most MxPoints newest buckets which overlap [FromTm, ToTm], newest first
+	void GetNewestFirst(TTmBucketV& OutBucketV, const int& MxPoints=-1,
+			const uint64& FromTm=0, const uint64& ToTm=TUInt64::Mx) const;
+
+private:
+	// index of the first bucket starting after Tm
+	int GetFirstAfter(const uint64& Tm) const;
+	// index of the first bucket ending after Tm
+	int GetFirstEndingAfter(const uint64& Tm) const;
+};
+
+/////////////////////////////////////////////////////////
+// Time series
+// the samples of a single sensor ordered by time, new samples are appended
+// to an uncompressed head which is sealed into a compressed chunk once full,
+// expired samples are hidden and dropped a chunk at a time
+class TTmSeries {
+private:
+	const static int CHUNK_SAMPLES;
+
+	TVec<PTmChunk> ChunkV;		// sealed chunks, oldest first
+	TUInt64V HeadTmV;			// the open chunk
+	TFltV HeadValV;
+	uint64 MnTm;				// samples taken before MnTm are expired
+	int Samples;				// number of samples which are not expired
+	double LastVal;				// value of the newest sample, kept so it needn't be decoded
+
+	// one rollup for every resolution except the raw one, built from the
+	// samples when first queried so loading many series stays cheap
+	mutable TVec<TTmRollup> RollupV;
+
+public:
+	// resolutions of a series, the raw samples are at index RES_RAW
+	// followed by increasingly coarse rollups
+	const static int RES_RAW;
+	const static int RESOLUTIONS;
+
+	// returns the resolution with the given name, -1 if there is none
+	static int GetResN(const TChView& ResNm);
+	static const char* GetResNm(const int& ResN);
+
+	TTmSeries();
+	TTmSeries(TSIn& SIn);
+
+	void Save(TSOut& SOut) const;
+	// copies the samples into Snap for saving, the sealed chunks are shared
+	// and the rollups are not copied
+	void GetSnapshot(TTmSeries& Snap) const;
+
+	// appends a sample, samples older than the newest one are ignored
+	bool Add(const uint64& Tm, const double& Val);
+	// removes the samples taken before MnTm, returns the number of removed samples
+	int DelBefore(const uint64& MnTm);
+	// removes the oldest chunks until the raw samples use at most MxMem bytes,
+	// the rollups don't count as they are built on demand, returns the
+	// number of removed samples
+	int Trim(const int& MxMem);
+	void Clr();
+
+	int Len() const { return Samples; }
+	bool Empty() const { return Samples == 0; }
+	uint64 GetLastTm() const;
+	double GetLastVal() const;
+	// samples taken before this time are expired
+	uint64 GetMnTm() const { return MnTm; }
+
+	// approximate memory used by the series in bytes
+	int GetMemUsed() const;
+	// approximate memory used by the raw samples in bytes, without the rollups
+	int GetRawMemUsed() const;
+
+	// number of points in [FromTm, ToTm] at resolution ResN
+	int GetResLen(const int& ResN, const uint64& FromTm=0, const uint64& ToTm=TUInt64::Mx) const;
+	// the finest resolution with at most MxPoints points in [FromTm, ToTm],
+	// the coarsest resolution if there is none
+	int SelectRes(const int& MxPoints, const uint64& FromTm=0, const uint64& ToTm=TUInt64::Mx) const;
+
+	// copies at most MxPoints newest samples in [FromTm, ToTm] into HistV,
+	// newest first as expected by the protocol, only the chunks which
+	// overlap the range are decoded
+	void GetNewestFirst(TUInt64FltKdV& HistV, const int& MxPoints=-1,
+			const uint64& FromTm=0, const uint64& ToTm=TUInt64::Mx) const;
+	// copies at most MxPoints newest buckets of a rollup resolution
+	void GetNewestFirst(const int& ResN, TTmBucketV& BucketV, const int& MxPoints=-1,
+			const uint64& FromTm=0, const uint64& ToTm=TUInt64::Mx) const;
+	// replaces the samples with the ones in HistV, ordered newest first
+	void SetNewestFirst(const TUInt64FltKdV& HistV);
+
+private:
+	void Seal();
+	// counts the samples which are not expired
+	int CountSamples() const;
+	int CountRange(const uint64& FromTm, const uint64& ToTm) const;
+	// index of the first chunk starting after Tm
+	int GetFirstChunkAfter(const uint64& Tm) const;
+	// index of the first chunk ending at or after Tm
+	int GetFirstChunkNotBefore(const uint64& Tm) const;
+	const TTmRollup& GetRollup(const int& ResN) const;
+	// rebuilds the rollups from the samples
+	void InitRollups() const;
+};
+
+/////////////////////////////////////////////////////////
+// Sampling policy
+// decides which readings of a sensor are stored in its history, a reading
+// is stored when it changed enough since the last stored sample or when
+// the last stored sample is too old
+class TSamplePolicy {
+public:
+	uint64 Period;			// minimum time between two stored samples
+	double AbsDeadband;		// minimum absolute change of the value
+	double RelDeadband;		// minimum change relative to the last stored value
+	uint64 MxGap;			// heartbeat, a flat signal is stored at least this often
+
+	TSamplePolicy(const uint64& _Period=uint64(1000)*60, const double& _AbsDeadband=0,
+			const double& _RelDeadband=0, const uint64& _MxGap=uint64(1000)*60*10):
+		Period(_Period), AbsDeadband(_AbsDeadband), RelDeadband(_RelDeadband), MxGap(_MxGap) {}
+
+	// true if the reading Val taken at Tm should be stored given the last
+	// stored sample of the series
+	bool IsSample(const uint64& LastTm, const double& LastVal, const uint64& Tm, const double& Val) const;
+	// true if the reading should be stored in Series
+	bool IsSample(const TTmSeries& Series, const uint64& Tm, const double& Val) const;
+};
+
+/////////////////////////////////////////////////////////
+// History reply encodings
+enum THistEnc {
+	hetTxt,		// comma separated decimal text
+	hetF32,		// binary, values as little endian float32
+	hetQuant	// binary, values quantized to a number of decimals
+};
+
+/////////////////////////////////////////////////////////
+// History codec
+// encodes the content of history replies
+//
+// text replies are comma separated `time,value` pairs for raw samples and
+// `time,avg,min,max,count` tuples for rollups, numbers are formatted as
+// with %g by a dedicated formatter
+//
+// binary replies start with a header followed by the points, newest first:
+//   <encoding><decimals><varint number of points>
+//   raw:    [<varint time delta><value>]*
+//   rollup: [<varint time delta><avg><min><max><varint count>]*
+// the first time is absolute, the following ones are deltas to the previous
+// (newer) time; float32 values are sent as they are, quantized values
+// are sent as zig-zag varint deltas of round(value * 10^decimals) to the
+// previous value of the same field
+//
+// replies with several series list them in the order of the request,
+// separated by ';' in text replies and one after the other, each with its
+// own header, in binary replies
+//
+// time aligned replies only contain the times present in every series,
+// rollups are represented by their averages:
+//   text:   `time,v1,...,vn` rows
+//   binary: <header with the number of rows>[<varint time delta><v1>...<vn>]*
+class THistCodec {
+public:
+	static void Encode(const TUInt64FltKdV& HistV, const THistEnc& Enc, const int& Decimals, TChA& Out);
+	static void Encode(const TTmBucketV& BucketV, const THistEnc& Enc, const int& Decimals, TChA& Out);
+	static void Encode(const TVec<TUInt64FltKdV>& HistVV, const THistEnc& Enc, const int& Decimals, TChA& Out);
+	static void Encode(const TVec<TTmBucketV>& BucketVV, const THistEnc& Enc, const int& Decimals, TChA& Out);
+	static void EncodeAligned(const TVec<TUInt64FltKdV>& HistVV, const THistEnc& Enc, const int& Decimals, TChA& Out);
+	static void EncodeAligned(const TVec<TTmBucketV>& BucketVV, const THistEnc& Enc, const int& Decimals, TChA& Out);
+
+	static THistEnc GetEnc(const TChView& EncNm, bool& Ok);
+	static const char* GetEncNm(const THistEnc& Enc);
+
+	// fast decimal formatting
+	static void AddUInt64(const uint64& Val, TChA& Out);
+	// formats Val as %g would
+	static void AddFlt(const double& Val, TChA& Out);
+
+private:
+	static void AddVarInt(const uint64& Val, TChA& Out);
+	static void AddVal(const double& Val, const THistEnc& Enc, const double& Scale, int64& PrevQuant, TChA& Out);
+	static void AddBinHeader(const int& Points, const THistEnc& Enc, const int& Decimals, TChA& Out);
+
+	template <class TPoint>
+	static void EncodeAlignedT(const TVec<TVec<TPoint> >& PointVV, const THistEnc& Enc, const int& Decimals, TChA& Out);
+};
+
+/////////////////////////////////////////////////////////
+// History query
+// parameters of GET history, formatted as `<can>[,<can>]*[;<key>=<value>]*`,
+// the supported keys are:
+//   res    - resolution name (raw, 1h, 1d)
+//   points - maximum number of returned points, if no resolution is
+//            requested the finest resolution which fits is used,
+//            DEF_MX_POINTS if neither points nor limit is given
+//   from   - only points at or after this time (ms)
+//   to     - only points at or before this time (ms)
+//   limit  - maximum number of returned points, the newest are kept
+//   enc    - reply encoding (txt, f32, q)
+//   dec    - number of decimals kept by the quantized encoding
+//   align  - 1 to only return the times present in every series
+class THistQuery {
+public:
+	const static int MX_CANS;
+	const static int DEF_MX_POINTS;
+
+	TIntV CanIdV;
+	int ResN;		// -1 if the resolution should be picked by MxPoints
+	int MxPoints;	// -1 if unlimited
+	int Limit;		// -1 if unlimited
+	uint64 FromTm;
+	uint64 ToTm;
+	THistEnc Enc;
+	int Decimals;
+	bool Align;
+
+	THistQuery(): CanIdV(), ResN(-1), MxPoints(-1), Limit(-1), FromTm(0), ToTm(TUInt64::Mx),
+		Enc(hetTxt), Decimals(2), Align(false) {}
+
+	// returns false if the parameters are invalid
+	static bool Parse(const TChView& Params, THistQuery& Query);
+
+	// maximum number of returned points, -1 if unlimited
+	int GetMxPoints() const;
+	// a string which is equal for queries with equal replies
+	TStr GetKey() const;
+	// the CAN IDs as they are sent in the reply params
+	TChA GetCanIdStr() const;
+};
+
+/////////////////////////////////////////////////////////
+// History reply cache
+// encoded history replies, keyed by THistQuery::GetKey
+//
+// each CAN ID has its own version which is bumped whenever its series
+// changes, an entry remembers the versions of the series it was built
+// from and is dropped once any of them changes, so sampling one signal
+// doesn't drop the replies of the others. A reply is only cached if the
+// versions didn't change while it was being built
+class THistReplyCache {
+private:
+	class TEntry {
+	public:
+		TChA ParamChA;
+		TChA ContentChA;
+		int Points;
+		TIntV CanIdV;
+		TUInt64V VersionV;
+
+		TEntry(): ParamChA(), ContentChA(), Points(0), CanIdV(), VersionV() {}
+	};
+
+	const static int MX_ENTRIES;
+
+	THash<TStr, TEntry> EntryH;
+	THash<TInt, TUInt64> CanVersionH;
+	// bumped when the whole history is replaced
+	uint64 Epoch;
+	int Bytes;
+
+	// statistics
+	uint64 Hits;
+	uint64 Misses;
+	uint64 Rebuilds;
+	uint64 RebuildMicros;
+	uint64 Invalidations;
+
+	TCriticalSection CacheSection;
+
+public:
+	THistReplyCache();
+
+	// copies the cached reply, returns false if there is none
+	bool Get(const TStr& Key, TChA& ParamChA, TChA& ContentChA, int& Points);
+	// caches a reply which was built from the series of CanIdV at versions
+	// VersionV (see GetVersionV) and took BuildMicros to build
+	void Add(const TStr& Key, const TIntV& CanIdV, const TUInt64V& VersionV,
+			const TChA& ParamChA, const TChA& ContentChA, const int& Points,
+			const uint64& BuildMicros);
+
+	// bumps the versions of the CAN IDs whose series changed
+	void Invalidate(const TIntV& CanIdV);
+	// drops all the entries, called when the whole history is replaced
+	void Invalidate();
+	// the current versions of the CAN IDs, the epoch is stored last
+	void GetVersionV(const TIntV& CanIdV, TUInt64V& VersionV);
+
+	PJsonVal GetStatJson();
+
+private:
+	uint64 GetCanVersion(const int& CanId) const;
+	bool IsCurrent(const TIntV& CanIdV, const TUInt64V& VersionV) const;
+	void DelEntry(const int& KeyId);
+};
+
+/////////////////////////////////////////////////////////
+// History file
+// the layout of history.bin, the file starts with a magic string so
+// the file can be told apart from the old format which stored every
+// series as an uncompressed vector
+class THistFile {
+private:
+	const THash<TInt, TTmSeries>& SeriesH;
+
+public:
+	const static TStr MAGIC;
+
+	THistFile(const THash<TInt, TTmSeries>& _SeriesH): SeriesH(_SeriesH) {}
+
+	void Save(TSOut& SOut) const;
+
+	// loads the series directly into SeriesH, throws if the stream
+	// does not hold a history file
+	static void Load(TSIn& SIn, THash<TInt, TTmSeries>& SeriesH);
+};
+
+}
+
+#endif /* HISTORY_H_ */
@@ -39,12 +39,46 @@ int main(int argc, char* argv[]) {
 		const int PortN = Env.GetIfArgPrefixInt("-port=", 8080, "Port number");
 		const TStr HostNm = Env.GetIfArgPrefixStr("-host=", "127.0.0.1", "Host");
 		const TStr DbPath = Env.GetIfArgPrefixStr("-db=", "./db/", "DB folder");
+		const TStr CaptureFNm = Env.GetIfArgPrefixStr("-capture=", "", "Record the inbound traffic to this file");
+		const TStr ReplayFNm = Env.GetIfArgPrefixStr("-replay=", "", "Replay a capture file instead of connecting");
+		const double ReplaySpeed = Env.GetIfArgPrefixFlt("-replay_speed=", 1, "Replay speed relative to the original, 0 = as fast as possible");
+		const TStr ReadingsLogFormatNm = Env.GetIfArgPrefixStr("-log_readings=", "", "Log every reading to the DB folder: txt or bin");
+
+		TReadingsLogFormat ReadingsLogFormat = rlfTxt;
+		const bool LogReadings = !ReadingsLogFormatNm.Empty();
+		if (LogReadings && !TAdriaReadingsLog::GetFormat(ReadingsLogFormatNm, ReadingsLogFormat)) {
+			Notify->OnNotifyFmt(TNotifyType::ntErr, "Unknown readings log format: %s", ReadingsLogFormatNm.CStr());
+			return 1;
+		}
+
+		if (!ReplayFNm.Empty()) {
+			// replay the capture without a socket and exit
+			Notify->OnNotifyFmt(TNotifyType::ntInfo, "Replaying capture %s", ReplayFNm.CStr());
+
+			TDataProvider DataProvider(DbPath, Notify);
+			if (LogReadings) { DataProvider.StartReadingsLog(ReadingsLogFormat); }
+			PSockEvent Communicator = TAdriaCommunicator::NewOffline(Notify);
+			AdriaServer = TAdriaApp::New(Communicator, DataProvider, Notify);
+
+			((TAdriaCommunicator*) Communicator())->Replay(ReplayFNm, ReplaySpeed);
+
+			Notify->OnNotify(TNotifyType::ntInfo, TJsonVal::GetStrFromVal(((TAdriaCommunicator*) Communicator())->GetStatJson()));
+			AdriaServer->ShutDown();
+
+			return 0;
+		}
 
     	// start server
     	Notify->OnNotifyFmt(TNotifyType::ntInfo, "Starting socket client, host: %s, port %d", HostNm.CStr(), PortN);
 
     	TDataProvider DataProvider(DbPath, Notify);
-		AdriaServer = TAdriaApp::New(TAdriaCommunicator::New(HostNm, PortN, Notify), DataProvider, Notify);
+		if (LogReadings) { DataProvider.StartReadingsLog(ReadingsLogFormat); }
+		PSockEvent Communicator = TAdriaCommunicator::New(HostNm, PortN, Notify);
+		if (!CaptureFNm.Empty()) {
+			((TAdriaCommunicator*) Communicator())->StartCapture(CaptureFNm);
+		}
+
+		AdriaServer = TAdriaApp::New(Communicator, DataProvider, Notify);
 
 		TLoop::Ref();
 		TLoop::Run();
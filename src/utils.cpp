@@ -1,5 +1,8 @@
 #include "utils.h"
 
+#include <fcntl.h>
+#include <unistd.h>
+
 using namespace TAdriaUtils;
 
 ////////////////////////////////////////////////////
@@ -8,6 +11,87 @@ const int TUtils::BATTERY_LS_CANID = 106;
 const int TUtils::FRESH_WATER_CANID = 108;
 const int TUtils::WASTE_WATER_CANID = 109;
 
+const TStr TUtils::STRUCT_MAGIC = "ADRIASTR";
+const int TUtils::STRUCT_VERSION = 1;
+
+uint64 TUtils::GetCurrTimeMicros() {
+	return (uint64) std::chrono::duration_cast<std::chrono::microseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+uint TUtils::GetCs(const char* Bf, const int& BfL) {
+	uint Cs = 2166136261u;
+	for (int ChN = 0; ChN < BfL; ChN++) {
+		Cs ^= (uchar) Bf[ChN];
+		Cs *= 16777619u;
+	}
+	return Cs;
+}
+
+void TUtils::WriteStructFile(const TStr& FNm, const char* Bf, const int& BfL, const bool& Sync) {
+	const TStr TmpFNm = FNm + ".tmp";
+
+	{
+		TFOut Out(TmpFNm);
+		Out.PutBf(STRUCT_MAGIC.CStr(), STRUCT_MAGIC.Len());
+		TInt(STRUCT_VERSION).Save(Out);
+		TInt(BfL).Save(Out);
+		TUInt(GetCs(Bf, BfL)).Save(Out);
+		Out.PutBf(Bf, BfL);
+		Out.Flush();
+	}
+
+	if (Sync) {
+		const int Fd = open(TmpFNm.CStr(), O_RDONLY);
+		EAssertR(Fd >= 0, "Failed to open " + TmpFNm + " for syncing!");
+		const int Res = fsync(Fd);
+		close(Fd);
+		EAssertR(Res == 0, "Failed to sync " + TmpFNm + "!");
+	}
+
+	// rename replaces the old file in one step, a crash leaves either
+	// the old or the new file
+	TFile::Rename(TmpFNm, FNm);
+
+	if (Sync) {
+		const int DirFd = open(FNm.GetFPath().CStr(), O_RDONLY);
+		if (DirFd >= 0) {
+			fsync(DirFd);
+			close(DirFd);
+		}
+	}
+}
+
+PSIn TUtils::OpenStructFile(const TStr& FNm) {
+	PSIn SIn = TFIn::New(FNm);
+
+	const int MagicLen = STRUCT_MAGIC.Len();
+	const int HeaderLen = MagicLen + 12;
+
+	// the old format has no header
+	TMem MagicBf;
+	if (SIn->Len() < MagicLen) { return TFIn::New(FNm); }
+	TAdriaCapture::ReadBf(SIn, MagicLen, MagicBf);
+	if (memcmp(MagicBf.GetBf(), STRUCT_MAGIC.CStr(), MagicLen) != 0) { return TFIn::New(FNm); }
+
+	EAssertR(SIn->Len() >= HeaderLen - MagicLen, "Truncated header: " + FNm);
+	const int Version = TInt(*SIn);
+	const int BfL = TInt(*SIn);
+	const uint Cs = TUInt(*SIn);
+
+	EAssertR(Version == STRUCT_VERSION, TStr::Fmt("Unknown version %d of %s", Version, FNm.CStr()));
+	EAssertR(BfL >= 0 && SIn->Len() == BfL, "Truncated file: " + FNm);
+
+	char* Bf = new char[BfL];
+	SIn->GetBf(Bf, BfL);
+	if (GetCs(Bf, BfL) != Cs) {
+		delete[] Bf;
+		TExcept::Throw("Checksum mismatch: " + FNm);
+	}
+
+	return TMIn::New(Bf, BfL, true);
+}
+
 void TUtils::PrintItemSetV(const TVec<TPair<TFlt, TIntV>>& ItemSetSuppV, const PNotify& Notify) {
 	try {
 		Notify->OnNotify(TNotifyType::ntInfo, "Printing frequent itemsets...");
@@ -47,6 +131,57 @@ void TUtils::PrintRuleCandV(const TVec<TPair<TFlt,TPair<TIntV,TInt>>>& RuleCandV
 	}
 }
 
+////////////////////////////////////////////////////
+// TChView
+int TChView::SearchCh(const char& Ch, const int& BChN) const {
+	for (int ChN = BChN; ChN < BfL; ChN++) {
+		if (Bf[ChN] == Ch) { return ChN; }
+	}
+	return -1;
+}
+
+int TChView::GetInt(const int& DefVal) const {
+	if (BfL == 0) { return DefVal; }
+
+	int ChN = 0;
+	bool IsNeg = false;
+	if (Bf[0] == '-') { IsNeg = true; ChN++; }
+	if (ChN == BfL) { return DefVal; }
+
+	int Val = 0;
+	for (; ChN < BfL; ChN++) {
+		const char Ch = Bf[ChN];
+		if (Ch < '0' || '9' < Ch) { return DefVal; }
+
+		const int Digit = Ch - '0';
+		if (Val > (TInt::Mx - Digit) / 10) { return DefVal; }
+		Val = 10*Val + Digit;
+	}
+
+	return IsNeg ? -Val : Val;
+}
+
+bool TChView::GetUInt64(uint64& Val) const {
+	if (BfL == 0) { return false; }
+
+	Val = 0;
+	for (int ChN = 0; ChN < BfL; ChN++) {
+		const char Ch = Bf[ChN];
+		if (Ch < '0' || '9' < Ch) { return false; }
+		Val = 10*Val + (Ch - '0');
+	}
+
+	return true;
+}
+
+TStr TChView::GetStr() const {
+	TChA ChA(BfL+1);
+	for (int ChN = 0; ChN < BfL; ChN++) {
+		ChA += Bf[ChN];
+	}
+	return ChA;
+}
+
 ////////////////////////////////////////////////////
 // TAdriaMsg
 const TChA TAdriaMsg::POST = "POST";
@@ -55,22 +190,34 @@ const TChA TAdriaMsg::GET = "GET";
 
 const TChA TAdriaMsg::RES_TABLE = "res_table";
 const TChA TAdriaMsg::HISTORY = "history";
+const TChA TAdriaMsg::HISTORY_SUB = "history_sub";
+const TChA TAdriaMsg::HISTORY_UNSUB = "history_unsub";
 const TChA TAdriaMsg::PREDICTION = "prediction";
+const TChA TAdriaMsg::STATS = "stats";
+const TChA TAdriaMsg::RULES = "rules";
+const TChA TAdriaMsg::FRAMING = "framing";
+const TChA TAdriaMsg::FRAMING_BINARY = "binary";
 
 const int TAdriaMsg::BYTES_PER_EL = 6;
 
+const uchar TAdriaMsg::BIN_FLAG = 0x80;
+const uchar TAdriaMsg::BIN_METHOD_MASK = 0x03;
+const uchar TAdriaMsg::BIN_HAS_PARAMS = 0x04;
+const uchar TAdriaMsg::BIN_HAS_COMPONENT_ID = 0x08;
+
 TAdriaMsg::TAdriaMsg(const PNotify& _Notify):
-		Buff(600),
 		Method(TAdriaMsgMethod::ammNone),
-		Command(TStr()),
-		Params(TStr()),
+		Command(),
+		Params(),
+		ComponentId(),
 		Length(-1),
-		Content(400),
-		IsLastReadEol(true),
+		Content(),
+		OwnBf(),
+		ArrivalTm(0),
+		CaptureTm(0),
 		Notify(_Notify) {}
 
 bool TAdriaMsg::IsComplete() const {
-	if (!IsLastReadEol) { return false; }
 	if (!HasMethod() || !HasCommand()) { return false; }
 
 	if (IsPush() || IsPost()) {
@@ -83,138 +230,1169 @@ bool TAdriaMsg::IsComplete() const {
 	return true;
 }
 
-void TAdriaMsg::ReadUntil(const PSIn& In, const TStr& EndStr, TChA& Out) const {
-	const int BuffLen = EndStr.Len();
+void TAdriaMsg::Clr() {
+	Method = TAdriaMsgMethod::ammNone;
+	Command.Clr();
+	Params.Clr();
+	ComponentId.Clr();
+	Length = -1;
+	Content.Clr();
+	OwnBf.Clr(false);
+	ArrivalTm = 0;
+	CaptureTm = 0;
+}
+
+void TAdriaMsg::MakeOwned() {
+	OwnBf.Clr(false);
+
+	const int CommandN = OwnBf.Len();		CopyView(Command, OwnBf);
+	const int ParamsN = OwnBf.Len();		CopyView(Params, OwnBf);
+	const int ComponentIdN = OwnBf.Len();	CopyView(ComponentId, OwnBf);
+	const int ContentN = OwnBf.Len();		CopyView(Content, OwnBf);
+
+	// point the views to the own buffer once it doesn't move anymore
+	const char* Bf = OwnBf.GetBf();
+	Command = TChView(Bf + CommandN, Command.Len());
+	Params = TChView(Bf + ParamsN, Params.Len());
+	ComponentId = TChView(Bf + ComponentIdN, ComponentId.Len());
+	Content = TChView(Bf + ContentN, Content.Len());
+}
+
+void TAdriaMsg::CopyView(const TChView& View, TMem& Out) {
+	if (!View.Empty()) {
+		Out.AddBf(View.GetBf(), View.Len());
+	}
+}
+
+TStr TAdriaMsg::GetStr() const {
+	TChA Res;
 
-	const char* Target = EndStr.CStr();
-	char* Buff = new char[BuffLen];
+	switch (Method) {
+	case TAdriaMsgMethod::ammPush:
+		Res += TAdriaMsg::PUSH;
+		break;
+	case TAdriaMsgMethod::ammPost:
+		Res += TAdriaMsg::POST;
+		break;
+	case TAdriaMsgMethod::ammGet:
+		Res += TAdriaMsg::GET;
+		break;
+	default:
+		throw TExcept::New("Invalid method!", "TAdriaMsg::GetStr()");
+	}
 
-	while (!In->Eof()) {
-		char Ch = In->GetCh();
+	Res.Push(' ');
+	Res += Command.GetStr();
 
-		Out += Ch;
+	if (HasParams()) { Res.Push('?'); Res += Params.GetStr(); }
 
-		// shift buffer
-		for (int i = 0; i < BuffLen-1; i++) { Buff[i] = Buff[i+1]; }
-		Buff[BuffLen - 1] = Ch;
+	Res += "\r\n";
 
-		// check if the delimiter was reached
-		if (TAdriaMsg::BuffsEq(Buff, Target, BuffLen))
-			break;
+	if (HasContent()) {
+		Res += TStr("Length=") + TInt::GetStr(Length) + "\r\n";
+		Res += Content.GetStr() + TStr("\r\n");
 	}
 
-	delete Buff;
+	return Res;
 }
 
-void TAdriaMsg::ReadLine(const PSIn& In, TChA& Out) const {
-	ReadUntil(In, "\r\n", Out);
+void TAdriaMsg::Encode(const TAdriaMsgMethod& Method, const TChA& Command, const TChA& Params,
+		const TChA& ComponentId, const TChView& Content, const bool& Binary, TMem& Out) {
+	if (Method == TAdriaMsgMethod::ammNone) {
+		throw TExcept::New("Invalid method!", "TAdriaMsg::Encode");
+	}
+
+	if (Binary) {
+		EncodeBin(Method, Command, Params, ComponentId, Content, Out);
+	} else {
+		EncodeTxt(Method, Command, Params, ComponentId, Content, Out);
+	}
 }
 
-void TAdriaMsg::Read(const PSIn& SIn) {
-	// read the method
-	TChA LineBuff;
-	ReadLine(SIn, LineBuff);
+int TAdriaMsg::GetBinCommandId(const TChA& Command) {
+	for (int CommandId = 1; GetBinCommand(CommandId) != NULL; CommandId++) {
+		if (*GetBinCommand(CommandId) == Command) {
+			return CommandId;
+		}
+	}
+	return 0;
+}
+
+const TChA* TAdriaMsg::GetBinCommand(const int& CommandId) {
+	switch (CommandId) {
+	case 1: return &TAdriaMsg::RES_TABLE;
+	case 2: return &TAdriaMsg::HISTORY;
+	case 3: return &TAdriaMsg::PREDICTION;
+	case 4: return &TAdriaMsg::STATS;
+	case 5: return &TAdriaMsg::RULES;
+	case 6: return &TAdriaMsg::FRAMING;
+	case 7: return &TAdriaMsg::HISTORY_SUB;
+	case 8: return &TAdriaMsg::HISTORY_UNSUB;
+	default: return NULL;
+	}
+}
+
+void TAdriaMsg::PutVarInt(const int& Val, TMem& Out) {
+	uint Rest = (uint) Val;
+	while (Rest >= 0x80) {
+		Out += (char) ((Rest & 0x7F) | 0x80);
+		Rest >>= 7;
+	}
+	Out += (char) Rest;
+}
+
+void TAdriaMsg::EncodeTxt(const TAdriaMsgMethod& Method, const TChA& Command, const TChA& Params,
+		const TChA& ComponentId, const TChView& Content, TMem& Out) {
+
+	const TChA& MethodStr = Method == TAdriaMsgMethod::ammPush ? TAdriaMsg::PUSH :
+			(Method == TAdriaMsgMethod::ammPost ? TAdriaMsg::POST : TAdriaMsg::GET);
+
+	Out.AddBf(MethodStr.CStr(), MethodStr.Len());
+	Out += ' ';
+	Out.AddBf(Command.CStr(), Command.Len());
+
+	if (!Params.Empty()) {
+		Out += '?';
+		Out.AddBf(Params.CStr(), Params.Len());
+	}
+	if (!ComponentId.Empty()) {
+		Out += '&';
+		Out.AddBf(ComponentId.CStr(), ComponentId.Len());
+	}
+
+	Out.AddBf("\r\n", 2);
+
+	if (Method == TAdriaMsgMethod::ammPush || Method == TAdriaMsgMethod::ammPost) {
+		const TStr LenStr = TInt::GetStr(Content.Len());
+
+		Out.AddBf("Length=", 7);
+		Out.AddBf(LenStr.CStr(), LenStr.Len());
+		Out.AddBf("\r\n", 2);
+		Out.AddBf(Content.GetBf(), Content.Len());
+		Out.AddBf("\r\n", 2);
+	}
+}
+
+void TAdriaMsg::EncodeBin(const TAdriaMsgMethod& Method, const TChA& Command, const TChA& Params,
+		const TChA& ComponentId, const TChView& Content, TMem& Out) {
+
+	const int CommandId = GetBinCommandId(Command);
+
+	uchar OpCode = BIN_FLAG | (uchar) Method;
+	if (!Params.Empty()) { OpCode |= BIN_HAS_PARAMS; }
+	if (!ComponentId.Empty()) { OpCode |= BIN_HAS_COMPONENT_ID; }
+
+	Out += (char) OpCode;
+	Out += (char) CommandId;
+
+	// commands without an ID are sent in full
+	if (CommandId == 0) {
+		PutVarInt(Command.Len(), Out);
+		Out.AddBf(Command.CStr(), Command.Len());
+	}
+	if (!Params.Empty()) {
+		PutVarInt(Params.Len(), Out);
+		Out.AddBf(Params.CStr(), Params.Len());
+	}
+	if (!ComponentId.Empty()) {
+		PutVarInt(ComponentId.Len(), Out);
+		Out.AddBf(ComponentId.CStr(), ComponentId.Len());
+	}
+
+	if (Method == TAdriaMsgMethod::ammPush || Method == TAdriaMsgMethod::ammPost) {
+		PutVarInt(Content.Len(), Out);
+		Out.AddBf(Content.GetBf(), Content.Len());
+	}
+}
+
+////////////////////////////////////////////////////
+// TAdriaMsgPool
+TAdriaMsgPool::TAdriaMsgPool(const int& _MxFreeMsgs, const PNotify& _Notify):
+		MxFreeMsgs(_MxFreeMsgs),
+		FreeMsgV(_MxFreeMsgs, 0),
+		Hits(0),
+		Misses(0),
+		Drops(0),
+		PoolSection(TCriticalSectionType::cstRecursive),
+		Notify(_Notify) {}
+
+PAdriaMsg TAdriaMsgPool::Get() {
+	TLock Lock(PoolSection);
+
+	if (FreeMsgV.Empty()) {
+		Misses++;
+		return TAdriaMsg::New(Notify);
+	}
+
+	Hits++;
+
+	PAdriaMsg Msg = FreeMsgV.Last();
+	FreeMsgV.DelLast();
+	return Msg;
+}
+
+void TAdriaMsgPool::Release(TVec<PAdriaMsg>& MsgV) {
+	TLock Lock(PoolSection);
+
+	for (int MsgIdx = 0; MsgIdx < MsgV.Len(); MsgIdx++) {
+		const PAdriaMsg& Msg = MsgV[MsgIdx];
+
+		// only MsgV references the message, it is safe to reuse it
+		if (Msg.GetRefs() == 1 && FreeMsgV.Len() < MxFreeMsgs) {
+			Msg->Clr();
+			FreeMsgV.Add(Msg);
+		} else {
+			Drops++;
+		}
+	}
+
+	MsgV.Clr(false);
+}
+
+PJsonVal TAdriaMsgPool::GetStatJson() {
+	TLock Lock(PoolSection);
+
+	PJsonVal StatJson = TJsonVal::NewObj();
+	StatJson->AddToObj("hits", (double) Hits);
+	StatJson->AddToObj("misses", (double) Misses);
+	StatJson->AddToObj("drops", (double) Drops);
+	StatJson->AddToObj("free", FreeMsgV.Len());
+
+	return StatJson;
+}
+
+////////////////////////////////////////////////////
+// TAdriaMsgParser
+const int TAdriaMsgParser::DEF_BUFF_LEN = 4096;
+const int TAdriaMsgParser::MX_CONTENT_LEN = 16*1024*1024;
+
+TAdriaMsgParser::TAdriaMsgParser(const PNotify& _Notify):
+		Bf(new char[DEF_BUFF_LEN]),
+		BfL(0),
+		MxBfL(DEF_BUFF_LEN),
+		FrameStartN(0),
+		ScanN(0),
+		LineStartN(0),
+		State(apsHeader),
+		Method(TAdriaMsgMethod::ammNone),
+		BinCommand(NULL),
+		CommandB(-1), CommandE(-1),
+		ParamsB(-1), ParamsE(-1),
+		ComponentIdB(-1), ComponentIdE(-1),
+		ContentB(-1),
+		Length(-1),
+		Notify(_Notify) {}
+
+void TAdriaMsgParser::Feed(const PSIn& SIn) {
+	while (!SIn->Eof()) {
+		const int ChunkBfL = SIn->Len();
+
+		if (ChunkBfL <= 0) {
+			// the stream does not know its length, fall back to reading by character
+			Reserve(1);
+			Bf[BfL++] = SIn->GetCh();
+		} else {
+			// read directly into the receive buffer
+			Reserve(ChunkBfL);
+			SIn->GetBf(Bf + BfL, ChunkBfL);
+			BfL += ChunkBfL;
+		}
+	}
+}
+
+void TAdriaMsgParser::Feed(const char* ChunkBf, const int& ChunkBfL) {
+	Reserve(ChunkBfL);
+	memcpy(Bf + BfL, ChunkBf, ChunkBfL);
+	BfL += ChunkBfL;
+}
+
+bool TAdriaMsgParser::Next(TAdriaMsg& Msg) {
+	int LineB, LineE;
+
+	if (State == apsHeader) {
+		if (FrameStartN == BfL) { return false; }
+
+		// binary frames are parsed in one step once they are complete
+		if (((uchar) Bf[FrameStartN] & TAdriaMsg::BIN_FLAG) != 0) {
+			if (!ParseBin()) { return false; }
+
+			FillMsg(Msg);
+			FrameStartN = ScanN;
+			LineStartN = 0;
+			return true;
+		}
+
+		if (!FindLine(LineB, LineE)) { return false; }
+
+		ParseHeader(LineB, LineE);
+
+		if (Method == TAdriaMsgMethod::ammGet) {
+			// GET requests have no content, the frame ends with the line
+			FillMsg(Msg);
+			FrameStartN = ScanN;
+			LineStartN = 0;
+			return true;
+		}
+
+		State = apsLength;
+	}
+
+	if (State == apsLength) {
+		if (!FindLine(LineB, LineE)) { return false; }
+
+		ParseLength(LineB, LineE);
+
+		ContentB = LineStartN;
+		State = apsContent;
+	}
+
+	// wait for the content and the trailing EOL
+	const int ContentN = FrameStartN + ContentB;
+	if (BfL - ContentN - 2 < Length) { return false; }
+
+	FillMsg(Msg);
+
+	int FrameEndN = ContentN + Length;
+	if (Bf[FrameEndN] == '\r' && Bf[FrameEndN+1] == '\n') {
+		FrameEndN += 2;
+	} else {
+		Notify->OnNotify(TNotifyType::ntWarn, "TAdriaMsgParser::Next: Message content not terminated by EOL!");
+	}
+
+	FrameStartN = FrameEndN;
+	ScanN = FrameEndN;
+	LineStartN = 0;
+	State = apsHeader;
+
+	return true;
+}
+
+void TAdriaMsgParser::Clr() {
+	BfL = 0;
+	FrameStartN = 0;
+	ScanN = 0;
+	LineStartN = 0;
+	State = apsHeader;
+	Method = TAdriaMsgMethod::ammNone;
+	Length = -1;
+}
+
+void TAdriaMsgParser::Reserve(const int& ChunkBfL) {
+	// drop the frames which were already consumed
+	if (FrameStartN > 0) {
+		const int PendingLen = BfL - FrameStartN;
+		if (PendingLen > 0) {
+			memmove(Bf, Bf + FrameStartN, PendingLen);
+		}
+
+		BfL = PendingLen;
+		ScanN -= FrameStartN;
+		FrameStartN = 0;
+	}
+
+	if (BfL + ChunkBfL > MxBfL) {
+		const int NewMxBfL = TMath::Mx(2*MxBfL, BfL + ChunkBfL);
+
+		char* NewBf = new char[NewMxBfL];
+		memcpy(NewBf, Bf, BfL);
+		delete[] Bf;
+
+		Bf = NewBf;
+		MxBfL = NewMxBfL;
+	}
+}
+
+bool TAdriaMsgParser::FindLine(int& LineB, int& LineE) {
+	const char* EolPtr = (const char*) memchr(Bf + ScanN, '\n', BfL - ScanN);
+
+	if (EolPtr == NULL) {
+		// remember where we stopped so the next call doesn't rescan
+		ScanN = BfL;
+		return false;
+	}
+
+	LineB = FrameStartN + LineStartN;
+	LineE = int(EolPtr - Bf);
+
+	ScanN = LineE + 1;
+	LineStartN = ScanN - FrameStartN;
 
 	// ignore the EOL
-	LineBuff.DelLastCh();	LineBuff.DelLastCh();
+	if (LineE > LineB && Bf[LineE-1] == '\r') { LineE--; }
 
-	if (LineBuff.IsPrefix(TAdriaMsg::PUSH)) {
+	return true;
+}
+
+void TAdriaMsgParser::ParseHeader(const int& LineB, const int& LineE) {
+	const char* LineBf = Bf + LineB;
+	const int LineBfL = LineE - LineB;
+
+	if (IsPrefix(LineBf, LineBfL, TAdriaMsg::PUSH)) {
 		Method = TAdriaMsgMethod::ammPush;
-	} else if (LineBuff.IsPrefix(TAdriaMsg::POST)) {
+	} else if (IsPrefix(LineBf, LineBfL, TAdriaMsg::POST)) {
 		Method = TAdriaMsgMethod::ammPost;
-	} else if (LineBuff.IsPrefix(TAdriaMsg::GET)) {
+	} else if (IsPrefix(LineBf, LineBfL, TAdriaMsg::GET)) {
 		Method = TAdriaMsgMethod::ammGet;
 	} else {
-		throw TExcept::New(TStr("Invalid protocol method: ") + LineBuff, "TAdriaMsg::Read(const PSIn& SIn)");
+		SkipFrame("Invalid protocol method: ", LineB, LineE);
 	}
 
 	// parse the command
-	int SpaceIdx = LineBuff.SearchCh(' ', 3);
+	const int SpaceIdx = SearchCh(LineBf, 3, LineBfL, ' ');
+	if (SpaceIdx < 0) {
+		SkipFrame("Missing command: ", LineB, LineE);
+	}
+
 	// check if the line has parameters
-	int QuestionMrkIdx = LineBuff.SearchCh('?', SpaceIdx+1);
-	int AndIdx = LineBuff.SearchCh('&', SpaceIdx+1);
+	const int QuestionMrkIdx = SearchCh(LineBf, SpaceIdx+1, LineBfL, '?');
+	const int AndIdx = SearchCh(LineBf, SpaceIdx+1, LineBfL, '&');
+
+	const int Offset = LineB - FrameStartN;
+
+	BinCommand = NULL;
+	CommandB = Offset + SpaceIdx + 1;
+	ParamsB = -1;	ParamsE = -1;
+	ComponentIdB = -1;	ComponentIdE = -1;
 
 	// multiple cases
 	if (QuestionMrkIdx < 0 && AndIdx < 0) {
 		// only the command is present
-		Command = LineBuff.GetSubStr(SpaceIdx+1, LineBuff.Len());
+		CommandE = Offset + LineBfL;
 	} else if (AndIdx < 0) {
 		// only the parameters are present
-		Command = LineBuff.GetSubStr(SpaceIdx+1, QuestionMrkIdx-1);
-		Params = LineBuff.GetSubStr(QuestionMrkIdx+1, LineBuff.Len());
+		CommandE = Offset + QuestionMrkIdx;
+		ParamsB = Offset + QuestionMrkIdx + 1;	ParamsE = Offset + LineBfL;
 	} else if (QuestionMrkIdx < 0) {
 		// only the ID is present
-		Command = LineBuff.GetSubStr(SpaceIdx+1, AndIdx-1);
-		ComponentId = LineBuff.GetSubStr(AndIdx+1, LineBuff.Len());
+		CommandE = Offset + AndIdx;
+		ComponentIdB = Offset + AndIdx + 1;	ComponentIdE = Offset + LineBfL;
 	} else {
 		// both the parameters and the ID are present
-		Command = LineBuff.GetSubStr(SpaceIdx+1, QuestionMrkIdx-1);
-		Params = LineBuff.GetSubStr(QuestionMrkIdx+1, AndIdx-1);
-		ComponentId = LineBuff.GetSubStr(AndIdx+1, LineBuff.Len());
+		CommandE = Offset + QuestionMrkIdx;
+		ParamsB = Offset + QuestionMrkIdx + 1;	ParamsE = Offset + AndIdx;
+		ComponentIdB = Offset + AndIdx + 1;	ComponentIdE = Offset + LineBfL;
 	}
 
-	if (HasContent()) {
-		// parse the length
-		LineBuff.Clr();
-		ReadLine(SIn, LineBuff);
-		// ignore the EOL
-		LineBuff.DelLastCh();	LineBuff.DelLastCh();
+	Length = -1;
+	ContentB = -1;
+}
+
+void TAdriaMsgParser::ParseLength(const int& LineB, const int& LineE) {
+	const char* LineBf = Bf + LineB;
+	const int LineBfL = LineE - LineB;
+
+	const TChA LengthPrefix = "Length=";
+	if (!IsPrefix(LineBf, LineBfL, LengthPrefix)) {
+		SkipFrame("Invalid length line: ", LineB, LineE);
+	}
+
+	Length = TChView(LineBf + LengthPrefix.Len(), LineBfL - LengthPrefix.Len()).GetInt(-1);
+	if (Length < 0 || Length > MX_CONTENT_LEN) {
+		SkipFrame("Invalid content length: ", LineB, LineE);
+	}
+}
+
+bool TAdriaMsgParser::ParseBin() {
+	int ChN = FrameStartN;
+
+	if (BfL - ChN < 2) { return false; }
+
+	const uchar OpCode = (uchar) Bf[ChN++];
+	const int CommandId = (uchar) Bf[ChN++];
 
-		TStr LenStr = LineBuff.GetSubStr(7, LineBuff.Len());
-		Length = LenStr.GetInt();
+	Method = (TAdriaMsgMethod) (OpCode & TAdriaMsg::BIN_METHOD_MASK);
+	BinCommand = NULL;
+	CommandB = -1;	CommandE = -1;
+	ParamsB = -1;	ParamsE = -1;
+	ComponentIdB = -1;	ComponentIdE = -1;
+	ContentB = -1;
+	Length = -1;
 
-		// read the content
-		int i = 0;
-		while (i++ < Length && !SIn->Eof()) {
-			char Ch = SIn->GetCh();
-			Content.AddCh(Ch);
+	if (Method == TAdriaMsgMethod::ammNone) {
+		// a binary frame can't be skipped without knowing its layout, drop everything
+		FrameStartN = BfL;	ScanN = BfL;
+		throw TExcept::New(TStr("Invalid binary opcode: ") + TInt::GetStr(OpCode), "TAdriaMsgParser::ParseBin");
+	}
+
+	if (CommandId == 0) {
+		if (!ReadBinField(ChN, CommandB, CommandE)) { return false; }
+	} else {
+		BinCommand = TAdriaMsg::GetBinCommand(CommandId);
+		if (BinCommand == NULL) {
+			FrameStartN = BfL;	ScanN = BfL;
+			throw TExcept::New(TStr("Invalid binary command ID: ") + TInt::GetStr(CommandId), "TAdriaMsgParser::ParseBin");
 		}
+	}
+
+	if ((OpCode & TAdriaMsg::BIN_HAS_PARAMS) != 0) {
+		if (!ReadBinField(ChN, ParamsB, ParamsE)) { return false; }
+	}
+	if ((OpCode & TAdriaMsg::BIN_HAS_COMPONENT_ID) != 0) {
+		if (!ReadBinField(ChN, ComponentIdB, ComponentIdE)) { return false; }
+	}
 
-		if (i < Length) {
-			Notify->OnNotifyFmt(ntWarn, "Failed to read whole message. %d characters missing!", Length-i);
+	if (Method != TAdriaMsgMethod::ammGet) {
+		int ContentE;
+		if (!ReadBinField(ChN, ContentB, ContentE)) { return false; }
+		Length = ContentE - ContentB;
+	}
+
+	ScanN = ChN;
+	return true;
+}
+
+bool TAdriaMsgParser::ReadBinField(int& ChN, int& FieldB, int& FieldE) {
+	int FieldLen;
+	if (!ReadVarInt(ChN, FieldLen)) { return false; }
+	if (FieldLen > MX_CONTENT_LEN) {
+		FrameStartN = BfL;	ScanN = BfL;
+		throw TExcept::New(TStr("Binary frame field too long: ") + TInt::GetStr(FieldLen), "TAdriaMsgParser::ReadBinField");
+	}
+	if (BfL - ChN < FieldLen) { return false; }
+
+	FieldB = ChN - FrameStartN;
+	ChN += FieldLen;
+	FieldE = ChN - FrameStartN;
+
+	return true;
+}
+
+bool TAdriaMsgParser::ReadVarInt(int& ChN, int& Val) {
+	uint Res = 0;
+	int Shift = 0;
+
+	while (true) {
+		if (ChN >= BfL) { return false; }
+
+		const uchar Ch = (uchar) Bf[ChN++];
+		Res |= uint(Ch & 0x7F) << Shift;
+
+		if ((Ch & 0x80) == 0) { break; }
+
+		Shift += 7;
+		if (Shift > 28) {
+			FrameStartN = BfL;	ScanN = BfL;
+			throw TExcept::New("Invalid varint in binary frame!", "TAdriaMsgParser::ReadVarInt");
 		}
+	}
 
-		// newline at the end
-		SIn->GetCh();	SIn->GetCh();
+	Val = (int) Res;
+	if (Val < 0) {
+		FrameStartN = BfL;	ScanN = BfL;
+		throw TExcept::New("Invalid field length in binary frame!", "TAdriaMsgParser::ReadVarInt");
 	}
+
+	return true;
 }
 
-TStr TAdriaMsg::GetStr() const {
-	TChA Res;
+void TAdriaMsgParser::FillMsg(TAdriaMsg& Msg) const {
+	const char* FrameBf = Bf + FrameStartN;
 
-	switch (Method) {
-	case TAdriaMsgMethod::ammPush:
-		Res += TAdriaMsg::PUSH;
-		break;
-	case TAdriaMsgMethod::ammPost:
-		Res += TAdriaMsg::POST;
-		break;
-	case TAdriaMsgMethod::ammGet:
-		Res += TAdriaMsg::GET;
-		break;
-	default:
-		throw TExcept::New("Invalid method!", "TAdriaMsg::GetStr()");
+	Msg.Method = Method;
+	Msg.Command = BinCommand != NULL ? TChView(*BinCommand) : TChView(FrameBf + CommandB, CommandE - CommandB);
+	Msg.Params = ParamsB >= 0 ? TChView(FrameBf + ParamsB, ParamsE - ParamsB) : TChView();
+	Msg.ComponentId = ComponentIdB >= 0 ? TChView(FrameBf + ComponentIdB, ComponentIdE - ComponentIdB) : TChView();
+
+	if (Method == TAdriaMsgMethod::ammGet) {
+		Msg.Length = -1;
+		Msg.Content.Clr();
+	} else {
+		Msg.Length = Length;
+		Msg.Content = TChView(FrameBf + ContentB, Length);
 	}
+}
 
-	Res.Push(' ');
-	Res += Command;
+void TAdriaMsgParser::SkipFrame(const TStr& MsgStr, const int& LineB, const int& LineE) {
+	const TStr LineStr = TChView(Bf + LineB, LineE - LineB).GetStr();
 
-	if (HasParams()) { Res.Push('?'); Res += Params; }
+	// continue with the line following the invalid one
+	FrameStartN = ScanN;
+	LineStartN = 0;
+	State = apsHeader;
+	Method = TAdriaMsgMethod::ammNone;
 
-	Res += "\r\n";
+	throw TExcept::New(MsgStr + LineStr, "TAdriaMsgParser::SkipFrame");
+}
 
-	if (HasContent()) {
-		Res += TStr("Length=") + TInt::GetStr(Length) + "\r\n";
-		Res += Content + TStr("\r\n");
+bool TAdriaMsgParser::IsPrefix(const char* LineBf, const int& LineBfL, const TChA& Prefix) {
+	return LineBfL >= Prefix.Len() && memcmp(LineBf, Prefix.CStr(), Prefix.Len()) == 0;
+}
+
+int TAdriaMsgParser::SearchCh(const char* LineBf, const int& B, const int& E, const char& Ch) {
+	if (B >= E) { return -1; }
+	const char* ChPtr = (const char*) memchr(LineBf + B, Ch, E - B);
+	return ChPtr == NULL ? -1 : int(ChPtr - LineBf);
+}
+
+////////////////////////////////////////////////////
+// TAdriaSendQueue
+const uint64 TAdriaSendQueue::RATE_WINDOW_MSECS = 1000;
+
+TAdriaSendQueue::TAdriaSendQueue(const uint64& _HighWaterBytes, const int& InitFrames):
+		FrameV(InitFrames, InitFrames),
+		BinaryV(InitFrames, InitFrames),
+		HeadN(0),
+		NFrames(0),
+		NBinary(0),
+		QueuedBytes(0),
+		HighWaterBytes(_HighWaterBytes),
+		MxQueuedBytes(0),
+		Enqueued(0),
+		Rejected(0),
+		Flushes(0),
+		SentBytes(0),
+		RateStartTm(TTm::GetCurUniMSecs()),
+		RateBytes(0),
+		BytesPerSec(0),
+		QueueSection(TCriticalSectionType::cstRecursive) {}
+
+bool TAdriaSendQueue::Push(const TMem& Frame, const bool& IsBinary) {
+	TLock Lock(QueueSection);
+
+	if (QueuedBytes >= HighWaterBytes) {
+		Rejected++;
+		return false;
 	}
 
-	return Res;
+	if (NFrames == FrameV.Len()) { Grow(); }
+
+	// reuse the memory of the slot
+	const int SlotN = (HeadN + NFrames) % FrameV.Len();
+	TMem& Slot = FrameV[SlotN];
+	Slot.Clr(false);
+	Slot.AddBf(Frame.GetBf(), Frame.Len());
+	BinaryV[SlotN] = IsBinary;
+
+	NFrames++;
+	if (IsBinary) { NBinary++; }
+	QueuedBytes += Frame.Len();
+	Enqueued++;
+
+	if (QueuedBytes > MxQueuedBytes) { MxQueuedBytes = QueuedBytes; }
+
+	return true;
+}
+
+int TAdriaSendQueue::Peek(TMem& Out, const int& MxBytes, const bool& TextOnly) {
+	TLock Lock(QueueSection);
+
+	int NPeeked = 0;
+	while (NPeeked < NFrames && Out.Len() < MxBytes) {
+		const int SlotN = (HeadN + NPeeked) % FrameV.Len();
+		if (TextOnly && BinaryV[SlotN]) { break; }
+
+		const TMem& Frame = FrameV[SlotN];
+		Out.AddBf(Frame.GetBf(), Frame.Len());
+		NPeeked++;
+	}
+
+	return NPeeked;
+}
+
+void TAdriaSendQueue::OnSent(const int& NSent, const int& Bytes) {
+	TLock Lock(QueueSection);
+
+	// the frames were peeked by the only consumer, so they are still at the head
+	for (int FrameN = 0; FrameN < NSent && NFrames > 0; FrameN++) {
+		QueuedBytes -= FrameV[HeadN].Len();
+		if (BinaryV[HeadN]) { NBinary--; }
+
+		HeadN = (HeadN + 1) % FrameV.Len();
+		NFrames--;
+	}
+
+	Flushes++;
+	SentBytes += Bytes;
+	RateBytes += Bytes;
+
+	UpdateRate(TTm::GetCurUniMSecs());
+}
+
+int TAdriaSendQueue::DelBinary() {
+	TLock Lock(QueueSection);
+
+	if (NBinary == 0) { return 0; }
+
+	// move the text frames to the front of the ring, keeping their order
+	const int Len = FrameV.Len();
+	int NKept = 0;
+	for (int FrameN = 0; FrameN < NFrames; FrameN++) {
+		const int SlotN = (HeadN + FrameN) % Len;
+		if (BinaryV[SlotN]) {
+			QueuedBytes -= FrameV[SlotN].Len();
+			continue;
+		}
+
+		const int KeptSlotN = (HeadN + NKept) % Len;
+		if (KeptSlotN != SlotN) {
+			FrameV[KeptSlotN] = FrameV[SlotN];
+			BinaryV[KeptSlotN] = false;
+		}
+		NKept++;
+	}
+
+	const int Deleted = NFrames - NKept;
+	NFrames = NKept;
+	NBinary = 0;
+	return Deleted;
+}
+
+void TAdriaSendQueue::Clr() {
+	TLock Lock(QueueSection);
+
+	HeadN = 0;
+	NFrames = 0;
+	NBinary = 0;
+	QueuedBytes = 0;
+}
+
+bool TAdriaSendQueue::Empty() {
+	TLock Lock(QueueSection);
+	return NFrames == 0;
+}
+
+int TAdriaSendQueue::GetFrames() {
+	TLock Lock(QueueSection);
+	return NFrames;
+}
+
+int TAdriaSendQueue::GetBinaryFrames() {
+	TLock Lock(QueueSection);
+	return NBinary;
+}
+
+uint64 TAdriaSendQueue::GetBytes() {
+	TLock Lock(QueueSection);
+	return QueuedBytes;
+}
+
+PJsonVal TAdriaSendQueue::GetStatJson() {
+	TLock Lock(QueueSection);
+
+	UpdateRate(TTm::GetCurUniMSecs());
+
+	PJsonVal StatJson = TJsonVal::NewObj();
+	StatJson->AddToObj("frames", NFrames);
+	StatJson->AddToObj("binaryFrames", NBinary);
+	StatJson->AddToObj("bytes", (double) QueuedBytes);
+	StatJson->AddToObj("maxBytes", (double) MxQueuedBytes);
+	StatJson->AddToObj("highWaterBytes", (double) HighWaterBytes);
+	StatJson->AddToObj("enqueued", (double) Enqueued);
+	StatJson->AddToObj("rejected", (double) Rejected);
+	StatJson->AddToObj("flushes", (double) Flushes);
+	StatJson->AddToObj("sentBytes", (double) SentBytes);
+	StatJson->AddToObj("bytesPerSec", BytesPerSec);
+
+	return StatJson;
+}
+
+void TAdriaSendQueue::Grow() {
+	const int OldLen = FrameV.Len();
+	const int NewLen = TMath::Mx(2*OldLen, 1);
+
+	// unroll the ring into the new vector
+	TVec<TMem> NewFrameV(NewLen, NewLen);
+	TBoolV NewBinaryV(NewLen, NewLen);
+	for (int i = 0; i < NFrames; i++) {
+		NewFrameV[i] = FrameV[(HeadN + i) % OldLen];
+		NewBinaryV[i] = BinaryV[(HeadN + i) % OldLen];
+	}
+
+	FrameV = NewFrameV;
+	BinaryV = NewBinaryV;
+	HeadN = 0;
+}
+
+void TAdriaSendQueue::UpdateRate(const uint64& CurrTm) {
+	const uint64 Elapsed = CurrTm - RateStartTm;
+	if (Elapsed < RATE_WINDOW_MSECS) { return; }
+
+	BytesPerSec = 1000.0 * RateBytes / Elapsed;
+	RateStartTm = CurrTm;
+	RateBytes = 0;
+}
+
+////////////////////////////////////////////////////
+// TAdriaCapture
+const TStr TAdriaCapture::MAGIC = "ADRIACAP1";
+
+void TAdriaCapture::ReadBf(const PSIn& SIn, const int& Len, TMem& Out) {
+	char Bf[4096];
+
+	Out.Clr(false);
+
+	int ReadN = 0;
+	while (ReadN < Len) {
+		const int ChunkLen = TMath::Mn(Len - ReadN, (int) sizeof(Bf));
+		SIn->GetBf(Bf, ChunkLen);
+		Out.AddBf(Bf, ChunkLen);
+		ReadN += ChunkLen;
+	}
+}
+
+////////////////////////////////////////////////////
+// TAdriaCaptureWriter
+const uint64 TAdriaCaptureWriter::FLUSH_INTERVAL_MSECS = 1000;
+
+TAdriaCaptureWriter::TAdriaCaptureWriter(const TStr& FNm):
+		SOut(TFOut::New(FNm)),
+		LastFlushTm(TTm::GetCurUniMSecs()),
+		Chunks(0),
+		Bytes(0),
+		CaptureSection(TCriticalSectionType::cstRecursive) {
+
+	SOut->PutBf(TAdriaCapture::MAGIC.CStr(), TAdriaCapture::MAGIC.Len());
+}
+
+void TAdriaCaptureWriter::Write(const PSIn& SIn, TMem& ChunkBf) {
+	TAdriaCapture::ReadBf(SIn, SIn->Len(), ChunkBf);
+	Write(TTm::GetCurUniMSecs(), ChunkBf.GetBf(), ChunkBf.Len());
+}
+
+void TAdriaCaptureWriter::Write(const uint64& Tm, const char* Bf, const int& BfL) {
+	TLock Lock(CaptureSection);
+
+	TUInt64(Tm).Save(*SOut);
+	TInt(BfL).Save(*SOut);
+	SOut->PutBf(Bf, BfL);
+
+	Chunks++;
+	Bytes += BfL;
+
+	// flush periodically so a crash doesn't lose much of the capture
+	if (Tm - LastFlushTm >= FLUSH_INTERVAL_MSECS) {
+		SOut->Flush();
+		LastFlushTm = Tm;
+	}
+}
+
+void TAdriaCaptureWriter::Flush() {
+	TLock Lock(CaptureSection);
+	SOut->Flush();
+}
+
+PJsonVal TAdriaCaptureWriter::GetStatJson() {
+	TLock Lock(CaptureSection);
+
+	PJsonVal StatJson = TJsonVal::NewObj();
+	StatJson->AddToObj("chunks", (double) Chunks);
+	StatJson->AddToObj("bytes", (double) Bytes);
+	return StatJson;
+}
+
+////////////////////////////////////////////////////
+// TAdriaCaptureReader
+TAdriaCaptureReader::TAdriaCaptureReader(const TStr& FNm):
+		SIn(TFIn::New(FNm)),
+		Torn(false) {
+
+	const int MagicLen = TAdriaCapture::MAGIC.Len();
+
+	TMem MagicBf;
+	EAssertR(SIn->Len() >= MagicLen, "Invalid capture file: " + FNm);
+	TAdriaCapture::ReadBf(SIn, MagicLen, MagicBf);
+	EAssertR(memcmp(MagicBf.GetBf(), TAdriaCapture::MAGIC.CStr(), MagicLen) == 0, "Invalid capture file: " + FNm);
+}
+
+bool TAdriaCaptureReader::Next(uint64& Tm, TMem& ChunkBf) {
+	if (Torn || SIn->Eof()) { return false; }
+
+	// time and length
+	if (SIn->Len() < 12) { Torn = true; return false; }
+	Tm = TUInt64(*SIn);
+	const int BfL = TInt(*SIn);
+
+	if (BfL < 0 || SIn->Len() < BfL) { Torn = true; return false; }
+	TAdriaCapture::ReadBf(SIn, BfL, ChunkBf);
+	return true;
+}
+
+////////////////////////////////////////////////////
+// TAdriaReadingsLog
+const TStr TAdriaReadingsLog::MAGIC = "ADRIARDG1";
+const int TAdriaReadingsLog::FLUSH_BYTES = 64*1024;
+const uint64 TAdriaReadingsLog::FLUSH_INTERVAL_MSECS = 1000;
+const uint64 TAdriaReadingsLog::MX_FILE_BYTES = uint64(64)*1024*1024;
+const uint64 TAdriaReadingsLog::MX_FILE_AGE_MSECS = uint64(1000)*60*60*24;
+
+bool TAdriaReadingsLog::GetFormat(const TStr& FormatNm, TReadingsLogFormat& Format) {
+	if (FormatNm == "txt") {
+		Format = rlfTxt;
+		return true;
+	} else if (FormatNm == "bin") {
+		Format = rlfBin;
+		return true;
+	}
+	return false;
 }
 
-bool TAdriaMsg::BuffsEq(const char* Buff1, const char* Buff2, const int& BuffLen) {
-	for (int i = 0; i < BuffLen; i++) {
-		if (Buff1[i] != Buff2[i])
-			return false;
+TAdriaReadingsLog::TAdriaReadingsLog(const TStr& _FNm, const TReadingsLogFormat& _Format):
+		FNm(_FNm),
+		Format(_Format),
+		Bf(),
+		WriteBf(),
+		SOut(),
+		FileBytes(0),
+		FileStartTm(0),
+		LastFlushTm(TTm::GetCurUniMSecs()),
+		LastSec(TUInt64::Mx),
+		LastTmStr(),
+		Recs(0),
+		Flushes(0),
+		Rotations(0),
+		LogSection(TCriticalSectionType::cstRecursive),
+		WriteSection(TCriticalSectionType::cstRecursive) {
+
+	Bf.Reserve(FLUSH_BYTES + 64);
+	WriteBf.Reserve(FLUSH_BYTES + 64);
+
+	if (TFile::Exists(FNm)) {
+		Rotate();
+	} else {
+		Open();
 	}
+}
+
+void TAdriaReadingsLog::Add(const uint64& Tm, const int& CanId, const double& Val) {
+	TLock Lock(LogSection);
+
+	if (Format == rlfTxt) {
+		const uint64 Sec = Tm / 1000;
+		if (Sec != LastSec) {
+			LastTmStr = TTm::GetTmFromMSecs(Tm).GetWebLogDateTimeStr(true, "T");
+			LastSec = Sec;
+		}
+
+		Bf += LastTmStr;
+		Bf += ',';
+		Bf += TInt::GetStr(CanId);
+		Bf += ',';
+		Bf += TFlt::GetStr(Val);
+		Bf += '\n';
+	} else {
+		for (int ByteN = 0; ByteN < 8; ByteN++) {
+			Bf += (char) ((Tm >> (8*ByteN)) & 0xFF);
+		}
+		Bf += (char) (uchar) CanId;
+
+		const float FltVal = (float) Val;
+		uint Bits;	memcpy(&Bits, &FltVal, sizeof(float));
+		for (int ByteN = 0; ByteN < 4; ByteN++) {
+			Bf += (char) ((Bits >> (8*ByteN)) & 0xFF);
+		}
+	}
+
+	Recs++;
+}
+
+void TAdriaReadingsLog::Flush() {
+	Write();
+}
+
+void TAdriaReadingsLog::FlushIfDue() {
+	bool Due;
+	{
+		TLock Lock(LogSection);
+		Due = Bf.Len() >= FLUSH_BYTES ||
+				(!Bf.Empty() && TTm::GetCurUniMSecs() - LastFlushTm >= FLUSH_INTERVAL_MSECS);
+	}
+
+	if (Due) { Write(); }
+}
+
+PJsonVal TAdriaReadingsLog::GetStatJson() {
+	TLock Lock(LogSection);
+
+	PJsonVal StatJson = TJsonVal::NewObj();
+	StatJson->AddToObj("format", Format == rlfTxt ? "txt" : "bin");
+	StatJson->AddToObj("records", (double) Recs);
+	StatJson->AddToObj("flushes", (double) Flushes);
+	StatJson->AddToObj("rotations", (double) Rotations);
+	StatJson->AddToObj("fileBytes", (double) FileBytes);
+	StatJson->AddToObj("buffered", Bf.Len());
+	return StatJson;
+}
+
+void TAdriaReadingsLog::Write() {
+	TLock WriteLock(WriteSection);
+
+	const uint64 CurrTm = TTm::GetCurUniMSecs();
+
+	// take the buffered readings, new ones are added while writing
+	{
+		TLock Lock(LogSection);
+		if (Bf.Empty()) { return; }
+
+		WriteBf.Swap(Bf);
+		Bf.Clr();
+		LastFlushTm = CurrTm;
+	}
+
+	SOut->PutBf(WriteBf.CStr(), WriteBf.Len());
+	SOut->Flush();
+
+	bool DoRotate;
+	{
+		TLock Lock(LogSection);
+		FileBytes += WriteBf.Len();
+		Flushes++;
+		DoRotate = FileBytes >= MX_FILE_BYTES || CurrTm - FileStartTm >= MX_FILE_AGE_MSECS;
+	}
+	WriteBf.Clr();
+
+	if (DoRotate) {
+		Rotate();
+	}
+}
+
+void TAdriaReadingsLog::Rotate() {
+	// close the file before renaming it
+	SOut.Clr();
+
+	if (TFile::Exists(FNm)) {
+		const TStr StampStr = TUInt64::GetStr(TTm::GetCurUniMSecs());
+		TStr RotatedFNm = FNm + "." + StampStr;
+		for (int FNmN = 1; TFile::Exists(RotatedFNm); FNmN++) {
+			RotatedFNm = FNm + "." + StampStr + "-" + TInt::GetStr(FNmN);
+		}
+		TFile::Rename(FNm, RotatedFNm);
+
+		TLock Lock(LogSection);
+		Rotations++;
+	}
+
+	Open();
+}
+
+void TAdriaReadingsLog::Open() {
+	SOut = TFOut::New(FNm);
+	if (Format == rlfBin) {
+		SOut->PutBf(MAGIC.CStr(), MAGIC.Len());
+	}
+
+	TLock Lock(LogSection);
+	FileBytes = Format == rlfBin ? MAGIC.Len() : 0;
+	FileStartTm = TTm::GetCurUniMSecs();
+}
+
+////////////////////////////////////////////////////
+// TAdriaWal
+const TStr TAdriaWal::MAGIC = "ADRIAWAL1";
+
+TAdriaWal::TAdriaWal(const TStr& _FNm, const bool& Append):
+		FNm(_FNm),
+		SOut(),
+		Recs(0),
+		Bytes(0),
+		Rotations(0),
+		WalSection(TCriticalSectionType::cstRecursive) {
+
+	Open(Append);
+}
+
+void TAdriaWal::Write(const uchar& Type, const char* Bf, const int& BfL) {
+	TLock Lock(WalSection);
+
+	SOut->PutCh((char) Type);
+	TInt(BfL).Save(*SOut);
+	SOut->PutBf(Bf, BfL);
+	TUInt(TUtils::GetCs(Bf, BfL)).Save(*SOut);
+	SOut->Flush();
+
+	Recs++;
+	Bytes += BfL + 9;
+}
+
+void TAdriaWal::Rotate(const TStr& PrevFNm) {
+	TLock Lock(WalSection);
+
+	SOut.Clr();
+
+	// the records of a log that is being written are intact
+	if (TFile::Exists(PrevFNm)) {
+		MoveRecs(FNm, PrevFNm);
+	} else {
+		TFile::Rename(FNm, PrevFNm);
+	}
+
+	Open(false);
+
+	Recs = 0;
+	Bytes = 0;
+	Rotations++;
+}
+
+void TAdriaWal::MoveRecs(const TStr& FNm, const TStr& PrevFNm) {
+	if (!TFile::Exists(FNm)) { return; }
+
+	// a torn record is dropped, so records appended later stay readable
+	{
+		TAdriaWal PrevWal(PrevFNm, true);
+		TAdriaWalReader Reader(FNm);
+
+		uchar Type;
+		TMem RecBf;
+		while (Reader.Next(Type, RecBf)) {
+			PrevWal.Write(Type, RecBf.GetBf(), RecBf.Len());
+		}
+	}
+
+	TFile::Del(FNm);
+}
+
+PJsonVal TAdriaWal::GetStatJson() {
+	TLock Lock(WalSection);
+
+	PJsonVal StatJson = TJsonVal::NewObj();
+	StatJson->AddToObj("records", (double) Recs);
+	StatJson->AddToObj("bytes", (double) Bytes);
+	StatJson->AddToObj("rotations", (double) Rotations);
+	return StatJson;
+}
+
+void TAdriaWal::Open(const bool& Append) {
+	// a log cut off before its header is started again
+	if (Append && TFile::Exists(FNm) && !TAdriaWalReader(FNm).IsTorn()) {
+		SOut = TFOut::New(FNm, true);
+	} else {
+		// close the old file before truncating it
+		SOut.Clr();
+		SOut = TFOut::New(FNm);
+		SOut->PutBf(MAGIC.CStr(), MAGIC.Len());
+		SOut->Flush();
+	}
+}
+
+////////////////////////////////////////////////////
+// TAdriaWalReader
+TAdriaWalReader::TAdriaWalReader(const TStr& FNm):
+		SIn(TFIn::New(FNm)),
+		Torn(false) {
+
+	const int MagicLen = TAdriaWal::MAGIC.Len();
+
+	// a crash right after the file was created leaves it without the
+	// header, such a log holds no records
+	if (SIn->Len() < MagicLen) { Torn = true; return; }
+
+	TMem MagicBf;
+	TAdriaCapture::ReadBf(SIn, MagicLen, MagicBf);
+	if (memcmp(MagicBf.GetBf(), TAdriaWal::MAGIC.CStr(), MagicLen) != 0) { Torn = true; }
+}
+
+bool TAdriaWalReader::Next(uchar& Type, TMem& RecBf) {
+	if (Torn || SIn->Eof()) { return false; }
+
+	// type and length
+	if (SIn->Len() < 5) { Torn = true; return false; }
+	Type = (uchar) SIn->GetCh();
+	const int BfL = TInt(*SIn);
+
+	// payload and checksum
+	if (Type == 0 || BfL < 0 || SIn->Len() < BfL + 4) { Torn = true; return false; }
+	TAdriaCapture::ReadBf(SIn, BfL, RecBf);
+	const uint Cs = TUInt(*SIn);
+
+	if (Cs != TUtils::GetCs(RecBf.GetBf(), RecBf.Len())) { Torn = true; return false; }
 	return true;
 }
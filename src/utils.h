@@ -4,6 +4,9 @@
 #include <base.h>
 #include <net.h>
 #include <mine.h>
+#include <thread.h>
+#include <atomic>
+#include <chrono>
 
 namespace TAdriaUtils {
 
@@ -15,11 +18,16 @@ public:
 
 	static uint64 GetCurrTimeStamp();
 	static TStr GetCurrTimeStr();
+	// monotonic time in microseconds, for measuring latencies
+	static uint64 GetCurrTimeMicros();
 
 	// file names
 	static TStr GetLogFName(const TStr& DbPath) { return DbPath + "/readings.log"; }
+	static TStr GetBinLogFName(const TStr& DbPath) { return DbPath + "/readings.bin"; }
 	static TStr GetHistFName(const TStr& DbPath) { return DbPath + "/history.bin"; }
 	static TStr GetHistBackupFName( const TStr& DbPath) { return DbPath + "/history-backup.bin"; }
+	static TStr GetWalFName(const TStr& DbPath) { return DbPath + "/state.wal"; }
+	static TStr GetPrevWalFName(const TStr& DbPath) { return DbPath + "/state-prev.wal"; }
 	static TStr GetRuleFName(const TStr& DbPath) { return DbPath + "/rule_instances.bin"; }
 	static TStr GetBackupRuleFName(const TStr& DbPath) { return DbPath + "/rule_instances-backup.bin"; }
 	static TStr GetWaterLevelFNm(const TStr& DbPath) { return DbPath + "/water_level.bin"; }
@@ -33,42 +41,48 @@ public:
 	static void PrintItemSetV(const TVec<TPair<TFlt, TIntV>>& ItemSetSuppV, const PNotify& Notify);
 	static void PrintRuleCandV(const TVec<TPair<TFlt,TPair<TIntV,TInt>>>& RuleCandV, const PNotify& Notify);
 
-	// persist
+	// structure files
+	// a structure file starts with a header holding MAGIC, the format version,
+	// the length of the payload and its checksum
+	const static TStr STRUCT_MAGIC;
+	const static int STRUCT_VERSION;
+
+	// checksum of a buffer (FNV-1a)
+	static uint GetCs(const char* Bf, const int& BfL);
+	// writes the payload with a header into a temporary file and renames it
+	// to FNm, so FNm is replaced atomically, with Sync the data is on the
+	// disk before the rename
+	static void WriteStructFile(const TStr& FNm, const char* Bf, const int& BfL, const bool& Sync);
+	// returns a stream over the verified payload of a structure file, files
+	// without a header (the old format) are returned as they are, throws
+	// if the header or the checksum is invalid
+	static PSIn OpenStructFile(const TStr& FNm);
+
+	// persist, returns true if success, the backup file of the old format
+	// is removed once the structure is saved
 	template <class TStruct>
-	static void PersistStruct(const TStr& StructFNm, const TStr& StructBackupFNm, TStruct& Struct, const PNotify& Notify) {
+	static bool PersistStruct(const TStr& StructFNm, const TStr& StructBackupFNm, TStruct& Struct,
+			const PNotify& Notify, const bool& Sync=true) {
 		Notify->OnNotify(TNotifyType::ntInfo, "Persisting structure...");
 
 		try {
-			// remove the file and create a new file
-			if (TFile::Exists(StructFNm)) {
-				TFile::Del(StructFNm);
-			}
-
-			// save a new rule file
-			{
-				TFOut Out(StructFNm);
-				Struct.Save(Out);
-			}
+			TMOut Out;
+			Struct.Save(Out);
+			WriteStructFile(StructFNm, Out.GetBfAddr(), Out.Len(), Sync);
 
-			// the new file is created, now create a new backup file
-			// first remove the old backup file
 			if (TFile::Exists(StructBackupFNm)) {
 				TFile::Del(StructBackupFNm);
 			}
-
-			// save a new rule file
-			{
-				TFOut Out(StructBackupFNm);
-				Struct.Save(Out);
-			}
+			return true;
 		} catch (const PExcept& Except) {
 			Notify->OnNotify(TNotifyType::ntErr, "Failed to persist structure!");
 			Notify->OnNotify(TNotifyType::ntErr, Except->GetMsgStr());
+			return false;
 		}
 	}
 
 	// tries to load a structure from a file `StructFNm` or a backup file `StructBackupFNm`
-	// returns true if success
+	// of the old format, returns true if success
 	template <class TStruct>
 	static bool LoadStruct(const TStr& StructFNm, const TStr& StructBackupFNm, TStruct& Struct, const PNotify& Notify) {
 		Notify->OnNotify(TNotifyType::ntInfo, "Loading structure...");
@@ -78,22 +92,22 @@ public:
 
 			if (TFile::Exists(StructFNm)) {
 				try {
-					TFIn SIn(StructFNm);
-					Struct = TStruct(SIn);
+					PSIn SIn = OpenStructFile(StructFNm);
+					Struct = TStruct(*SIn);
 					Success = true;
 				} catch (const PExcept& Except) {
-					Notify->OnNotify(TNotifyType::ntErr, "TDataProvider::LoadWaterLevelV: An exception occurred while loading water levels!");
+					Notify->OnNotifyFmt(TNotifyType::ntErr, "An exception occurred while loading %s!", StructFNm.CStr());
 					Notify->OnNotify(TNotifyType::ntErr, Except->GetMsgStr());
 				}
 			}
 
 			if (!Success && TFile::Exists(StructBackupFNm)) {
 				try {
-					TFIn SIn(StructBackupFNm);
-					Struct = TStruct(SIn);
+					PSIn SIn = OpenStructFile(StructBackupFNm);
+					Struct = TStruct(*SIn);
 					Success = true;
 				} catch (const PExcept& Except) {
-					Notify->OnNotify(TNotifyType::ntErr, "TDataProvider::LoadWaterLevelV: An exception occurred while loading backup water levels!");
+					Notify->OnNotifyFmt(TNotifyType::ntErr, "An exception occurred while loading %s!", StructBackupFNm.CStr());
 					Notify->OnNotify(TNotifyType::ntErr, Except->GetMsgStr());
 				}
 			}
@@ -106,6 +120,45 @@ public:
 	}
 };
 
+/////////////////////////////////////////////////////////
+// Character view
+// a non-owning view into a character buffer, it is only valid
+// for as long as the underlying buffer is not modified
+class TChView {
+private:
+	const char* Bf;
+	int BfL;
+
+public:
+	TChView(): Bf(NULL), BfL(0) {}
+	TChView(const char* _Bf, const int& _BfL): Bf(_Bf), BfL(_BfL) {}
+	TChView(const TChA& ChA): Bf(ChA.CStr()), BfL(ChA.Len()) {}
+
+	const char* GetBf() const { return Bf; }
+	int Len() const { return BfL; }
+	bool Empty() const { return BfL == 0; }
+	void Clr() { Bf = NULL; BfL = 0; }
+
+	char operator [](const int& ChN) const { return Bf[ChN]; }
+	bool operator ==(const TChA& ChA) const { return IsEq(ChA.CStr(), ChA.Len()); }
+	bool operator ==(const char* CStr) const { return IsEq(CStr, (int) strlen(CStr)); }
+
+	// returns the index of the first Ch at or after BChN, -1 if there is none
+	int SearchCh(const char& Ch, const int& BChN=0) const;
+	// view of the characters [BChN, EChN)
+	TChView GetSubView(const int& BChN, const int& EChN) const { return TChView(Bf + BChN, EChN - BChN); }
+
+	// parses the view as a decimal integer, returns DefVal if the view is not a number
+	int GetInt(const int& DefVal=-1) const;
+	// parses the view as an unsigned decimal integer, returns false if the view is not a number
+	bool GetUInt64(uint64& Val) const;
+	// copies the view into a new string
+	TStr GetStr() const;
+
+private:
+	bool IsEq(const char* OthBf, const int& OthBfL) const { return BfL == OthBfL && memcmp(Bf, OthBf, BfL) == 0; }
+};
+
 enum TAdriaMsgMethod {
 	ammNone,
 	ammPush,
@@ -115,7 +168,18 @@ enum TAdriaMsgMethod {
 
 /////////////////////////////////////////////////////////
 // Adria Message class
-// parses the message from the input stream and holds it's content
+// holds the content of a message parsed by TAdriaMsgParser, the fields
+// are views into the parsers receive buffer and are only valid until
+// the parser is fed again, unless the message is made to own its bytes
+//
+// messages are framed either as text:
+//   <METHOD> <command>[?<params>][&<component id>]\r\n
+//   [Length=<n>\r\n<content>\r\n]
+// or, once negotiated, in the compact binary framing:
+//   <opcode><command id>[<varint len><command>][<varint len><params>]
+//   [<varint len><component id>][<varint len><content>]
+// the opcode has the highest bit set so both framings can be told
+// apart by the first byte of the frame
 class TAdriaMsg;
 typedef TPt<TAdriaMsg> PAdriaMsg;
 class TAdriaMsg{
@@ -123,6 +187,7 @@ private:
   TCRef CRef;
 public:
   friend class TPt<TAdriaMsg>;
+  friend class TAdriaMsgParser;
 public:
 	const static TChA POST;
 	const static TChA PUSH;
@@ -130,20 +195,33 @@ public:
 
 	const static TChA RES_TABLE;
 	const static TChA HISTORY;
+	const static TChA HISTORY_SUB;
+	const static TChA HISTORY_UNSUB;
 	const static TChA PREDICTION;
+	const static TChA STATS;
+	const static TChA RULES;
+	const static TChA FRAMING;
+	const static TChA FRAMING_BINARY;
 	const static int BYTES_PER_EL;
 
-private:
-	TChA Buff;
+	// binary framing
+	const static uchar BIN_FLAG;
+	const static uchar BIN_METHOD_MASK;
+	const static uchar BIN_HAS_PARAMS;
+	const static uchar BIN_HAS_COMPONENT_ID;
 
+private:
 	TAdriaMsgMethod Method;
-	TChA Command;
-	TChA Params;
-	TChA ComponentId;
+	TChView Command;
+	TChView Params;
+	TChView ComponentId;
 	TInt Length;
-	TChA Content;
+	TChView Content;
 
-	bool IsLastReadEol;
+	// the bytes of an owned message, kept when the message is recycled
+	TMem OwnBf;
+	uint64 ArrivalTm;
+	uint64 CaptureTm;
 
 	PNotify Notify;
 
@@ -158,20 +236,40 @@ public:
 	TStr GetStr() const;
 
 	bool IsComplete() const;
-	void Read(const PSIn& In);
+	void Clr();
+
+	// copies the fields out of the parsers buffer so the message can
+	// outlive the next read, call once after the message is parsed
+	void MakeOwned();
+
+	// arrival time in microseconds, see TUtils::GetCurrTimeMicros
+	void SetArrivalTm(const uint64& Tm) { ArrivalTm = Tm; }
+	uint64 GetArrivalTm() const { return ArrivalTm; }
+	// capture time in milliseconds of a replayed message, 0 for live traffic
+	void SetCaptureTm(const uint64& Tm) { CaptureTm = Tm; }
+	// the time the data in the message is stamped with, the capture
+	// time when the message is replayed and the current time otherwise
+	uint64 GetTmStamp() const { return CaptureTm > 0 ? CaptureTm : TUtils::GetCurrTimeStamp(); }
+
+	// encodes a message into Out using the text or the binary framing
+	static void Encode(const TAdriaMsgMethod& Method, const TChA& Command, const TChA& Params,
+			const TChA& ComponentId, const TChView& Content, const bool& Binary, TMem& Out);
+
+	// returns the binary framing ID of the command or 0 if the command doesn't have one
+	static int GetBinCommandId(const TChA& Command);
+	// returns the command with the given binary framing ID or NULL if the ID is unknown
+	static const TChA* GetBinCommand(const int& CommandId);
+
+	static void PutVarInt(const int& Val, TMem& Out);
 
 	bool IsPush() const { return IsMethod(TAdriaMsgMethod::ammPush); }
 	bool IsPost() const { return IsMethod(TAdriaMsgMethod::ammPost); }
 	bool IsGet() const { return IsMethod(TAdriaMsgMethod::ammGet); }
 
-	const TChA& GetCommand() const { return Command; }
-	const TChA& GetContent() const { return Content; }
-	const TChA& GetComponentId() const { return ComponentId; }
-	const TChA& GetParams() const { return Params; }
-
-private:
-	void ReadUntil(const PSIn& In, const TStr& EndStr, TChA& Out) const;
-	void ReadLine(const PSIn& In, TChA& Out) const;
+	const TChView& GetCommand() const { return Command; }
+	const TChView& GetContent() const { return Content; }
+	const TChView& GetComponentId() const { return ComponentId; }
+	const TChView& GetParams() const { return Params; }
 
 public:
 	bool HasMethod() const { return Method != TAdriaMsgMethod::ammNone; }
@@ -183,7 +281,442 @@ public:
 private:
 	bool IsMethod(const TAdriaMsgMethod& Mtd) const { return Method == Mtd; }
 
-	static bool BuffsEq(const char* Buff1, const char* Buff2, const int& BuffLen);
+	static void EncodeTxt(const TAdriaMsgMethod& Method, const TChA& Command, const TChA& Params,
+			const TChA& ComponentId, const TChView& Content, TMem& Out);
+	static void EncodeBin(const TAdriaMsgMethod& Method, const TChA& Command, const TChA& Params,
+			const TChA& ComponentId, const TChView& Content, TMem& Out);
+
+	static void CopyView(const TChView& View, TMem& Out);
+};
+
+/////////////////////////////////////////////////////////
+// Adria Message pool
+// a bounded pool of recycled messages, a message is only recycled
+// when nobody else holds a reference to it
+class TAdriaMsgPool {
+private:
+	const int MxFreeMsgs;
+	TVec<PAdriaMsg> FreeMsgV;
+
+	uint64 Hits;
+	uint64 Misses;
+	uint64 Drops;
+
+	TCriticalSection PoolSection;
+	PNotify Notify;
+
+public:
+	TAdriaMsgPool(const int& _MxFreeMsgs, const PNotify& _Notify=TStdNotify::New());
+
+	// returns a recycled message or allocates a new one if the pool is empty
+	PAdriaMsg Get();
+	// recycles the messages in MsgV and clears the vector
+	void Release(TVec<PAdriaMsg>& MsgV);
+
+	uint64 GetHits() const { return Hits; }
+	uint64 GetMisses() const { return Misses; }
+	uint64 GetDrops() const { return Drops; }
+
+	PJsonVal GetStatJson();
+};
+
+/////////////////////////////////////////////////////////
+// Adria Message parser
+// frames messages directly in the receive buffer, the state of a partially
+// received frame is kept between reads so frames can arrive in arbitrary chunks
+class TAdriaMsgParser {
+private:
+	enum TParseState {
+		apsHeader,
+		apsLength,
+		apsContent
+	};
+
+	const static int DEF_BUFF_LEN;
+	const static int MX_CONTENT_LEN;	// longer frames are rejected
+
+	char* Bf;
+	int BfL;
+	int MxBfL;
+
+	int FrameStartN;	// start of the frame currently being parsed
+	int ScanN;			// position from which the delimiter search is resumed
+	int LineStartN;		// start of the current line, relative to FrameStartN
+
+	// state of the current frame, offsets are relative to FrameStartN
+	TParseState State;
+	TAdriaMsgMethod Method;
+	const TChA* BinCommand;		// command of a binary frame with a command ID
+	int CommandB, CommandE;
+	int ParamsB, ParamsE;
+	int ComponentIdB, ComponentIdE;
+	int ContentB;
+	int Length;
+
+	PNotify Notify;
+
+public:
+	TAdriaMsgParser(const PNotify& _Notify=TStdNotify::New());
+	~TAdriaMsgParser() { delete[] Bf; }
+
+	// appends a chunk to the receive buffer, invalidates all the
+	// messages returned by Next so far
+	void Feed(const PSIn& SIn);
+	void Feed(const char* ChunkBf, const int& ChunkBfL);
+	// parses the next complete frame into Msg, returns false if
+	// the buffer does not contain a complete frame
+	bool Next(TAdriaMsg& Msg);
+
+	// number of buffered bytes which were not yet consumed by a complete frame
+	int GetPendingLen() const { return BfL - FrameStartN; }
+	void Clr();
+
+private:
+	TAdriaMsgParser(const TAdriaMsgParser&);
+	TAdriaMsgParser& operator =(const TAdriaMsgParser&);
+
+	// makes room for ChunkBfL more bytes at the end of the buffer
+	void Reserve(const int& ChunkBfL);
+	// finds the next line, returns false if the line is not yet complete
+	bool FindLine(int& LineB, int& LineE);
+	void ParseHeader(const int& LineB, const int& LineE);
+	void ParseLength(const int& LineB, const int& LineE);
+	// parses a binary frame, returns false if the frame is not yet complete
+	bool ParseBin();
+	// reads a length prefixed field of a binary frame
+	bool ReadBinField(int& ChN, int& FieldB, int& FieldE);
+	bool ReadVarInt(int& ChN, int& Val);
+	void FillMsg(TAdriaMsg& Msg) const;
+	// skips the current (invalid) frame and throws an exception
+	void SkipFrame(const TStr& MsgStr, const int& LineB, const int& LineE);
+
+	static bool IsPrefix(const char* LineBf, const int& LineBfL, const TChA& Prefix);
+	static int SearchCh(const char* LineBf, const int& B, const int& E, const char& Ch);
+};
+
+/////////////////////////////////////////////////////////
+// Single producer single consumer queue
+// a bounded lock-free ring, exactly one thread may push and exactly
+// one other thread may pop
+template <class TVal>
+class TSpscQueue {
+private:
+	TVec<TVal> SlotV;
+	int Mask;
+
+	std::atomic<int> HeadN;		// next slot to pop, written by the consumer
+	std::atomic<int> TailN;		// next slot to push, written by the producer
+
+public:
+	// the capacity is rounded up to a power of 2
+	TSpscQueue(const int& Cap);
+
+	// moves Val into the queue and clears it, returns false if the queue is full
+	bool Push(TVal& Val);
+	// moves the oldest value into Val, returns false if the queue is empty
+	bool Pop(TVal& Val);
+
+	int Len() const { return (TailN.load() - HeadN.load()) & Mask; }
+	bool Empty() const { return HeadN.load() == TailN.load(); }
+	int GetCap() const { return Mask; }
+};
+
+template <class TVal>
+TSpscQueue<TVal>::TSpscQueue(const int& Cap):
+		SlotV(),
+		Mask(0),
+		HeadN(0),
+		TailN(0) {
+
+	// one slot is kept empty to tell a full queue from an empty one
+	int Slots = 2;
+	while (Slots < Cap + 1) { Slots *= 2; }
+
+	SlotV.Gen(Slots);
+	Mask = Slots - 1;
+}
+
+template <class TVal>
+bool TSpscQueue<TVal>::Push(TVal& Val) {
+	const int CurrTailN = TailN.load(std::memory_order_relaxed);
+	const int NextTailN = (CurrTailN + 1) & Mask;
+
+	if (NextTailN == HeadN.load(std::memory_order_acquire)) { return false; }
+
+	// the producer is done with the value before the slot is published
+	SlotV[CurrTailN] = Val;
+	Val = TVal();
+
+	TailN.store(NextTailN, std::memory_order_release);
+	return true;
+}
+
+template <class TVal>
+bool TSpscQueue<TVal>::Pop(TVal& Val) {
+	const int CurrHeadN = HeadN.load(std::memory_order_relaxed);
+
+	if (CurrHeadN == TailN.load(std::memory_order_acquire)) { return false; }
+
+	Val = SlotV[CurrHeadN];
+	SlotV[CurrHeadN] = TVal();
+
+	HeadN.store((CurrHeadN + 1) & Mask, std::memory_order_release);
+	return true;
+}
+
+/////////////////////////////////////////////////////////
+// Adria send queue
+// a ring of encoded frames waiting to be sent, the frames are coalesced
+// into a single buffer when the queue is flushed. The frames stay queued
+// until they are handed to the socket, each remembers its framing so the
+// binary ones can be held back while the framing is negotiated
+class TAdriaSendQueue {
+private:
+	const static uint64 RATE_WINDOW_MSECS;
+
+	TVec<TMem> FrameV;
+	TBoolV BinaryV;
+	int HeadN;
+	int NFrames;
+	int NBinary;
+
+	uint64 QueuedBytes;
+	const uint64 HighWaterBytes;
+
+	// statistics
+	uint64 MxQueuedBytes;
+	uint64 Enqueued;
+	uint64 Rejected;
+	uint64 Flushes;
+	uint64 SentBytes;
+
+	uint64 RateStartTm;
+	uint64 RateBytes;
+	double BytesPerSec;
+
+	TCriticalSection QueueSection;
+
+public:
+	TAdriaSendQueue(const uint64& _HighWaterBytes, const int& InitFrames=64);
+
+	// appends a copy of the frame, returns false if the queue is above
+	// the high water mark and the frame was rejected
+	bool Push(const TMem& Frame, const bool& IsBinary=false);
+	// appends copies of the queued frames to Out until it holds at least
+	// MxBytes, stops at the first binary frame if TextOnly is set, returns
+	// the number of frames copied, they stay in the queue
+	int Peek(TMem& Out, const int& MxBytes, const bool& TextOnly=false);
+	// removes the first NSent frames which were handed to the socket
+	void OnSent(const int& NSent, const int& Bytes);
+	// removes the binary frames, returns how many were removed
+	int DelBinary();
+	void Clr();
+
+	bool Empty();
+	int GetFrames();
+	int GetBinaryFrames();
+	uint64 GetBytes();
+
+	PJsonVal GetStatJson();
+
+private:
+	void Grow();
+	void UpdateRate(const uint64& CurrTm);
+};
+
+/////////////////////////////////////////////////////////
+// Adria traffic capture
+// a capture file holds the raw inbound byte stream as it arrived from the
+// bus, a sequence of chunks each prefixed by its arrival time in milliseconds
+// and its length
+class TAdriaCapture {
+public:
+	const static TStr MAGIC;
+
+	// reads Len bytes from SIn into Out, reusing the memory of Out
+	static void ReadBf(const PSIn& SIn, const int& Len, TMem& Out);
+};
+
+class TAdriaCaptureWriter;
+typedef TPt<TAdriaCaptureWriter> PAdriaCaptureWriter;
+class TAdriaCaptureWriter {
+private:
+  TCRef CRef;
+public:
+  friend class TPt<TAdriaCaptureWriter>;
+private:
+	const static uint64 FLUSH_INTERVAL_MSECS;
+
+	PSOut SOut;
+	uint64 LastFlushTm;
+
+	uint64 Chunks;
+	uint64 Bytes;
+
+	TCriticalSection CaptureSection;
+
+public:
+	TAdriaCaptureWriter(const TStr& FNm);
+	static PAdriaCaptureWriter New(const TStr& FNm) { return new TAdriaCaptureWriter(FNm); }
+
+	~TAdriaCaptureWriter() { Flush(); }
+
+	// reads the whole chunk from SIn into ChunkBf and appends it to the capture
+	void Write(const PSIn& SIn, TMem& ChunkBf);
+	void Write(const uint64& Tm, const char* Bf, const int& BfL);
+	void Flush();
+
+	PJsonVal GetStatJson();
+};
+
+class TAdriaCaptureReader {
+private:
+	PSIn SIn;
+	bool Torn;
+
+public:
+	TAdriaCaptureReader(const TStr& FNm);
+
+	// reads the next chunk, returns false at the end of the capture or at
+	// a chunk cut off by a crash
+	bool Next(uint64& Tm, TMem& ChunkBf);
+	// true if the capture ended with an incomplete chunk
+	bool IsTorn() const { return Torn; }
+};
+
+/////////////////////////////////////////////////////////
+// Readings log
+// logs every reading, the readings are collected in memory and written
+// with one call once enough of them are buffered or the oldest one is a
+// second old, a full or a day old log is renamed to <file>.<time> and a
+// new one is started
+enum TReadingsLogFormat {
+	rlfTxt,		// time,CAN ID,value lines
+	rlfBin		// MAGIC followed by uint64 time, uchar CAN ID and float32 value, little endian
+};
+
+class TAdriaReadingsLog;
+typedef TPt<TAdriaReadingsLog> PAdriaReadingsLog;
+class TAdriaReadingsLog {
+private:
+  TCRef CRef;
+public:
+  friend class TPt<TAdriaReadingsLog>;
+public:
+	const static TStr MAGIC;
+
+	// returns false if there is no format with the name
+	static bool GetFormat(const TStr& FormatNm, TReadingsLogFormat& Format);
+
+private:
+	const static int FLUSH_BYTES;
+	const static uint64 FLUSH_INTERVAL_MSECS;
+	const static uint64 MX_FILE_BYTES;
+	const static uint64 MX_FILE_AGE_MSECS;
+
+	const TStr FNm;
+	const TReadingsLogFormat Format;
+
+	TChA Bf;					// readings which weren't written yet
+	TChA WriteBf;				// readings being written, swapped with Bf
+	PSOut SOut;
+	uint64 FileBytes;
+	uint64 FileStartTm;
+	uint64 LastFlushTm;
+
+	uint64 LastSec;				// the text time of the last reading is reused within a second
+	TStr LastTmStr;
+
+	uint64 Recs;
+	uint64 Flushes;
+	uint64 Rotations;
+
+	TCriticalSection LogSection;	// guards Bf and the statistics
+	TCriticalSection WriteSection;	// guards the file, taken before LogSection
+
+public:
+	// an existing log is rotated, so every run starts a new file
+	TAdriaReadingsLog(const TStr& FNm, const TReadingsLogFormat& Format);
+	static PAdriaReadingsLog New(const TStr& FNm, const TReadingsLogFormat& Format) { return new TAdriaReadingsLog(FNm, Format); }
+
+	~TAdriaReadingsLog() { Flush(); }
+
+	// buffers a reading, never writes so it can be called under other locks
+	void Add(const uint64& Tm, const int& CanId, const double& Val);
+	// writes the buffered readings
+	void Flush();
+	// writes the buffered readings if there are enough of them or the
+	// oldest one waited long enough
+	void FlushIfDue();
+
+	PJsonVal GetStatJson();
+
+private:
+	void Write();
+	// called under WriteSection
+	void Rotate();
+	void Open();
+};
+
+/////////////////////////////////////////////////////////
+// Write-ahead log
+// an append-only log of state changes, every record holds its type, the
+// length of its payload, the payload and its checksum (TUtils::GetCs), so
+// a record torn by a crash is recognized when the log is read back
+class TAdriaWal;
+typedef TPt<TAdriaWal> PAdriaWal;
+class TAdriaWal {
+private:
+  TCRef CRef;
+public:
+  friend class TPt<TAdriaWal>;
+public:
+	const static TStr MAGIC;
+
+private:
+	const TStr FNm;
+	PSOut SOut;
+
+	uint64 Recs;				// records since the last rotation
+	uint64 Bytes;
+	uint64 Rotations;
+
+	TCriticalSection WalSection;
+
+public:
+	// starts a new log, when Append is set the records of an existing log are kept
+	TAdriaWal(const TStr& FNm, const bool& Append=false);
+	static PAdriaWal New(const TStr& FNm, const bool& Append=false) { return new TAdriaWal(FNm, Append); }
+
+	// appends a record and flushes it to the file
+	void Write(const uchar& Type, const char* Bf, const int& BfL);
+	void Write(const uchar& Type, const TMOut& RecOut) { Write(Type, RecOut.GetBfAddr(), RecOut.Len()); }
+	// moves the records to the log PrevFNm and starts a new log, the records
+	// are appended if PrevFNm exists
+	void Rotate(const TStr& PrevFNm);
+	// moves the intact records of the log FNm to the end of the log PrevFNm,
+	// PrevFNm is created if it doesn't exist
+	static void MoveRecs(const TStr& FNm, const TStr& PrevFNm);
+
+	PJsonVal GetStatJson();
+
+private:
+	void Open(const bool& Append);
+};
+
+class TAdriaWalReader {
+private:
+	PSIn SIn;
+	bool Torn;
+
+public:
+	TAdriaWalReader(const TStr& FNm);
+
+	// reads the next record, returns false at the end of the log or at
+	// the first record which is incomplete or fails its checksum
+	bool Next(uchar& Type, TMem& RecBf);
+	// true if reading stopped at a damaged record or the header is damaged
+	bool IsTorn() const { return Torn; }
 };
 
 }